@@ -0,0 +1,130 @@
+/* Asynchronous trie operations.  See async.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "async.h"
+
+/* Finished operations, waiting for the thread that submitted them */
+struct async_completions {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct trie_op *head;
+};
+
+static int started = 0;
+static pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submit_cond = PTHREAD_COND_INITIALIZER;
+static struct trie_op *submit_head = NULL, *submit_tail = NULL;
+static __thread struct async_completions *my_completions = NULL;
+
+static void _async_run (struct trie_op *op) {
+    switch (op->op) {
+        case TRIE_OP_LOOKUP:
+            op->res = lookup(op->name, op->strlen, &op->ip4_address);
+            break;
+        case TRIE_OP_INSERT:
+            op->res = insert_ttl(op->name, op->strlen, op->ip4_address, op->ttl);
+            break;
+        case TRIE_OP_INSERT_NEGATIVE:
+            op->res = insert_negative(op->name, op->strlen);
+            break;
+        case TRIE_OP_UPDATE:
+            op->res = update(op->name, op->strlen, op->ip4_address);
+            break;
+        case TRIE_OP_DELETE:
+            op->res = delete(op->name, op->strlen);
+            break;
+        case TRIE_OP_UPSERT:
+            op->res = upsert(op->name, op->strlen, op->ip4_address, op->ttl);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static void * _async_worker (void *arg) {
+    while (1) {
+        struct trie_op *op;
+
+        pthread_mutex_lock(&submit_mutex);
+        while (!submit_head)
+            pthread_cond_wait(&submit_cond, &submit_mutex);
+        op = submit_head;
+        submit_head = op->next;
+        if (!submit_head)
+            submit_tail = NULL;
+        pthread_mutex_unlock(&submit_mutex);
+
+        _async_run(op);
+
+        struct async_completions *owner = op->owner;
+        pthread_mutex_lock(&owner->mutex);
+        op->next = owner->head;
+        owner->head = op;
+        pthread_cond_signal(&owner->cond);
+        pthread_mutex_unlock(&owner->mutex);
+    }
+    return NULL;
+}
+
+void async_init (int workers) {
+    int i;
+
+    if (__sync_lock_test_and_set(&started, 1))
+        return;
+    for (i = 0; i < workers; i++) {
+        pthread_t worker;
+        int err = pthread_create(&worker, NULL, &_async_worker, NULL);
+        if (err)
+            printf("Failed to start async worker: %d\n", err);
+        else
+            pthread_detach(worker);
+    }
+}
+
+/* This thread's completion list, made on first use.  It is never
+ * freed, since a worker may still be about to use it.
+ */
+static struct async_completions * _async_completions () {
+    if (!my_completions) {
+        my_completions = malloc(sizeof(struct async_completions));
+        assert(my_completions);
+        pthread_mutex_init(&my_completions->mutex, NULL);
+        pthread_cond_init(&my_completions->cond, NULL);
+        my_completions->head = NULL;
+    }
+    return my_completions;
+}
+
+void trie_submit (struct trie_op *op) {
+    op->owner = _async_completions();
+    op->next = NULL;
+
+    pthread_mutex_lock(&submit_mutex);
+    if (submit_tail)
+        submit_tail->next = op;
+    else
+        submit_head = op;
+    submit_tail = op;
+    pthread_cond_signal(&submit_cond);
+    pthread_mutex_unlock(&submit_mutex);
+}
+
+int trie_poll (struct trie_op **completions, int max, int wait) {
+    struct async_completions *mine = _async_completions();
+    int i, count = 0;
+
+    pthread_mutex_lock(&mine->mutex);
+    while (wait && !mine->head)
+        pthread_cond_wait(&mine->cond, &mine->mutex);
+    while (count < max && mine->head) {
+        completions[count++] = mine->head;
+        mine->head = mine->head->next;
+    }
+    pthread_mutex_unlock(&mine->mutex);
+
+    for (i = 0; i < count; i++)
+        if (completions[i]->done)
+            completions[i]->done(completions[i], completions[i]->arg);
+    return count;
+}
@@ -0,0 +1,56 @@
+#ifndef __ASYNC_H__
+#define __ASYNC_H__
+
+#include <pthread.h>
+#include "trie.h"
+
+/* Asynchronous trie operations.  A caller submits operations and
+ * carries on; a pool of worker threads runs them with the ordinary
+ * (blocking) trie.h calls, so a worker, not the caller, is the one to
+ * stall on a lock.  Each finished operation goes back to the thread
+ * that submitted it, which collects it with trie_poll.  Operations
+ * from one thread may run in any order, and at the same time.
+ *
+ * This works with any variant that is safe with more than one thread.
+ */
+
+/* What a struct trie_op does */
+#define TRIE_OP_LOOKUP          1 /* res is lookup's, ip4_address its address */
+#define TRIE_OP_INSERT          2 /* insert_ttl */
+#define TRIE_OP_INSERT_NEGATIVE 3
+#define TRIE_OP_UPDATE          4
+#define TRIE_OP_DELETE          5
+#define TRIE_OP_UPSERT          6 /* upsert, with ttl */
+
+struct async_completions;
+
+struct trie_op {
+    int op; /* TRIE_OP_* */
+    char name[MAX_KEY]; /* A copy, so the caller's buffer can be reused */
+    size_t strlen;
+    int32_t ip4_address; /* To store, or the address found */
+    uint32_t ttl;
+    int res; /* The call's return value, once it is done */
+    /* Optional; called by trie_poll, in the submitting thread */
+    void (*done) (struct trie_op *op, void *arg);
+    void *arg;
+    /* Private */
+    struct trie_op *next;
+    struct async_completions *owner;
+};
+
+/* Start a pool of worker threads to run operations.  Only the first call
+ * does anything.
+ */
+void async_init (int workers);
+
+/* Queue op.  It belongs to the pool until trie_poll hands it back. */
+void trie_submit (struct trie_op *op);
+
+/* Hand back up to max of this thread's finished operations in
+ * completions, after calling their done callbacks, and return how
+ * many.  If wait is set and none have finished, wait for one.
+ */
+int trie_poll (struct trie_op **completions, int max, int wait);
+
+#endif /* __ASYNC_H__ */
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Compare the throughput of trie variants as the client count grows.
+#
+# Usage: ./bench.sh [max threads] [seconds per run] [search percent] [variants...]
+# e.g.   ./bench.sh 8 5 90 dns-rw dns-rw-brlock dns-rw-pf
+
+MAX=${1:-$(nproc)}
+LEN=${2:-5}
+READS=${3:-90}
+shift $(( $# < 3 ? $# : 3 ))
+VARIANTS=${@:-dns-rw dns-rw-brlock dns-rw-pf}
+
+make -s $VARIANTS || exit 1
+
+printf "%-8s" threads
+for v in $VARIANTS; do printf "%16s" $v; done
+printf "\n"
+
+t=1
+while [ $t -le $MAX ]; do
+    printf "%-8s" $t
+    for v in $VARIANTS; do
+        ops=$(./$v -c $t -l $LEN -r $READS | awk '/per second/ { print $(NF-2) }')
+        printf "%16s" $ops
+    done
+    printf "\n"
+    if [ $t -lt $MAX ] && [ $((t * 2)) -gt $MAX ]; then t=$MAX; else t=$((t * 2)); fi
+done
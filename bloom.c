@@ -0,0 +1,85 @@
+/* Counting Bloom filter.  See bloom.h. */
+
+#include <assert.h>
+#include <string.h>
+#include "bloom.h"
+
+static int next_slot = 0;
+static __thread int my_slot = -1;
+
+/* This thread's statistics slot, handed out round-robin on first use */
+static struct bloom_slot * _bloom_slot (struct bloom *filter) {
+    if (my_slot < 0)
+        my_slot = __sync_fetch_and_add(&next_slot, 1) % BLOOM_SLOTS;
+    return &filter->slots[my_slot];
+}
+
+/* 64-bit FNV-1a */
+uint64_t bloom_hash (const char *string, size_t strlen) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+    for (i = 0; i < strlen; i++) {
+        hash ^= (unsigned char) string[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* The i'th counter for a hash, by double hashing */
+static unsigned char * _bloom_counter (struct bloom *filter, uint64_t hash, int i) {
+    uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+    return &filter->counters[(h1 + i * h2) & (BLOOM_COUNTERS - 1)];
+}
+
+void bloom_init (struct bloom *filter) {
+    memset(filter, 0, sizeof(struct bloom));
+}
+
+void bloom_add (struct bloom *filter, uint64_t hash) {
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        unsigned char *counter = _bloom_counter(filter, hash, i);
+        unsigned char old;
+        do {
+            old = *counter;
+        } while (old != BLOOM_MAX && !__sync_bool_compare_and_swap(counter, old, old + 1));
+    }
+}
+
+void bloom_remove (struct bloom *filter, uint64_t hash) {
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        unsigned char *counter = _bloom_counter(filter, hash, i);
+        unsigned char old;
+        do {
+            old = *counter;
+            assert(old > 0);
+        } while (old != BLOOM_MAX && !__sync_bool_compare_and_swap(counter, old, old - 1));
+    }
+}
+
+int bloom_maybe (struct bloom *filter, uint64_t hash) {
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        if (*(volatile unsigned char *) _bloom_counter(filter, hash, i) == 0) {
+            __sync_fetch_and_add(&_bloom_slot(filter)->rejected, 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_false_positive (struct bloom *filter) {
+    __sync_fetch_and_add(&_bloom_slot(filter)->false_positives, 1);
+}
+
+double bloom_false_positive_rate (struct bloom *filter) {
+    unsigned long rejected = 0, false_positives = 0, absent;
+    int i;
+    for (i = 0; i < BLOOM_SLOTS; i++) {
+        rejected += filter->slots[i].rejected;
+        false_positives += filter->slots[i].false_positives;
+    }
+    absent = rejected + false_positives;
+    return absent ? (double) false_positives / absent : 0.0;
+}
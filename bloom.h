@@ -0,0 +1,55 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "locks.h"
+
+/* A counting Bloom filter over the names a trie holds, so lookups can
+ * reject most absent names without taking any trie lock.  Counters
+ * are updated atomically, so it is safe from any thread.  Counting
+ * (rather than single bits) lets removals keep it tight as names are
+ * deleted and evicted; a counter that saturates just stays put, which
+ * can only cost false positives, never false negatives.
+ *
+ * Names are hashed once; tries keep the hash in the node so they can
+ * remove a name without knowing it.
+ */
+
+#define BLOOM_BITS 16
+#define BLOOM_COUNTERS (1 << BLOOM_BITS)
+#define BLOOM_HASHES 4
+#define BLOOM_MAX 255
+
+/* Statistics are counted per thread, each slot on its own cache line,
+ * so lookups don't all write one shared word; threads beyond
+ * BLOOM_SLOTS share slots.  bloom_false_positive_rate adds them up.
+ */
+#define BLOOM_SLOTS 64
+
+struct bloom_slot {
+    unsigned long rejected; /* Lookups answered "absent" */
+    unsigned long false_positives; /* "Maybe" answers that missed anyway */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct bloom {
+    unsigned char counters[BLOOM_COUNTERS];
+    struct bloom_slot slots[BLOOM_SLOTS];
+};
+
+uint64_t bloom_hash (const char *string, size_t strlen);
+
+void bloom_init (struct bloom *filter);
+void bloom_add (struct bloom *filter, uint64_t hash);
+void bloom_remove (struct bloom *filter, uint64_t hash);
+
+/* Return 0 if the name is certainly absent, 1 if it may be present. */
+int bloom_maybe (struct bloom *filter, uint64_t hash);
+
+/* Report that a "maybe" turned out to be a miss. */
+void bloom_false_positive (struct bloom *filter);
+
+/* Fraction of absent names that got past the filter */
+double bloom_false_positive_rate (struct bloom *filter);
+
+#endif /* __BLOOM_H__ */
@@ -0,0 +1,1408 @@
+/* A (reverse) trie kept as a series of immutable versions.  A writer
+ * copies each node on the path it changes (path copying), so the new
+ * version shares every other node with the old one, and then publishes
+ * it by swapping one pointer.  Readers only lock long enough to pin
+ * the version that is current when they start, and read it while
+ * writers go on; a snapshot (snapshot.h) is just a version pinned for
+ * longer.  Each node counts the versions and nodes that point to it,
+ * and is freed when the last of them goes.  Writers take turns.
+ *
+ * The hash index (-x) is not used: readers would need an index of
+ * their own version, so lookups always walk the tree.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "trie.h"
+#include "expiry.h"
+#include "cursor.h"
+#include "bloom.h"
+#include "lookupcache.h"
+#include "locks.h"
+#include "snapshot.h"
+#include "zone.h"
+#include "async.h"
+#include "waitq.h"
+
+struct trie_node {
+    struct trie_node *next;  /* parent list */
+    unsigned int strlen; /* Length of the key */
+    volatile int refs; /* Versions and nodes pointing here */
+    struct rrset records; /* The name's records, if present */
+    unsigned char present; /* Does this node hold a value? */
+    uint32_t expires; /* Tick when the value or negative entry expires, 0 = never */
+    unsigned char negative; /* A cached "known absent" entry rather than a value */
+    unsigned char filtered; /* Counted in the filter, if it is on */
+    uint64_t filter_hash; /* Of the full name, to remove it from the filter */
+    struct trie_node *children; /* Sorted list of children */
+    char key[MAX_KEY]; /* Up to MAX_KEY chars */
+};
+
+/* A published tree.  Nothing in it changes until it is freed. */
+struct version {
+    struct trie_node *tree;
+    int nodes;
+    volatile int refs; /* 1 while current, plus 1 per reader or snapshot */
+};
+
+struct trie_snapshot {
+    struct version *version;
+    uint32_t now; /* Tick it was taken at, so nothing in it expires */
+};
+
+/* What _insert stores at a name */
+struct new_value {
+    const struct record *record; /* Record to add, NULL for a negative entry */
+    uint32_t expires; /* Tick when it expires, 0 = never */
+    int negative; /* Store a negative entry instead of a record */
+    int append; /* Add to a live record set, rather than failing */
+    const char *name; /* The full name, for the filter */
+    size_t name_len;
+    int replace; /* Overwrite a live value too (upsert) */
+};
+
+/* Best match so far in search_longest_suffix */
+struct suffix_match {
+    int found;
+    size_t rest; /* Length of the string in front of the match */
+    int32_t ip4_address;
+};
+
+static struct version *current = NULL;  //What new readers get
+static struct wordlock version_lock;  //Covers current, and pinning it
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* A tree being written: the next version, under write_mutex, or a
+ * zone that reload is building off to the side.  Each thread works on
+ * the one draft points to.
+ */
+struct draft {
+    struct trie_node *root;
+    int node_count;
+    int negative_count;
+    int changed; /* A value changed, so lookup caches are stale */
+    uint64_t *unfilter; /* Hashes of names emptied, for after publishing */
+    int unfilter_count, unfilter_size;
+};
+static struct draft next = { NULL, 0, 0, 0, NULL, 0, 0 };
+static __thread struct draft *draft = &next;
+
+#define root (draft->root)
+#define node_count (draft->node_count)
+#define negative_count (draft->negative_count)
+#define changed (draft->changed)
+
+/* The rest is the writer's, under write_mutex, but for the filter and
+ * the wheel, which have their own locks.
+ */
+static int max_count = 100;  //Try to stay under 100 nodes
+static struct expiry_wheel wheel;
+static int max_negative = 20;  //Negative entries get their own, smaller budget
+static uint32_t negative_ttl = 5;  //Seconds
+static struct expiry_queue negative_queue;
+static struct expiry_queue prune_queue;  //Names of tombstones awaiting compact()
+static struct bloom filter;
+extern int use_filter;
+extern int use_cache;
+static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
+extern int separate_delete_thread;
+
+void set_value (struct trie_node *node, const struct new_value *value);
+
+/* Readers of the current version may still find a name this draft has
+ * emptied, so it only leaves the filter once the draft is published.
+ * Names go in as soon as they are stored, which can only cost a false
+ * positive in the meantime.
+ */
+void defer_unfilter (uint64_t hash) {
+    if (draft->unfilter_count == draft->unfilter_size) {
+        draft->unfilter_size = draft->unfilter_size ? 2 * draft->unfilter_size : 16;
+        draft->unfilter = realloc(draft->unfilter, draft->unfilter_size * sizeof(uint64_t));
+        assert(draft->unfilter);
+    }
+    draft->unfilter[draft->unfilter_count++] = hash;
+}
+
+/* Take the names a draft emptied out of the filter */
+void apply_unfilter (struct draft *written) {
+    int i;
+    for (i = 0; i < written->unfilter_count; i++)
+        bloom_remove(&filter, written->unfilter[i]);
+    written->unfilter_count = 0;
+}
+
+struct trie_node * new_leaf (const char *string, size_t strlen, const struct new_value *value) {
+    struct trie_node *new_node = malloc(sizeof(struct trie_node));
+    node_count++;
+    if (!new_node) {
+        printf ("WARNING: Node memory allocation failed.  Results may be bogus.\n");
+        return NULL;
+    }
+    assert(strlen < MAX_KEY);
+    assert(strlen > 0);
+    new_node->next = NULL;
+    new_node->strlen = strlen;
+    new_node->refs = 1;
+    strncpy(new_node->key, string, strlen);
+    new_node->key[strlen] = '\0';
+    rrset_init(&new_node->records);
+    new_node->filtered = 0;
+    new_node->present = 0;
+    new_node->expires = 0;
+    new_node->negative = 0;
+    new_node->children = NULL;
+    if (value)
+        set_value(new_node, value);
+
+    return new_node;
+}
+
+void node_get (struct trie_node *node) {
+    if (node)
+        __sync_fetch_and_add(&node->refs, 1);
+}
+
+/* Drop a reference to node, freeing it, and in turn dropping its
+ * references, if it was the last.
+ */
+void node_put (struct trie_node *node) {
+    while (node && __sync_sub_and_fetch(&node->refs, 1) == 0) {
+        struct trie_node *next = node->next;
+        node_put(node->children);
+        rrset_clear(&node->records);
+        free(node);
+        node = next;
+    }
+}
+
+/* Make the node at *link the writer's own, copying it if a version
+ * still uses it.  The writer must own the node (or root) that holds
+ * link.  Returns the node now at *link.
+ */
+struct trie_node * private_node (struct trie_node **link) {
+    struct trie_node *node = *link, *copy;
+    int i;
+
+    // Only the writer can add references, so one means it is ours
+    if (node->refs == 1)
+        return node;
+
+    copy = malloc(sizeof(struct trie_node));
+    assert(copy);
+    *copy = *node;
+    copy->refs = 1;
+    rrset_init(&copy->records);
+    for (i = 0; i < node->records.count; i++)
+        rrset_add(&copy->records, rrset_get(&node->records, i));
+    node_get(copy->next);
+    node_get(copy->children);
+
+    *link = copy;
+    node_put(node);
+    return copy;
+}
+
+/* Does this node hold a value that has not expired by tick now? */
+int live_value (struct trie_node *node, uint32_t now) {
+    return node->present && (node->expires == 0 || node->expires > now);
+}
+
+/* Does this node hold nothing at all, not even a negative entry? */
+int empty_node (struct trie_node *node) {
+    return !node->present && !node->negative;
+}
+
+/* Store a record or a negative entry, or clear the node if value
+ * is NULL, keeping negative_count in step.  The node must be the
+ * writer's own.
+ */
+void set_value (struct trie_node *node, const struct new_value *value) {
+    int negative = value && value->negative;
+
+    negative_count += negative - node->negative;
+    node->negative = negative;
+
+    // Appending to a live set keeps its records and its TTL
+    if (!value || !value->append || !live_value(node, expiry_now())) {
+        rrset_clear(&node->records);
+        node->expires = value ? value->expires : 0;
+    }
+    if (value && value->record)
+        rrset_add(&node->records, value->record);
+    node->present = (node->records.count > 0);
+
+    if (use_filter) {
+        if (!empty_node(node) && !node->filtered) {
+            node->filter_hash = bloom_hash(value->name, value->name_len);
+            bloom_add(&filter, node->filter_hash);
+            node->filtered = 1;
+        } else if (empty_node(node) && node->filtered) {
+            defer_unfilter(node->filter_hash);
+            node->filtered = 0;
+        }
+    }
+    changed = 1;
+}
+
+/* Would _delete remove what this node holds? */
+int deletable (struct trie_node *node, uint32_t expired_by, int negative) {
+    if (negative ? !node->negative : !node->present)
+        return 0;
+    return !expired_by || (node->expires && node->expires <= expired_by);
+}
+
+// Compare strings backward.  Unlike strncmp, we assume
+// that we will not stop at a null termination, only after
+// n chars (or a difference).  Base code borrowed from musl
+int reverse_strncmp(const char *left, const char *right, size_t n)
+{
+    const unsigned char *l= (const unsigned char *) &left[n-1];
+    const unsigned char *r= (const unsigned char *) &right[n-1];
+    if (!n--) return 0;
+    for (; *l && *r && n && *l == *r ; l--, r--, n--);
+    return *l - *r;
+}
+
+int compare_keys (const char *string1, int len1, const char *string2, int len2, int *pKeylen) {
+    int keylen, offset;
+    char scratch[MAX_KEY];
+    assert (len1 > 0);
+    assert (len2 > 0);
+    // Take the max of the two keys, treating the front as if it were
+    // filled with spaces, just to ensure a total order on keys.
+    if (len1 < len2) {
+        keylen = len2;
+        offset = keylen - len1;
+        memset(scratch, ' ', offset);
+        memcpy(&scratch[offset], string1, len1);
+        string1 = scratch;
+    } else if (len2 < len1) {
+        keylen = len1;
+        offset = keylen - len2;
+        memset(scratch, ' ', offset);
+        memcpy(&scratch[offset], string2, len2);
+        string2 = scratch;
+    } else
+        keylen = len1; // == len2
+
+    assert (keylen > 0);
+    if (pKeylen)
+        *pKeylen = keylen;
+    return reverse_strncmp(string1, string2, keylen);
+}
+
+int compare_keys_substring (const char *string1, int len1, const char *string2, int len2, int *pKeylen) {
+    int keylen, offset1, offset2;
+    keylen = len1 < len2 ? len1 : len2;
+    offset1 = len1 - keylen;
+    offset2 = len2 - keylen;
+    assert (keylen > 0);
+    if (pKeylen)
+        *pKeylen = keylen;
+    return reverse_strncmp(&string1[offset1], &string2[offset2], keylen);
+}
+
+
+void init(int numthreads) {
+    wordlock_init(&version_lock);
+    current = calloc(1, sizeof(struct version));
+    assert(current);
+    current->refs = 1;
+    root = NULL;
+    expiry_init(&wheel);
+    expiry_queue_init(&negative_queue);
+    expiry_queue_init(&prune_queue);
+    bloom_init(&filter);
+}
+
+void shutdown_delete_thread() {
+    if (separate_delete_thread) {
+        pthread_mutex_lock(&delete_mutex);
+        pthread_cond_signal(&delete_cond);
+        pthread_mutex_unlock(&delete_mutex);
+    }
+    return;
+}
+
+/* Pin the current version, so that nothing in it is freed */
+struct version * version_get () {
+    struct version *version;
+    wordlock_lock(&version_lock);
+    version = current;
+    __sync_fetch_and_add(&version->refs, 1);
+    wordlock_unlock(&version_lock);
+    return version;
+}
+
+void version_put (struct version *version) {
+    if (__sync_sub_and_fetch(&version->refs, 1) == 0) {
+        node_put(version->tree);
+        free(version);
+    }
+}
+
+/* Start a new version, sharing all of the current one */
+void write_begin () {
+    pthread_mutex_lock(&write_mutex);
+    root = current->tree;
+    node_get(root);
+}
+
+/* Publish the tree written since write_begin, unless nothing in it
+ * was copied.  Lookup caches are only invalidated once readers can see
+ * the new values, or a lookup could cache an old one as new.
+ */
+void write_end () {
+    struct version *old = current, *version;
+
+    if (root == old->tree) {
+        node_put(root);
+    } else {
+        version = malloc(sizeof(struct version));
+        assert(version);
+        version->tree = root;
+        version->nodes = node_count;
+        version->refs = 1;
+        wordlock_lock(&version_lock);
+        current = version;
+        wordlock_unlock(&version_lock);
+        version_put(old);
+    }
+
+    apply_unfilter(draft);
+    if (changed && use_cache)
+        cache_invalidate();
+    changed = 0;
+    pthread_mutex_unlock(&write_mutex);
+}
+
+/* Make every node that a search for string looks at the writer's own,
+ * so _insert and _delete may change them in place.
+ */
+void unshare (const char *string, size_t strlen) {
+    struct trie_node **link = &root;
+    int keylen, cmp;
+
+    while (*link) {
+        struct trie_node *node = private_node(link);
+
+        cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp == 0) {
+            if (node->strlen > keylen || strlen == keylen)
+                return;
+            strlen -= keylen;
+            link = &node->children;
+        } else {
+            cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+            if (cmp < 0)
+                link = &node->next;
+            else
+                return;
+        }
+    }
+}
+
+/* Recursive helper function.
+ * Returns a pointer to the node if found.
+ * Stores an optional pointer to the
+ * parent, or what should be the parent if not found.
+ *
+ */
+struct trie_node *
+_search (struct trie_node *node, const char *string, size_t strlen) {
+
+    int keylen, cmp;
+
+    // First things first, check if we are NULL
+    if (node == NULL) return NULL;
+
+    assert(node->strlen < MAX_KEY);
+
+    // See if this key is a substring of the string passed in
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // Yes, either quit, or recur on the children
+
+        // If this key is longer than our search string, the key isn't here
+        if (node->strlen > keylen) {
+            return NULL;
+        } else if (strlen > keylen) {
+            // Recur on children list
+            return _search(node->children, string, strlen - keylen);
+        } else {
+            assert (strlen == keylen);
+
+            return node;
+        }
+
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0) {
+            // No, look right (the node's key is "less" than the search key)
+            return _search(node->next, string, strlen);
+        } else {
+            // Quit early
+            return 0;
+        }
+    }
+}
+
+int search  (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+int lookup  (const char *string, size_t strlen, int32_t *ip4_address) {
+    struct trie_node *found;
+    struct version *version;
+    uint32_t now = expiry_now();
+    int res = LOOKUP_MISS;
+    int32_t ip = 0;
+    int has_a = 0;
+    uint32_t expires = 0;
+    unsigned long epoch = cache_epoch();
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    // Hot names are answered from this thread's cache, without locks
+    if (use_cache && cache_get(string, strlen, epoch, now, &res, ip4_address))
+        return res;
+
+    // Most absent names stop here, without any locks
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return LOOKUP_MISS;
+
+    version = version_get();
+    found = _search(version->tree, string, strlen);
+
+    if (found && live_value(found, now)) {
+        has_a = rrset_find_a(&found->records, &ip);
+        res = has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+        expires = found->expires;
+    } else if (found && found->negative && found->expires > now) {
+        res = LOOKUP_NEGATIVE;
+        expires = found->expires;
+    }
+    version_put(version);
+
+    if (use_filter && res == LOOKUP_MISS)
+        bloom_false_positive(&filter);
+    if (use_cache)
+        cache_put(string, strlen, epoch, res, has_a, ip, expires);
+    if (ip4_address && has_a)
+        *ip4_address = ip;
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    struct trie_node *found;
+    struct version *version;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return 0;
+
+    version = version_get();
+    found = _search(version->tree, string, strlen);
+
+    if (found && live_value(found, expiry_now())) {
+        fn(&found->records, arg);
+        res = 1;
+    }
+    version_put(version);
+    return res;
+}
+
+/* Recursive helper for search_longest_suffix.  Walks the same path
+ * as _search, remembering the deepest live value that ends on a
+ * label boundary.
+ */
+void
+_search_suffix (struct trie_node *node, const char *string, size_t strlen,
+        uint32_t now, struct suffix_match *match) {
+
+    int keylen, cmp;
+
+    // First things first, check if we are NULL
+    if (node == NULL) return;
+
+    assert(node->strlen < MAX_KEY);
+
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // This node is on the path unless its key is longer than the string
+        if (node->strlen > keylen)
+            return;
+        if (live_value(node, now) && (strlen == keylen || string[strlen - keylen - 1] == '.')) {
+            match->found = 1;
+            match->rest = strlen - keylen;
+            match->ip4_address = 0;
+            rrset_find_a(&node->records, &match->ip4_address);
+        }
+        if (strlen > keylen)
+            _search_suffix(node->children, string, strlen - keylen, now, match);
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0)
+            _search_suffix(node->next, string, strlen, now, match);
+    }
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    struct suffix_match match = { 0, 0, 0 };
+    struct version *version;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    version = version_get();
+    _search_suffix(version->tree, string, strlen, expiry_now(), &match);
+    version_put(version);
+
+    if (match.found) {
+        if (ip4_address)
+            *ip4_address = match.ip4_address;
+        if (suffix_len)
+            *suffix_len = strlen - match.rest;
+    }
+    return match.found;
+}
+
+/* Recursive helper for cursor_next.  name is a MAX_KEY buffer whose
+ * last namelen bytes hold the full name of node's parent.  Walks node
+ * and its later siblings.  Returns 1 once the walk should stop.
+ */
+int _cursor_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        struct trie_cursor *cursor, int *left,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+
+    for (; node; node = node->next) {
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+        int want;
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        want = cursor_check(cursor, start, strlen);
+        if (want & CURSOR_STOP)
+            return 1;
+        if ((want & CURSOR_EMIT) && live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            cursor_advance(cursor, start, strlen);
+            if (--*left == 0)
+                return 1;
+        }
+        if ((want & CURSOR_DESCEND) && _cursor_walk(node->children, name, strlen, now, cursor, left, fn, arg))
+            return 1;
+    }
+    return 0;
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    struct version *version;
+    int left = max;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    version = version_get();
+    _cursor_walk(version->tree, name, 0, expiry_now(), cursor, &left, fn, arg);
+    version_put(version);
+
+    // A page that isn't full means the walk ran out of names
+    if (left > 0)
+        cursor->done = 1;
+    return max - left;
+}
+
+struct trie_snapshot * snapshot_take () {
+    struct trie_snapshot *snap = malloc(sizeof(struct trie_snapshot));
+    assert(snap);
+    snap->version = version_get();
+    snap->now = expiry_now();
+    return snap;
+}
+
+/* Recursive helper for snapshot_walk, like _cursor_walk without the
+ * cursor.  Returns how many names it passed to fn.
+ */
+int _snapshot_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    int count = 0;
+
+    for (; node; node = node->next) {
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        if (live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            count++;
+        }
+        count += _snapshot_walk(node->children, name, strlen, now, fn, arg);
+    }
+    return count;
+}
+
+int snapshot_walk (struct trie_snapshot *snap,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    return _snapshot_walk(snap->version->tree, name, 0, snap->now, fn, arg);
+}
+
+void snapshot_release (struct trie_snapshot *snap) {
+    version_put(snap->version);
+    free(snap);
+}
+
+int _update_value (const char *string, size_t strlen, int32_t ip4_address);
+
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    int res;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    write_begin();
+    res = _update_value(string, strlen, ip4_address);
+    write_end();
+    return res;
+}
+
+/* update's part inside the write section */
+int _update_value (const char *string, size_t strlen, int32_t ip4_address) {
+    struct trie_node *found;
+    int res = 0;
+
+    // Only copy the path if there is something to change
+    found = _search(root, string, strlen);
+    if (found && live_value(found, expiry_now()) && rrset_find_a(&found->records, NULL)) {
+        unshare(string, strlen);
+        found = _search(root, string, strlen);
+        res = rrset_set_a(&found->records, ip4_address);
+        changed = 1;
+    }
+    return res;
+}
+
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    struct trie_node *found;
+    int32_t ip;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    write_begin();
+    // As in update, only copy the path if there is something to change
+    found = _search(root, string, strlen);
+    if (found && live_value(found, expiry_now())
+            && rrset_find_a(&found->records, &ip) && ip == expected) {
+        unshare(string, strlen);
+        found = _search(root, string, strlen);
+        res = rrset_set_a(&found->records, ip4_address);
+        changed = 1;
+    }
+    write_end();
+    return res;
+}
+
+/* Recursive helper function.  Every node it looks at must already be
+ * the writer's own (see unshare).
+ */
+int _insert (const char *string, size_t strlen, const struct new_value *value,
+        struct trie_node *node, struct trie_node *parent, struct trie_node *left) {
+
+    int cmp, keylen;
+
+    // First things first, check if we are NULL
+    assert (node != NULL);
+    assert (node->strlen < MAX_KEY);
+
+    // Take the minimum of the two lengths
+    cmp = compare_keys_substring (node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // Yes, either quit, or recur on the children
+
+        // If this key is longer than our search string, we need to insert
+        // "above" this node
+        if (node->strlen > keylen) {
+            struct trie_node *new_node;
+
+            assert(keylen == strlen);
+            assert((!parent) || parent->children == node);
+
+            new_node = new_leaf (string, strlen, value);
+            node->strlen -= keylen;
+            new_node->children = node;
+            new_node->next = node->next;
+            node->next = NULL;
+
+            assert ((!parent) || (!left));
+
+            if (parent) {
+                parent->children = new_node;
+            } else if (left) {
+                left->next = new_node;
+            } else if ((!parent) || (!left)) {
+                root = new_node;
+            }
+            return 1;
+
+        } else if (strlen > keylen) {
+
+            if (node->children == NULL) {
+                // Insert leaf here
+                struct trie_node *new_node = new_leaf (string, strlen - keylen, value);
+                node->children = new_node;
+                return 1;
+            } else {
+                // Recur on children list, store "parent" (loosely defined)
+                return _insert(string, strlen - keylen, value,
+                        node->children, node, NULL);
+            }
+        } else {
+            assert (strlen == keylen);
+            if (value->append || value->replace || !live_value(node, expiry_now())) {
+                set_value(node, value);
+                return 1;
+            } else {
+                return 0;
+            }
+        }
+
+    } else {
+        /* Is there any common substring? */
+        int i, cmp2, keylen2, overlap = 0;
+        for (i = 1; i < keylen; i++) {
+            cmp2 = compare_keys_substring (&node->key[i], node->strlen - i,
+                    &string[i], strlen - i, &keylen2);
+            assert (keylen2 > 0);
+            if (cmp2 == 0) {
+                overlap = 1;
+                break;
+            }
+        }
+
+        if (overlap) {
+            // Insert a common parent, recur
+            int offset = strlen - keylen2;
+            struct trie_node *new_node = new_leaf (&string[offset], keylen2, NULL);
+            assert ((node->strlen - keylen2) > 0);
+            node->strlen -= keylen2;
+            new_node->children = node;
+            new_node->next = node->next;
+            node->next = NULL;
+            assert ((!parent) || (!left));
+
+            if (node == root) {
+                root = new_node;
+            } else if (parent) {
+                assert(parent->children == node);
+                parent->children = new_node;
+            } else if (left) {
+                left->next = new_node;
+            } else if ((!parent) && (!left)) {
+                root = new_node;
+            }
+
+            return _insert(string, offset, value,
+                    node, new_node, NULL);
+        } else {
+            cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
+            if (cmp < 0) {
+                // No, recur right (the node's key is "less" than  the search key)
+                if (node->next)
+                    return _insert(string, strlen, value, node->next, NULL, node);
+                else {
+                    // Insert here
+                    struct trie_node *new_node = new_leaf (string, strlen, value);
+                    node->next = new_node;
+                    return 1;
+                }
+            } else {
+                // Insert here
+                struct trie_node *new_node = new_leaf (string, strlen, value);
+                new_node->next = node;
+                if (node == root)
+                    root = new_node;
+                else if (parent && parent->children == node)
+                    parent->children = new_node;
+                else if (left && left->next == node)
+                    left->next = new_node;
+            }
+        }
+        return 1;
+    }
+}
+
+void assert_invariants();
+
+int insert_value (const char *string, size_t strlen, const struct new_value *value);
+int _insert_value (const char *string, size_t strlen, const struct new_value *value);
+
+int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+/* One try at a squatting insert, for waitq_until */
+int try_insert (void *arg) {
+    const struct new_value *value = arg;
+    return insert_value(value->name, value->name_len, value);
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &value);
+    return insert_value(string, strlen, &value);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    struct new_value value = { record, 0, 0, 1, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen, 1 };
+    return insert_value(string, strlen, &value);
+}
+
+/* Common code for inserting a value or a negative entry */
+int insert_value (const char *string, size_t strlen, const struct new_value *value) {
+    int res;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    write_begin();
+    res = _insert_value(string, strlen, value);
+    write_end();
+    return res;
+}
+
+/* insert_value's part inside the write section */
+int _insert_value (const char *string, size_t strlen, const struct new_value *value) {
+    int res;
+
+    unshare(string, strlen);
+
+    /* Edge case: root is null */
+    if (root == NULL) {
+        root = new_leaf (string, strlen, value);
+        res = 1;
+    } else
+        res = _insert(string, strlen, value, root, NULL, NULL);
+
+    if (res && value->negative)
+        expiry_queue_push(&negative_queue, string, strlen, value->expires);
+    else if (res)
+        expiry_add(&wheel, string, strlen, value->expires);
+    return res;
+}
+
+/* Take every name under node out of the filter */
+void _unfilter (struct trie_node *node) {
+    for (; node; node = node->next) {
+        if (node->filtered)
+            bloom_remove(&filter, node->filter_hash);
+        _unfilter(node->children);
+    }
+}
+
+int reload (const struct zone_name *zone, int n) {
+    struct draft fresh = { NULL, 0, 0, 0, NULL, 0, 0 };
+    struct trie_node *old;
+    int i, loaded = 0;
+
+    /* Build the new tree in this thread's own draft; nothing else sees
+     * it.  Readers never take write_mutex, so holding it throughout
+     * only makes writers wait, rather than write to a tree about to be
+     * replaced. */
+    write_begin();
+    draft = &fresh;
+    for (i = 0; i < n; i++) {
+        struct record record = { .type = RR_A, .data.a = zone[i].ip4_address };
+        struct new_value value = { &record, expiry_from_ttl(zone[i].ttl), 0, 0,
+            zone[i].name, zone[i].strlen };
+        int res;
+
+        if (zone[i].strlen == 0)
+            continue;
+        if (root == NULL) {
+            root = new_leaf (zone[i].name, zone[i].strlen, &value);
+            res = 1;
+        } else
+            res = _insert(zone[i].name, zone[i].strlen, &value, root, NULL, NULL);
+        if (res) {
+            expiry_add(&wheel, zone[i].name, zone[i].strlen, value.expires);
+            loaded++;
+        }
+    }
+    assert_invariants();
+    apply_unfilter(&fresh);  //These only undo the build's own adds
+    free(fresh.unfilter);
+    draft = &next;
+
+    // ... and make it the next version in place of the current tree
+    old = root;
+    fresh.unfilter = next.unfilter;  //Empty since the last write_end
+    fresh.unfilter_size = next.unfilter_size;
+    next = fresh;
+    changed = 1;
+    write_end();
+
+    // Lookups ask the filter before they pin a version, so from here on
+    // one it turns away would have found the fresh tree anyway
+    if (use_filter)
+        _unfilter(old);
+    node_put(old);
+    return loaded;
+}
+
+/* Recursive helper function.
+ * Returns a pointer to the node if found.
+ * Stores an optional pointer to the
+ * parent, or what should be the parent if not found.
+ * If expired_by is non-zero, only delete a value that
+ * expired at or before that tick.  If negative is set,
+ * delete a negative entry instead of a value.
+ * Every node it looks at must already be the writer's own.
+ */
+struct trie_node *
+_delete (struct trie_node *node, const char *string,
+        size_t strlen, uint32_t expired_by, int negative) {
+    int keylen, cmp;
+
+    // First things first, check if we are NULL
+    if (node == NULL) return NULL;
+
+    assert(node->strlen < MAX_KEY);
+
+    // See if this key is a substring of the string passed in
+    cmp = compare_keys_substring (node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // Yes, either quit, or recur on the children
+
+        // If this key is longer than our search string, the key isn't here
+        if (node->strlen > keylen) {
+            return NULL;
+        } else if (strlen > keylen) {
+            struct trie_node *found =  _delete(node->children, string, strlen - keylen, expired_by, negative);
+            if (found) {
+                /* If the node doesn't have children, delete it.
+                 * Otherwise, keep it around to find the kids */
+                if (found->children == NULL && empty_node(found)) {
+                    assert(node->children == found);
+                    node->children = found->next;
+                    free(found);
+                    node_count--;
+                }
+
+                /* Delete the root node if we empty the tree */
+                if (node == root && node->children == NULL && empty_node(node)) {
+                    root = node->next;
+                    free(node);
+                    node_count--;
+                }
+
+                return node; /* Recursively delete needless interior nodes */
+            } else
+                return NULL;
+        } else {
+            assert (strlen == keylen);
+
+            /* We found it! Clear the records if we may, and report the
+             * node if that leaves it empty, so it (and any emptied
+             * ancestors) get unlinked.  The reaper only takes values that
+             * have really expired, since the name may have been
+             * re-inserted with a new TTL. */
+            if (deletable(node, expired_by, negative))
+                set_value(node, NULL);
+            if (empty_node(node)) {
+                /* Delete the root node if we empty the tree */
+                if (node == root && node->children == NULL && empty_node(node)) {
+                    root = node->next;
+                    free(node);
+                    node_count--;
+                    return (struct trie_node *) 0x100100; /* XXX: Don't use this pointer for anything except
+                                                           * comparison with NULL, since the memory is freed.
+                                                           * Return a "poison" pointer that will probably
+                                                           * segfault if used.
+                                                           */
+                }
+                return node;
+            } else {
+                /* Still holds a value */
+                return NULL;
+            }
+        }
+
+    } else {
+        cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0) {
+            // No, look right (the node's key is "less" than  the search key)
+            struct trie_node *found = _delete(node->next, string, strlen, expired_by, negative);
+            if (found) {
+                /* If the node doesn't have children, delete it.
+                 * Otherwise, keep it around to find the kids */
+                if (found->children == NULL && empty_node(found)) {
+                    assert(node->next == found);
+                    node->next = found->next;
+                    free(found);
+                    node_count--;
+                }
+
+                return node; /* Recursively delete needless interior nodes */
+            }
+            return NULL;
+        } else {
+            // Quit early
+            return NULL;
+        }
+    }
+}
+
+int _delete_value (const char *string, size_t strlen);
+
+int delete  (const char *string, size_t strlen) {
+    int res;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    write_begin();
+    res = _delete_value(string, strlen);
+    write_end();
+    return res;
+}
+
+/* delete's part inside the write section */
+int _delete_value (const char *string, size_t strlen) {
+    struct trie_node *found;
+    int res = 0, prunable = 0;
+
+    /* Only clear the value.  The node stays linked as a tombstone,
+     * which searches already treat as a miss, until compact() gets
+     * to it.  Only copy the path if there is something to clear. */
+    found = _search(root, string, strlen);
+    if (found && deletable(found, 0, 0)) {
+        unshare(string, strlen);
+        found = _search(root, string, strlen);
+        set_value(found, NULL);
+        prunable = (found->children == NULL);
+        res = 1;
+    }
+    assert_invariants();
+
+    if (prunable)
+        expiry_queue_push(&prune_queue, string, strlen, 0);
+    if (res)
+        waitq_wake(string, strlen);
+    return res;
+}
+
+/* The whole batch goes into one new version, so readers get all of it
+ * or none of it.  Lookups in the batch read the writer's own tree, and
+ * so see the ops before them.
+ */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    struct trie_node *found;
+    int i, done = 0;
+
+    write_begin();
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        uint32_t now = expiry_now();
+        op->res = 0;
+        if (op->strlen == 0)
+            continue;
+        switch (op->op) {
+            case TRIE_OP_LOOKUP:
+                found = _search(root, op->name, op->strlen);
+                op->res = LOOKUP_MISS;
+                if (found && live_value(found, now)) {
+                    if (rrset_find_a(&found->records, &op->ip4_address))
+                        op->res = LOOKUP_FOUND;
+                } else if (found && found->negative && found->expires > now)
+                    op->res = LOOKUP_NEGATIVE;
+                break;
+            case TRIE_OP_INSERT: {
+                struct record record = { .type = RR_A, .data.a = op->ip4_address };
+                struct new_value value = { &record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen };
+                op->res = _insert_value(op->name, op->strlen, &value);
+                break;
+            }
+            case TRIE_OP_INSERT_NEGATIVE: {
+                struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, op->name, op->strlen };
+                op->res = _insert_value(op->name, op->strlen, &value);
+                break;
+            }
+            case TRIE_OP_UPSERT: {
+                struct record record = { .type = RR_A, .data.a = op->ip4_address };
+                struct new_value value = { &record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen, 1 };
+                op->res = _insert_value(op->name, op->strlen, &value);
+                break;
+            }
+            case TRIE_OP_UPDATE:
+                op->res = _update_value(op->name, op->strlen, op->ip4_address);
+                break;
+            case TRIE_OP_DELETE:
+                op->res = _delete_value(op->name, op->strlen);
+                break;
+            default:
+                assert(0);
+        }
+        done += (op->res != 0);
+    }
+    write_end();
+    return done;
+}
+
+/* Find one node to remove from the tree.
+ *  * Use any policy you like to select the node.
+ *   */
+int drop_one_node() {
+    struct trie_node *node = root;
+    int negative;
+    assert(node->key != NULL);
+    int size = MAX_KEY-1;
+    char key[size+1];
+    key[size] = '\0';
+    do {
+        assert(node->key != NULL);
+        size -= node->strlen;
+        assert(size >= 0);
+        memcpy(&key[size], node->key, node->strlen);
+        negative = node->negative;
+    } while ((node = node->children));
+    assert(node == NULL);
+    unshare(&key[size], strlen(&key[size]));
+    if (_delete(root, &key[size], strlen(&key[size]), 0, negative) == NULL)
+        return 0;
+    if (!negative)
+        waitq_wake(&key[size], strlen(&key[size]));
+    return 1;
+}
+
+/* Drop the oldest negative entry.  Returns 0 if there are none. */
+int drop_one_negative() {
+    struct expiry_entry *entry;
+    int res = 0;
+
+    while (!res && (entry = expiry_queue_pop(&negative_queue, 0))) {
+        unshare(entry->key, entry->strlen);
+        res = (_delete(root, entry->key, entry->strlen, 0, 1) != NULL);
+        free(entry);
+    }
+    return res;
+}
+
+/* Delete every name whose TTL has run out.  The wheel hands us
+ * just the names that came due, so the tree is never scanned.
+ */
+void reap_expired() {
+    uint32_t now = expiry_now();
+    struct expiry_entry *entry = expiry_advance(&wheel, now), *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        unshare(entry->key, entry->strlen);
+        if (_delete(root, entry->key, entry->strlen, now, 0))
+            waitq_wake(entry->key, entry->strlen);
+        free(entry);
+    }
+
+    // Negative entries all share one TTL, so their queue is in expiry order
+    while ((entry = expiry_queue_pop(&negative_queue, now))) {
+        unshare(entry->key, entry->strlen);
+        _delete(root, entry->key, entry->strlen, now, 1);
+        free(entry);
+    }
+}
+/* Unlink the tombstones that deletes have left behind, up to
+ * COMPACT_BATCH of them per version.
+ */
+void compact() {
+    struct expiry_entry *batch[COMPACT_BATCH];
+    int i, n;
+
+    do {
+        for (n = 0; n < COMPACT_BATCH && (batch[n] = expiry_queue_pop(&prune_queue, 0)); n++)
+            ;
+        if (n == 0)
+            break;
+        write_begin();
+        for (i = 0; i < n; i++) {
+            struct trie_node *node = _search(root, batch[i]->key, batch[i]->strlen);
+            // It may have been re-inserted, or unlinked along with another name
+            if (node && empty_node(node) && node->children == NULL) {
+                unshare(batch[i]->key, batch[i]->strlen);
+                _delete(root, batch[i]->key, batch[i]->strlen, 0, 0);
+            }
+        }
+        assert_invariants();
+        write_end();
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    } while (n == COMPACT_BATCH);
+}
+
+
+/* Check the total node count; see if we have exceeded a the max.
+*/
+void check_max_nodes() {
+    pthread_mutex_lock(&delete_mutex);
+    if (separate_delete_thread) {
+        /* Wake up at least once a tick to reap expired names */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+    }
+    compact();
+    write_begin();
+    reap_expired();
+    while (negative_count > max_negative && drop_one_negative())
+        ;
+    // Negative entries go first
+    while (node_count > max_count)
+        if (!drop_one_negative())
+            assert(drop_one_node());
+    assert(node_count <= max_count);
+    write_end();
+    pthread_mutex_unlock(&delete_mutex);
+}
+
+void delete_all_nodes() {
+    pthread_mutex_lock(&delete_mutex);
+    compact();
+    write_begin();
+    while (node_count)
+        assert(drop_one_node());
+    assert(node_count == 0);
+    write_end();
+    pthread_mutex_unlock(&delete_mutex);
+}
+
+int _print(struct trie_node *node, int depth, char lines[100], int count) {
+    printf("%s", lines);
+    if (!node->next)
+        printf("└");
+    else
+        printf("├");
+    int32_t ip4_address = 0;
+    rrset_find_a(&node->records, &ip4_address);
+    printf ("%.*s, IP %d, Records %d%s, This %p, Next %p, Children %p\n",
+            node->strlen, node->key, ip4_address, node->records.count, node->negative ? " (negative)" : "",
+            node, node->next, node->children);
+    if (node->children) {
+        if (node->next)
+            strcat(lines, "| ");
+        else strcat(lines, "  ");
+        count = _print(node->children, depth+1, lines, count+1);
+        lines[2*depth] = '\0';
+    }
+    if (node->next)
+        count = _print(node->next, depth, lines, count+1);
+    return count;
+}
+
+/* Prints the current version, without holding up writers */
+void print() {
+    struct version *version = version_get();
+    printf ("Root is at %p\n", version->tree);
+    char lines[100];
+    lines[0] = '\0';
+    int count = 0;
+    if (version->tree)
+        count = _print(version->tree, 0, lines, 1);
+#ifdef DEBUG
+    printf("node_count: %d\nActual node count: %d\n", version->nodes, count);
+#endif
+    assert(count == version->nodes);
+    version_put(version);
+}
+
+void print_stats() {
+    if (use_filter)
+        printf ("Filter false positive rate %.4f\n", bloom_false_positive_rate(&filter));
+}
+
+int num_nodes() {
+    return node_count;
+}
+
+
+int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
+    int count = 1;
+
+    int len = prefix_length + node->strlen;
+    if (len > MAX_KEY) {
+        printf("key too long at node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n",
+                node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
+        *error = 1;
+        return count;
+    }
+
+    if (node->refs < 1) {
+        printf("freed node %p still linked.  Key %.*s (%d), Refs %d\n",
+                node, node->strlen, node->key, node->strlen, node->refs);
+        *error = 1;
+        return count;
+    }
+
+    if (node->children) {
+        count += _assert_invariants(node->children, len, error);
+        if (*error) {
+            printf("Unwinding tree on error: node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n",
+                    node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
+            return count;
+        }
+    }
+
+    if (node->next) {
+        count += _assert_invariants(node->next, prefix_length, error);
+    }
+
+    return count;
+}
+
+/* Checks the tree being written; the caller holds write_mutex */
+void assert_invariants () {
+#ifdef DEBUG
+    int err = 0;
+    if (root) {
+        int count = _assert_invariants(root, 0, &err);
+        if (err) print();
+        assert(count == node_count);
+    }
+#endif // DEBUG
+}
@@ -0,0 +1,62 @@
+/* Ordered cursor support shared by every trie.  See cursor.h. */
+
+#include <string.h>
+#include "cursor.h"
+
+void cursor_init (struct trie_cursor *cursor, const char *suffix, size_t strlen) {
+    assert(strlen < MAX_KEY);
+    memcpy(cursor->suffix, suffix, strlen);
+    cursor->suffix_len = strlen;
+    cursor->last_len = 0;
+    cursor->done = 0;
+}
+
+/* Compare two names from the end.  If one is a suffix of the other,
+ * the shorter sorts first.
+ */
+static int _name_cmp (const char *name1, size_t len1, const char *name2, size_t len2) {
+    size_t i;
+    for (i = 1; i <= len1 && i <= len2; i++) {
+        if (name1[len1 - i] != name2[len2 - i])
+            return (unsigned char) name1[len1 - i] - (unsigned char) name2[len2 - i];
+    }
+    return (len1 > len2) - (len1 < len2);
+}
+
+/* Is name1 a suffix of name2? */
+static int _is_suffix (const char *name1, size_t len1, const char *name2, size_t len2) {
+    return len1 <= len2 && memcmp(name1, &name2[len2 - len1], len1) == 0;
+}
+
+int cursor_check (const struct trie_cursor *cursor, const char *name, size_t strlen) {
+    const char *suffix = cursor->suffix;
+    size_t suffix_len = cursor->suffix_len;
+    int want = CURSOR_EMIT | CURSOR_DESCEND;
+
+    // Is the subtree under the suffix?
+    if (_is_suffix(suffix, suffix_len, name, strlen)) {
+        // Everything below shares the character in front of the suffix
+        if (suffix_len && strlen > suffix_len && name[strlen - suffix_len - 1] != '.')
+            return 0;
+    } else if (_is_suffix(name, strlen, suffix, suffix_len))
+        want = CURSOR_DESCEND;
+    else if (_name_cmp(name, strlen, suffix, suffix_len) < 0)
+        return 0;
+    else
+        return CURSOR_STOP;
+
+    // Has this page's walk reached where the last one stopped?
+    if (cursor->last_len) {
+        if (_is_suffix(name, strlen, cursor->last, cursor->last_len))
+            want &= CURSOR_DESCEND;
+        else if (_name_cmp(name, strlen, cursor->last, cursor->last_len) < 0)
+            return 0;
+    }
+    return want;
+}
+
+void cursor_advance (struct trie_cursor *cursor, const char *name, size_t strlen) {
+    assert(strlen < MAX_KEY);
+    memcpy(cursor->last, name, strlen);
+    cursor->last_len = strlen;
+}
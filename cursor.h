@@ -0,0 +1,43 @@
+#ifndef __CURSOR_H__
+#define __CURSOR_H__
+
+#include "trie.h"
+
+/* Resumable, ordered walks over every name under a suffix.
+ *
+ * Names come out in reverse-key order (compared from the end, with a
+ * name before the longer names it is a suffix of), which is just the
+ * order of a depth-first walk of the tree.  Each call to cursor_next
+ * returns one page with the backend's locks held, and the cursor only
+ * remembers the last name it returned; the next page re-walks from the
+ * root, skipping whole subtrees that sort before that name.  Names
+ * inserted or deleted between pages may or may not be seen.
+ */
+
+struct trie_cursor {
+    char suffix[MAX_KEY]; /* Only names under this suffix */
+    size_t suffix_len;
+    char last[MAX_KEY]; /* The last name returned */
+    size_t last_len; /* 0 before the first page */
+    int done;
+};
+
+/* Results of cursor_check, as bits */
+#define CURSOR_EMIT    1 /* The node's own name is wanted */
+#define CURSOR_DESCEND 2 /* Its children may hold wanted names */
+#define CURSOR_STOP    4 /* Nothing here or later is wanted */
+
+/* Start a walk over suffix and every name under it, on a label
+ * boundary.  A suffix of length 0 walks the whole tree.
+ */
+void cursor_init (struct trie_cursor *cursor, const char *suffix, size_t strlen);
+
+/* Decide what a walk wants from the subtree whose root's full name
+ * is name.  Every name in that subtree ends with name.
+ */
+int cursor_check (const struct trie_cursor *cursor, const char *name, size_t strlen);
+
+/* Record that name was the last one returned. */
+void cursor_advance (struct trie_cursor *cursor, const char *name, size_t strlen);
+
+#endif /* __CURSOR_H__ */
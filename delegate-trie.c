@@ -0,0 +1,557 @@
+/* A (reverse) trie split into shards, each owned by one server
+ * thread.  Clients never touch a shard: they pass each operation to
+ * the shard's server through a lock-free ring (ring.h) and wait for
+ * the answer, so a shard stays in its server's cache and the trie
+ * itself needs no locks at all.  Each shard is a whole sequential
+ * trie (sequential-trie.c, built as shard-trie.o).
+ *
+ * Names go to shards by their last byte.  Every suffix of a name ends
+ * in the same byte, so suffix and cursor queries only ever need the
+ * one shard, and since shards own ascending ranges of last bytes, a
+ * walk of the whole tree just visits the shards in order.  Each shard
+ * keeps the sequential trie's node budgets.  The price is balance:
+ * names are only spread evenly if their last bytes are.  The
+ * simulator clamps its random letters to 'z', which sends over a
+ * third of its names to the last shard, and a real zone, whose names
+ * end in a few TLDs, would land almost all on one.
+ */
+
+#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trie.h"
+#include "cursor.h"
+#include "shard.h"
+#include "ring.h"
+#include "async.h"
+#include "waitq.h"
+
+#define SHARDS 4
+#define CALL_SPINS 256 /* Yields before a client sleeps on its request */
+#define MAX_NODES 100  /* The sequential trie's budgets, here for all the shards together */
+#define MAX_NEGATIVE 20
+
+/* What a client can ask a server to do */
+#define OP_INSERT_TTL     1
+#define OP_INSERT_NEGATIVE 2
+#define OP_INSERT_RECORD  3
+#define OP_LOOKUP         4
+#define OP_UPDATE         5
+#define OP_SEARCH_RECORDS 6
+#define OP_SUFFIX         7
+#define OP_CURSOR         8
+#define OP_DELETE         9
+#define OP_COMPACT        10
+#define OP_CHECK          11
+#define OP_DELETE_ALL     12
+#define OP_PRINT          13
+#define OP_PRINT_STATS    14
+#define OP_NUM_NODES      15
+#define OP_BATCH          16
+#define OP_UPSERT         17
+#define OP_CAS_VALUE      18
+#define OP_TRIM           19
+
+/* A batch of operations, spread over the shards it touches */
+struct batch {
+    struct trie_op *ops;
+    int n;
+    volatile int pending; /* Shards yet to apply their part */
+};
+
+/* Where a request is */
+#define REQ_PENDING 0
+#define REQ_DONE    1
+#define REQ_PARKED  2 /* Still pending, and the client sleeps on done */
+
+/* One operation.  It lives on the client's stack, and the client
+ * waits until the server sets done, so the server may write its
+ * results straight into the client's variables.
+ */
+struct request {
+    int op;
+    const char *string;
+    size_t strlen;
+    int32_t ip4_address; /* To store */
+    int32_t expected; /* For cas_value */
+    uint32_t ttl;
+    const struct record *record;
+    int32_t *ip; /* Where to put a found address */
+    size_t *suffix_len;
+    void (*records_fn) (const struct rrset *records, void *arg);
+    void (*cursor_fn) (const char *name, size_t strlen, const struct rrset *records, void *arg);
+    struct trie_cursor *cursor;
+    int max;
+    int max_negative; /* For OP_TRIM, with max */
+    struct batch *batch;
+    int shard; /* Whose part of the batch to apply */
+    void *arg;
+    int res;
+    int reply; /* Someone waits for res */
+    volatile int done; /* REQ_* */
+};
+
+struct shard {
+    struct ring ring;
+    pthread_t server;
+    volatile int nodes, negatives; /* As of the last request served */
+};
+
+static struct shard shards[SHARDS];
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;  //One batch at a time, or two could each hold a shard the other waits for
+static __thread unsigned int dirty = 0;  //Shards this client has changed since check_max_nodes
+static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t trim_mutex = PTHREAD_MUTEX_INITIALIZER;  //One thread evicts for all the shards
+extern int separate_delete_thread;
+
+/* Checks are posted without waiting, so they can all share one request */
+static struct request check_request = { .op = OP_CHECK };
+
+/* The shard for a name ending in c.  Shards own ascending ranges, and
+ * split the lowercase letters evenly.
+ */
+int shard_of (char c) {
+    if (c < 'a')
+        return 0;
+    if (c > 'z')
+        return SHARDS - 1;
+    return (c - 'a') * SHARDS / 26;
+}
+
+/* Apply one shard's part of a batch, and then wait for the other
+ * shards to apply theirs before serving anything else.  Until the
+ * last of them is done, any shard the batch touches is either still
+ * answering from before it or not answering at all, so no client can
+ * see part of it.
+ */
+int serve_batch (struct batch *batch, int shard) {
+    int i, done = 0;
+
+    for (i = 0; i < batch->n; i++) {
+        struct trie_op *op = &batch->ops[i];
+        if (op->strlen && shard_of(op->name[op->strlen - 1]) == shard)
+            done += shard_apply_batch(op, 1);
+    }
+    __sync_fetch_and_sub(&batch->pending, 1);
+    while (batch->pending)
+        sched_yield();
+    return done;
+}
+
+void serve (struct shard *shard, struct request *req) {
+    switch (req->op) {
+        case OP_INSERT_TTL:
+            req->res = shard_insert_ttl(req->string, req->strlen, req->ip4_address, req->ttl);
+            break;
+        case OP_INSERT_NEGATIVE:
+            req->res = shard_insert_negative(req->string, req->strlen);
+            break;
+        case OP_INSERT_RECORD:
+            req->res = shard_insert_record(req->string, req->strlen, req->record);
+            break;
+        case OP_LOOKUP:
+            req->res = shard_lookup(req->string, req->strlen, req->ip);
+            break;
+        case OP_UPDATE:
+            req->res = shard_update(req->string, req->strlen, req->ip4_address);
+            break;
+        case OP_UPSERT:
+            req->res = shard_upsert(req->string, req->strlen, req->ip4_address, req->ttl);
+            break;
+        case OP_CAS_VALUE:
+            req->res = shard_cas_value(req->string, req->strlen, req->expected, req->ip4_address);
+            break;
+        case OP_SEARCH_RECORDS:
+            req->res = shard_search_records(req->string, req->strlen, req->records_fn, req->arg);
+            break;
+        case OP_SUFFIX:
+            req->res = shard_search_longest_suffix(req->string, req->strlen, req->ip, req->suffix_len);
+            break;
+        case OP_CURSOR:
+            req->res = shard_cursor_next(req->cursor, req->max, req->cursor_fn, req->arg);
+            break;
+        case OP_DELETE:
+            req->res = shard_delete(req->string, req->strlen);
+            break;
+        case OP_COMPACT:
+            shard_compact();
+            break;
+        case OP_CHECK:
+            shard_check_max_nodes();
+            break;
+        case OP_DELETE_ALL:
+            shard_delete_all_nodes();
+            break;
+        case OP_PRINT:
+            shard_print();
+            break;
+        case OP_PRINT_STATS:
+            shard_print_stats();
+            break;
+        case OP_NUM_NODES:
+            req->res = shard_num_nodes();
+            break;
+        case OP_BATCH:
+            req->res = serve_batch(req->batch, req->shard);
+            break;
+        case OP_TRIM:
+            shard_trim(req->max, req->max_negative);
+            break;
+        default:
+            assert(0);
+    }
+    shard->nodes = shard_num_nodes();
+    shard->negatives = shard_num_negative();
+
+    /* Only a client that has gone to sleep needs the system call.  Once
+     * done is set the client may return, so the wake may land on a
+     * word that is no longer the request; futex waiters recheck. */
+    if (req->reply) {
+        __sync_synchronize();
+        if (__sync_lock_test_and_set(&req->done, REQ_DONE) == REQ_PARKED)
+            futex_wake(&req->done, 1);
+    }
+}
+
+void * server (void *arg) {
+    struct shard *shard = arg;
+
+    shard_use(shard_new());
+    shard_init(1);
+    while (1)
+        serve(shard, ring_wait(&shard->ring));
+    return NULL;
+}
+
+/* Queue req for a shard, without waiting for it */
+void post (int shard, struct request *req) {
+    while (!ring_push(&shards[shard].ring, req))
+        sched_yield();
+}
+
+/* Wait for a posted req's result: give the server a few turns, then
+ * sleep until it wakes us.
+ */
+int wait_for (struct request *req) {
+    int spins = 0;
+
+    while (req->done != REQ_DONE) {
+        if (++spins < CALL_SPINS)
+            sched_yield();
+        else {
+            __sync_bool_compare_and_swap(&req->done, REQ_PENDING, REQ_PARKED);
+            futex_wait(&req->done, REQ_PARKED);
+        }
+    }
+    __sync_synchronize();
+    return req->res;
+}
+
+/* Have a shard run req, and wait for the result */
+int call (int shard, struct request *req) {
+    req->reply = 1;
+    req->done = REQ_PENDING;
+    post(shard, req);
+    return wait_for(req);
+}
+
+/* Run an operation that concerns one name on its shard */
+int call_name (struct request *req) {
+    int shard = shard_of(req->string[req->strlen - 1]);
+    if (req->op == OP_INSERT_TTL || req->op == OP_INSERT_NEGATIVE ||
+            req->op == OP_INSERT_RECORD || req->op == OP_UPSERT || req->op == OP_DELETE)
+        dirty |= 1u << shard;
+    return call(shard, req);
+}
+
+/* Run an operation on every shard, and add up the results */
+int call_all (int op) {
+    int i, res = 0;
+    for (i = 0; i < SHARDS; i++) {
+        struct request req = { .op = op };
+        res += call(i, &req);
+    }
+    return res;
+}
+
+void init(int numthreads) {
+    int i;
+    for (i = 0; i < SHARDS; i++) {
+        ring_init(&shards[i].ring);
+        int err = pthread_create(&shards[i].server, NULL, &server, &shards[i]);
+        if (err)
+            printf("Failed to start server thread: %d\n", err);
+    }
+}
+
+void shutdown_delete_thread() {
+    if (separate_delete_thread) {
+        pthread_mutex_lock(&delete_mutex);
+        pthread_cond_signal(&delete_cond);
+        pthread_mutex_unlock(&delete_mutex);
+    }
+    return;
+}
+
+int search (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+int lookup (const char *string, size_t strlen, int32_t *ip4_address) {
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_LOOKUP, .string = string, .strlen = strlen, .ip = ip4_address };
+    return call_name(&req);
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_SEARCH_RECORDS, .string = string, .strlen = strlen,
+        .records_fn = fn, .arg = arg };
+    return call_name(&req);
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_SUFFIX, .string = string, .strlen = strlen,
+        .ip = ip4_address, .suffix_len = suffix_len };
+    return call_name(&req);
+}
+
+/* fn runs on the server threads.  A walk of the whole tree moves on
+ * to the next shard each time one runs out of names; the shard holding
+ * the last name returned is where to pick up.
+ */
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    int shard, count = 0;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    if (cursor->suffix_len)
+        shard = shard_of(cursor->suffix[cursor->suffix_len - 1]);
+    else
+        shard = cursor->last_len ? shard_of(cursor->last[cursor->last_len - 1]) : 0;
+
+    while (count < max) {
+        struct request req = { .op = OP_CURSOR, .cursor = cursor, .max = max - count,
+            .cursor_fn = fn, .arg = arg };
+        count += call(shard, &req);
+        if (!cursor->done || cursor->suffix_len || ++shard == SHARDS)
+            break;
+        cursor->done = 0;
+    }
+    return count;
+}
+
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_UPDATE, .string = string, .strlen = strlen,
+        .ip4_address = ip4_address };
+    return call_name(&req);
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_UPSERT, .string = string, .strlen = strlen,
+        .ip4_address = ip4_address, .ttl = ttl };
+    return call_name(&req);
+}
+
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_CAS_VALUE, .string = string, .strlen = strlen,
+        .expected = expected, .ip4_address = ip4_address };
+    return call_name(&req);
+}
+
+int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+/* One try at a squatting insert, for waitq_until.  Squatters wait
+ * here, in the client; the shards wake them as they free names.
+ */
+int try_insert (void *req) {
+    return call_name(req);
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_INSERT_TTL, .string = string, .strlen = strlen,
+        .ip4_address = ip4_address, .ttl = ttl };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &req);
+    return call_name(&req);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_INSERT_NEGATIVE, .string = string, .strlen = strlen };
+    return call_name(&req);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_INSERT_RECORD, .string = string, .strlen = strlen,
+        .record = record };
+    return call_name(&req);
+}
+
+int delete  (const char *string, size_t strlen) {
+    if (strlen == 0)
+        return 0;
+
+    struct request req = { .op = OP_DELETE, .string = string, .strlen = strlen };
+    return call_name(&req);
+}
+
+int trie_apply_batch (struct trie_op *ops, int n) {
+    struct batch batch = { ops, n, 0 };
+    struct request reqs[SHARDS];
+    unsigned int involved = 0;
+    int i, done = 0;
+
+    for (i = 0; i < n; i++) {
+        ops[i].res = 0;
+        if (ops[i].strlen == 0)
+            continue;
+        int shard = shard_of(ops[i].name[ops[i].strlen - 1]);
+        involved |= 1u << shard;
+        if (ops[i].op != TRIE_OP_LOOKUP)
+            dirty |= 1u << shard;
+    }
+    batch.pending = __builtin_popcount(involved);
+
+    pthread_mutex_lock(&batch_mutex);
+    for (i = 0; i < SHARDS; i++)
+        if (involved & (1u << i)) {
+            reqs[i] = (struct request) { .op = OP_BATCH, .batch = &batch, .shard = i, .reply = 1 };
+            post(i, &reqs[i]);
+        }
+    for (i = 0; i < SHARDS; i++)
+        if (involved & (1u << i))
+            done += wait_for(&reqs[i]);
+    pthread_mutex_unlock(&batch_mutex);
+    return done;
+}
+
+void compact() {
+    call_all(OP_COMPACT);
+}
+
+/* Each shard checks itself against the whole budget, so together
+ * they could hold SHARDS times it.  While they are over, have the
+ * shard with the most evict the excess.  The counts are as of each
+ * server's last request, so this may trim a little late, or a little
+ * more than a check still queued would have.
+ */
+void trim_shards () {
+    int i, nodes, negatives, fullest, before;
+
+    if (pthread_mutex_trylock(&trim_mutex))
+        return;  //Another thread is already at it
+    while (1) {
+        struct request req = { .op = OP_TRIM, .max = INT_MAX, .max_negative = INT_MAX };
+        nodes = negatives = fullest = 0;
+        for (i = 0; i < SHARDS; i++) {
+            nodes += shards[i].nodes;
+            negatives += shards[i].negatives;
+        }
+        // Negative entries go first
+        if (negatives > MAX_NEGATIVE) {
+            for (i = 1; i < SHARDS; i++)
+                if (shards[i].negatives > shards[fullest].negatives)
+                    fullest = i;
+            before = shards[fullest].negatives;
+            req.max_negative = before - (negatives - MAX_NEGATIVE);
+            if (req.max_negative < 0)
+                req.max_negative = 0;
+            call(fullest, &req);
+            if (shards[fullest].negatives >= before)
+                break;
+        } else if (nodes > MAX_NODES) {
+            for (i = 1; i < SHARDS; i++)
+                if (shards[i].nodes > shards[fullest].nodes)
+                    fullest = i;
+            before = shards[fullest].nodes;
+            req.max = before - (nodes - MAX_NODES);
+            if (req.max < 0)
+                req.max = 0;
+            call(fullest, &req);
+            if (shards[fullest].nodes >= before)
+                break;
+        } else
+            break;
+    }
+    pthread_mutex_unlock(&trim_mutex);
+}
+
+/* Ask the servers to check the shards this thread has changed, and
+ * don't wait; a server gets to it before anything else this thread
+ * sends it.  The delete thread instead checks every shard once a
+ * tick, or when it is shut down, and waits so that trim_shards sees
+ * what the checks left.
+ */
+void check_max_nodes() {
+    unsigned int check = dirty;
+    int i;
+
+    if (separate_delete_thread) {
+        struct timespec deadline;
+        pthread_mutex_lock(&delete_mutex);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+        pthread_mutex_unlock(&delete_mutex);
+        call_all(OP_CHECK);
+    } else {
+        dirty = 0;
+        for (i = 0; i < SHARDS; i++)
+            if (check & (1u << i))
+                post(i, &check_request);
+    }
+    trim_shards();
+}
+
+void delete_all_nodes() {
+    call_all(OP_DELETE_ALL);
+}
+
+void print() {
+    call_all(OP_PRINT);
+}
+
+void print_stats() {
+    call_all(OP_PRINT_STATS);
+}
+
+int num_nodes() {
+    return call_all(OP_NUM_NODES);
+}
@@ -0,0 +1,168 @@
+/* Hierarchical timing wheel for record TTLs.  See expiry.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "expiry.h"
+
+static __thread uint32_t frozen = 0;  //This thread's stopped clock, or 0
+
+uint32_t expiry_now () {
+    struct timespec ts;
+    if (frozen)
+        return frozen;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    // 0 means "never expires", so skip it
+    return ts.tv_sec ? (uint32_t) ts.tv_sec : 1;
+}
+
+uint32_t expiry_from_ttl (uint32_t ttl) {
+    if (ttl == 0)
+        return 0;
+    return expiry_now() + ttl;
+}
+
+void expiry_freeze (uint32_t tick) {
+    frozen = tick;
+}
+
+void expiry_thaw () {
+    frozen = 0;
+}
+
+void expiry_init (struct expiry_wheel *wheel) {
+    pthread_mutex_init(&wheel->mutex, NULL);
+    wheel->now = expiry_now();
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+}
+
+/* Put an entry in the slot for its expiry.  Called with the wheel
+ * locked, and with entry->expires >= wheel->now.
+ */
+static void _expiry_place (struct expiry_wheel *wheel, struct expiry_entry *entry) {
+    uint32_t delta = entry->expires - wheel->now;
+    uint32_t when = entry->expires;
+    int level;
+
+    // Entries past the top level wait in its furthest slot and are
+    // re-filed each time that slot cascades.
+    if (delta >= (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+        when = wheel->now + (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (1u << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    int slot = (when >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    entry->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = entry;
+}
+
+static struct expiry_entry * new_entry (const char *string, size_t strlen, uint32_t expires) {
+    struct expiry_entry *entry = malloc(sizeof(struct expiry_entry));
+    if (!entry) {
+        printf ("WARNING: Expiry entry allocation failed.  Name will not be reaped.\n");
+        return NULL;
+    }
+    assert(strlen < MAX_KEY);
+    entry->next = NULL;
+    entry->expires = expires;
+    entry->strlen = strlen;
+    memcpy(entry->key, string, strlen);
+    entry->key[strlen] = '\0';
+    return entry;
+}
+
+void expiry_add (struct expiry_wheel *wheel, const char *string, size_t strlen, uint32_t expires) {
+    struct expiry_entry *entry;
+
+    if (expires == 0)
+        return;
+
+    entry = new_entry(string, strlen, expires);
+    if (!entry)
+        return;
+
+    pthread_mutex_lock(&wheel->mutex);
+    // Anything already due goes out on the next tick
+    entry->expires = expires > wheel->now ? expires : wheel->now + 1;
+    _expiry_place(wheel, entry);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* Re-file every entry in a higher-level slot now that it is closer. */
+static void _expiry_cascade (struct expiry_wheel *wheel, int level) {
+    int slot = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    struct expiry_entry *entry = wheel->slots[level][slot], *next;
+
+    wheel->slots[level][slot] = NULL;
+    for (; entry; entry = next) {
+        next = entry->next;
+        _expiry_place(wheel, entry);
+    }
+}
+
+struct expiry_entry * expiry_advance (struct expiry_wheel *wheel, uint32_t now) {
+    struct expiry_entry *due = NULL, *entry, *next;
+
+    pthread_mutex_lock(&wheel->mutex);
+    while (wheel->now != now && (int32_t) (now - wheel->now) > 0) {
+        int level;
+        wheel->now++;
+
+        // Cascade from the top down, so entries can fall more than one level
+        for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+            uint32_t mask = (1u << (WHEEL_BITS * level)) - 1;
+            if ((wheel->now & mask) == 0)
+                _expiry_cascade(wheel, level);
+        }
+
+        int slot = wheel->now & (WHEEL_SIZE - 1);
+        entry = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        for (; entry; entry = next) {
+            next = entry->next;
+            entry->next = due;
+            due = entry;
+        }
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    return due;
+}
+
+void expiry_queue_init (struct expiry_queue *queue) {
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->head = queue->tail = NULL;
+}
+
+void expiry_queue_push (struct expiry_queue *queue, const char *string, size_t strlen, uint32_t expires) {
+    struct expiry_entry *entry = new_entry(string, strlen, expires);
+    if (!entry)
+        return;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail)
+        queue->tail->next = entry;
+    else
+        queue->head = entry;
+    queue->tail = entry;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+struct expiry_entry * expiry_queue_pop (struct expiry_queue *queue, uint32_t now) {
+    struct expiry_entry *entry;
+
+    pthread_mutex_lock(&queue->mutex);
+    entry = queue->head;
+    if (entry && (now == 0 || entry->expires <= now)) {
+        queue->head = entry->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        entry->next = NULL;
+    } else
+        entry = NULL;
+    pthread_mutex_unlock(&queue->mutex);
+    return entry;
+}
@@ -0,0 +1,80 @@
+#ifndef __EXPIRY_H__
+#define __EXPIRY_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "trie.h"
+
+/* A hierarchical timing wheel for record TTLs.
+ *
+ * Times are whole seconds of CLOCK_MONOTONIC ("ticks").  An expiry of 0
+ * means "never".  Each level has WHEEL_SIZE slots; level n covers
+ * deltas up to WHEEL_SIZE^(n+1) ticks, and entries cascade down one
+ * level when the level below wraps.  Adding and reaping an entry is
+ * O(1) amortized, and the trie itself is never scanned.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct expiry_entry {
+    struct expiry_entry *next;
+    uint32_t expires; /* Absolute tick */
+    unsigned int strlen; /* Length of the name */
+    char key[MAX_KEY]; /* The full name, not just a node's piece of it */
+};
+
+struct expiry_wheel {
+    pthread_mutex_t mutex;
+    uint32_t now; /* Last tick that was processed */
+    struct expiry_entry *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* The current tick.  Never returns 0. */
+uint32_t expiry_now ();
+
+/* Absolute expiry for a TTL in seconds, or 0 for a TTL of 0. */
+uint32_t expiry_from_ttl (uint32_t ttl);
+
+/* Stop the clock for this thread: expiry_now returns tick until
+ * expiry_thaw.  For a writer that must make one change twice and
+ * have both runs see the same time.
+ */
+void expiry_freeze (uint32_t tick);
+void expiry_thaw ();
+
+void expiry_init (struct expiry_wheel *wheel);
+
+/* Remember that string should be reaped at tick expires. */
+void expiry_add (struct expiry_wheel *wheel, const char *string, size_t strlen, uint32_t expires);
+
+/* Advance the wheel to tick now and return the list of entries that
+ * came due.  The caller owns (and must free) the entries.  An entry
+ * only says that the name *may* have expired: it could since have been
+ * deleted or re-inserted with a new TTL.
+ */
+struct expiry_entry * expiry_advance (struct expiry_wheel *wheel, uint32_t now);
+
+/* A FIFO of names for entries that all share one TTL, such as
+ * negative entries.  Since every entry lives equally long, the
+ * queue is in expiry order, and its head is also the oldest
+ * entry to evict when over budget.
+ */
+struct expiry_queue {
+    pthread_mutex_t mutex;
+    struct expiry_entry *head, *tail;
+};
+
+void expiry_queue_init (struct expiry_queue *queue);
+
+void expiry_queue_push (struct expiry_queue *queue, const char *string, size_t strlen, uint32_t expires);
+
+/* Pop the head if it has expired by tick now, or unconditionally if
+ * now is 0.  Returns NULL if there is nothing to pop.  As with the
+ * wheel, the caller frees the entry, and the name may have changed
+ * since it was pushed.
+ */
+struct expiry_entry * expiry_queue_pop (struct expiry_queue *queue, uint32_t now);
+
+#endif /* __EXPIRY_H__ */
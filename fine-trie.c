@@ -5,27 +5,81 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "trie.h"
+#include "expiry.h"
+#include "cursor.h"
+#include "hashindex.h"
+#include "bloom.h"
+#include "lookupcache.h"
+#include "locks.h"
+#include "async.h"
+#include "waitq.h"
+#include "hazard.h"
 
 struct trie_node {
     struct trie_node *next;  /* parent list */
     unsigned int strlen; /* Length of the key */
-    int32_t ip4_address; /* 4 octets */
+    struct wordlock lock; /* Fits in the padding after strlen */
+    volatile unsigned int seq; /* Odd while a writer changes what lookups read, and for good once unlinked */
+    struct rrset records; /* The name's records, if present */
+    unsigned char present; /* Does this node hold a value? */
+    uint32_t expires; /* Tick when the value or negative entry expires, 0 = never */
+    unsigned char negative; /* A cached "known absent" entry rather than a value */
+    struct index_entry *indexed; /* In the hash index, if it is on */
+    unsigned char filtered; /* Counted in the filter, if it is on */
+    uint64_t filter_hash; /* Of the full name, to remove it from the filter */
     struct trie_node *children; /* Sorted list of children */
     char key[MAX_KEY]; /* Up to MAX_KEY chars */
-    pthread_mutex_t mutex;
+};
+
+/* What _insert stores at a name */
+struct new_value {
+    const struct record *record; /* Record to add, NULL for a negative entry */
+    uint32_t expires; /* Tick when it expires, 0 = never */
+    int negative; /* Store a negative entry instead of a record */
+    int append; /* Add to a live record set, rather than failing */
+    const char *name; /* The full name, for the hash index */
+    size_t name_len;
+    int replace; /* Overwrite a live value too (upsert) */
+};
+
+/* Best match so far in search_longest_suffix */
+struct suffix_match {
+    int found;
+    size_t rest; /* Length of the string in front of the match */
+    int32_t ip4_address;
 };
 
 static struct trie_node * root = NULL;
 static int node_count = 0;
 static int max_count = 100;  //Try to stay under 100 nodes
+static struct expiry_wheel wheel;
+static int negative_count = 0;
+static int max_negative = 20;  //Negative entries get their own, smaller budget
+static uint32_t negative_ttl = 5;  //Seconds
+static struct expiry_queue negative_queue;
+static struct hash_index name_index;
+static struct expiry_queue prune_queue;  //Names whose emptied nodes await unlinking
+extern int use_hash_index;
+static struct bloom filter;
+extern int use_filter;
+extern int use_cache;
 static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t root_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t node_count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
+static volatile unsigned int batch_seq = 0;  //Odd while a batch holds delete_mutex
+static struct hazard_list retired;  //Unlinked nodes, under delete_mutex
 extern int separate_delete_thread;
 
-struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_address) {
+void set_value (struct trie_node *node, const struct new_value *value);
+
+/* Make a node for string, holding value if it isn't NULL.  Returns
+ * it locked, so index lookups that find it before it is linked in
+ * take the walk, which can only reach it once it is.
+ */
+struct trie_node * new_leaf (const char *string, size_t strlen, const struct new_value *value) {
     struct trie_node *new_node = malloc(sizeof(struct trie_node));
     pthread_mutex_lock(&node_count_mutex);
     node_count++;
@@ -40,14 +94,85 @@ struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_addr
     new_node->strlen = strlen;
     strncpy(new_node->key, string, strlen);
     new_node->key[strlen] = '\0';
-    new_node->ip4_address = ip4_address;
+    rrset_init(&new_node->records);
+    new_node->indexed = NULL;
+    new_node->filtered = 0;
+    new_node->present = 0;
+    new_node->expires = 0;
+    new_node->negative = 0;
     new_node->children = NULL;
-    int err = pthread_mutex_init(&(new_node->mutex), NULL);
-    if (err)
-        printf("Failed to initialize mutex: %d\n", err);
+    new_node->seq = 0;
+    wordlock_init(&new_node->lock);
+    wordlock_lock(&(new_node->lock));
+    __sync_synchronize();  //Before anyone can link it in
+    // The index may hand it out from here on, but only as busy
+    if (value)
+        set_value(new_node, value);
     return new_node;
 }
 
+/* Does this node hold a value that has not expired by tick now? */
+int live_value (struct trie_node *node, uint32_t now) {
+    return node->present && (node->expires == 0 || node->expires > now);
+}
+
+/* Does this node hold nothing at all, not even a negative entry? */
+int empty_node (struct trie_node *node) {
+    return !node->present && !node->negative;
+}
+
+/* Store a record or a negative entry, or clear the node if value
+ * is NULL, keeping negative_count in step.
+ */
+void set_value (struct trie_node *node, const struct new_value *value) {
+    int negative = value && value->negative;
+
+    pthread_mutex_lock(&node_count_mutex);
+    negative_count += negative - node->negative;
+    pthread_mutex_unlock(&node_count_mutex);
+    seq_write_begin(&node->seq);
+    node->negative = negative;
+
+    // Appending to a live set keeps its records and its TTL
+    if (!value || !value->append || !live_value(node, expiry_now())) {
+        rrset_clear(&node->records);
+        node->expires = value ? value->expires : 0;
+    }
+    if (value && value->record)
+        rrset_add(&node->records, value->record);
+    node->present = (node->records.count > 0);
+    seq_write_end(&node->seq);
+
+    // Index exactly the nodes that hold something
+    if (use_hash_index) {
+        if (!empty_node(node) && !node->indexed)
+            node->indexed = index_add(&name_index, value->name, value->name_len, node);
+        else if (empty_node(node) && node->indexed) {
+            index_remove(&name_index, node->indexed);
+            node->indexed = NULL;
+        }
+    }
+    if (use_filter) {
+        if (!empty_node(node) && !node->filtered) {
+            node->filter_hash = bloom_hash(value->name, value->name_len);
+            bloom_add(&filter, node->filter_hash);
+            node->filtered = 1;
+        } else if (empty_node(node) && node->filtered) {
+            bloom_remove(&filter, node->filter_hash);
+            node->filtered = 0;
+        }
+    }
+    if (use_cache)
+        cache_invalidate();
+}
+
+/* Would clear_one remove what this node holds? */
+int deletable (struct trie_node *node, uint32_t expired_by, int negative) {
+    if (negative ? !node->negative : !node->present)
+        return 0;
+    return !expired_by || (node->expires && node->expires <= expired_by);
+}
+
 // Compare strings backward.  Unlike strncmp, we assume
 // that we will not stop at a null termination, only after
 // n chars (or a difference).  Base code borrowed from musl
@@ -100,6 +225,11 @@ int compare_keys_substring (const char *string1, int len1, const char *string2,
 
 void init(int numthreads) {
     root = NULL;
+    expiry_init(&wheel);
+    expiry_queue_init(&negative_queue);
+    expiry_queue_init(&prune_queue);
+    bloom_init(&filter);
+    index_init(&name_index, 1);
 }
 
 void shutdown_delete_thread() {
@@ -112,7 +242,7 @@ void shutdown_delete_thread() {
 }
 
 /* Recursive helper function.
- * Returns a pointer to the node if found.
+ * Returns a pointer to the node if found, still locked.
  * Stores an optional pointer to the 
  * parent, or what should be the parent if not found.
  * 
@@ -127,7 +257,7 @@ _search (struct trie_node *node, const char *string, size_t strlen, struct trie_
         if (!prev_node)
             pthread_mutex_unlock(&root_mutex);
         else
-            pthread_mutex_unlock(&(prev_node->mutex));
+            wordlock_unlock(&(prev_node->lock));
         return NULL;
     }
 
@@ -137,9 +267,9 @@ _search (struct trie_node *node, const char *string, size_t strlen, struct trie_
     assert(node->strlen < MAX_KEY);
 
     // Check if nodes are locked
-    assert(pthread_mutex_trylock(&(node->mutex)));
+    assert(wordlock_trylock(&(node->lock)));
     if (prev_node)
-        assert(pthread_mutex_trylock(&(prev_node->mutex)));
+        assert(wordlock_trylock(&(prev_node->lock)));
 
     // See if this key is a substring of the string passed in
     cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
@@ -148,35 +278,35 @@ _search (struct trie_node *node, const char *string, size_t strlen, struct trie_
 
         // If this key is longer than our search string, the key isn't here
         if (node->strlen > keylen) {
-            pthread_mutex_unlock(&(node->mutex));
+            wordlock_unlock(&(node->lock));
             if (!prev_node)
                 pthread_mutex_unlock(&root_mutex);
             else
-                pthread_mutex_unlock(&(prev_node->mutex));
+                wordlock_unlock(&(prev_node->lock));
             return NULL;
         } else if (strlen > keylen) {
             // Recur on children list
             if (!node->children) {
-                pthread_mutex_unlock(&(node->mutex));
+                wordlock_unlock(&(node->lock));
                 if (!prev_node)
                     pthread_mutex_unlock(&root_mutex);
                 else
-                    pthread_mutex_unlock(&(prev_node->mutex));
+                    wordlock_unlock(&(prev_node->lock));
                 return NULL;
             }
-            pthread_mutex_lock(&(node->children->mutex));
+            wordlock_lock(&(node->children->lock));
             if (!prev_node)
                 pthread_mutex_unlock(&root_mutex);
             else
-                pthread_mutex_unlock(&(prev_node->mutex));
+                wordlock_unlock(&(prev_node->lock));
             return _search(node->children, string, strlen - keylen, node);
         } else {
             assert (strlen == keylen);
-            pthread_mutex_unlock(&(node->mutex));
+            // Leave the found node locked, so the caller can read its records
             if (!prev_node)
                 pthread_mutex_unlock(&root_mutex);
             else
-                pthread_mutex_unlock(&(prev_node->mutex));
+                wordlock_unlock(&(prev_node->lock));
             return node;
         }
 
@@ -185,33 +315,294 @@ _search (struct trie_node *node, const char *string, size_t strlen, struct trie_
         if (cmp < 0) {
             // No, look right (the node's key is "less" than the search key)
             if (!node->next) {
-                pthread_mutex_unlock(&(node->mutex));
+                wordlock_unlock(&(node->lock));
                 if (!prev_node)
                     pthread_mutex_unlock(&root_mutex);
                 else
-                    pthread_mutex_unlock(&(prev_node->mutex));
+                    wordlock_unlock(&(prev_node->lock));
                 return NULL;
             }
-            pthread_mutex_lock(&(node->next->mutex));
+            wordlock_lock(&(node->next->lock));
             if (!prev_node)
                 pthread_mutex_unlock(&root_mutex);
             else
-                pthread_mutex_unlock(&(prev_node->mutex));
+                wordlock_unlock(&(prev_node->lock));
             return _search(node->next, string, strlen, node);
         } else {
             // Quit early
-            pthread_mutex_unlock(&(node->mutex));
+            wordlock_unlock(&(node->lock));
             if (!prev_node)
                 pthread_mutex_unlock(&root_mutex);
             else
-                pthread_mutex_unlock(&(prev_node->mutex));
+                wordlock_unlock(&(prev_node->lock));
             return 0;
         }
     }
 }
 
+/* Lock the node if nobody else holds it, for index_find */
+int pin_node (void *node) {
+    return wordlock_trylock(&(((struct trie_node *) node)->lock)) == 0;
+}
+
+/* Exact-match search.  Returns the node locked, or NULL.  The hash
+ * index answers without locking any path, unless the node is busy,
+ * in which case we queue for it with a walk down the tree.  Pass
+ * gated unless the caller already holds delete_mutex.
+ */
+struct trie_node * find_exact (const char *string, size_t strlen, int gated) {
+    int busy = 0;
+
+    // While a batch runs, everyone else must queue at delete_mutex
+    if (use_hash_index && !(gated && (batch_seq & 1))) {
+        struct trie_node *found = index_find(&name_index, string, strlen, pin_node, &busy);
+        if (!busy)
+            return found;
+    }
+
+    if (gated)
+        pthread_mutex_lock(&delete_mutex);
+    pthread_mutex_lock(&root_mutex);
+    if (gated)
+        pthread_mutex_unlock(&delete_mutex);
+    if (!root) {
+        pthread_mutex_unlock(&root_mutex);
+        return NULL;
+    }
+    wordlock_lock(&(root->lock));
+    return _search(root, string, strlen, NULL);
+}
+
 int search  (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+/* Lock-free exact-match lookup, which writes nothing but this thread's
+ * hazard pointers.  At each step it reads the node under its sequence
+ * count, publishes a hazard pointer on the next node, and then checks
+ * that the node it is leaving is unchanged.  That proves the next node
+ * was still linked when the hazard went up, so the pruner won't free
+ * it; any change sends us back to the root.  Returns a LOOKUP_*
+ * result, filling in ip, has_a and expires as lookup does, or -1 if
+ * the A record is out of line, where only a locked reader may look.
+ */
+int _lookup_free (const char *string, size_t strlen, uint32_t now,
+        int32_t *ip, int *has_a, uint32_t *expires) {
+    struct hazard_record *me = hazard_mine();
+    struct trie_node *node, *next;
+    unsigned int seq, next_seq;
+    size_t left;
+    int keylen, cmp, slot, res;
+
+retry:
+    node = *(struct trie_node * volatile *) &root;
+    if (!node) {
+        hazard_clear(me);
+        return LOOKUP_MISS;
+    }
+    slot = 0;
+    hazard_set(me, slot, node);
+    if (node != root)
+        goto retry;
+    seq = node->seq;
+    __sync_synchronize();
+    if ((seq & 1) || node != root)
+        goto retry;
+    left = strlen;
+
+    while (1) {
+        next = NULL;
+        res = LOOKUP_MISS;
+        cmp = compare_keys_substring(node->key, node->strlen, string, left, &keylen);
+        if (cmp == 0) {
+            // Either the key isn't here, or it's below, or this is it
+            if (node->strlen > keylen)
+                ;
+            else if (left > keylen)
+                next = node->children;
+            else if (live_value(node, now)) {
+                *expires = node->expires;
+                *has_a = (node->records.first.type == RR_A);
+                *ip = node->records.first.data.a;
+                res = *has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+                if (!*has_a && node->records.count > 1)
+                    res = -1;
+            } else if (node->negative && node->expires > now) {
+                res = LOOKUP_NEGATIVE;
+                *expires = node->expires;
+            }
+        } else if (compare_keys(node->key, node->strlen, string, left, NULL) < 0)
+            next = node->next;
+
+        if (!next) {
+            if (seq_read_retry(&node->seq, seq))
+                goto retry;
+            hazard_clear(me);
+            return res;
+        }
+
+        hazard_set(me, !slot, next);
+        if (node->seq != seq)
+            goto retry;
+        next_seq = next->seq;
+        __sync_synchronize();
+        if ((next_seq & 1) || node->seq != seq)
+            goto retry;
+        if (cmp == 0)
+            left -= keylen;
+        node = next;
+        seq = next_seq;
+        slot = !slot;
+    }
+}
+
+int lookup  (const char *string, size_t strlen, int32_t *ip4_address) {
     struct trie_node *found;
+    uint32_t now = expiry_now();
+    int res = LOOKUP_MISS;
+    int32_t ip = 0;
+    int has_a = 0;
+    uint32_t expires = 0;
+    unsigned long epoch = cache_epoch();
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    // Hot names are answered from this thread's cache, without locks
+    if (use_cache && cache_get(string, strlen, epoch, now, &res, ip4_address))
+        return res;
+
+    // Most absent names stop here, without any locks
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return LOOKUP_MISS;
+
+    /* Walk without locks, unless the hash index would answer anyway.
+     * A batch that starts or ends meanwhile could be half seen, so
+     * then we ask again the locked way, queueing behind it. */
+    if (!use_hash_index) {
+        unsigned int batch = batch_seq;
+        __sync_synchronize();
+        if (!(batch & 1)) {
+            res = _lookup_free(string, strlen, now, &ip, &has_a, &expires);
+            if (res >= 0 && !seq_read_retry(&batch_seq, batch))
+                goto done;
+        }
+        res = LOOKUP_MISS;
+        has_a = 0;
+        expires = 0;
+    }
+
+    found = find_exact(string, strlen, 1);
+
+    if (found && live_value(found, now)) {
+        has_a = rrset_find_a(&found->records, &ip);
+        res = has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+        expires = found->expires;
+    } else if (found && found->negative && found->expires > now) {
+        res = LOOKUP_NEGATIVE;
+        expires = found->expires;
+    }
+    if (found)
+        wordlock_unlock(&(found->lock));
+
+done:
+    if (use_filter && res == LOOKUP_MISS)
+        bloom_false_positive(&filter);
+    if (use_cache)
+        cache_put(string, strlen, epoch, res, has_a, ip, expires);
+    if (ip4_address && has_a)
+        *ip4_address = ip;
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    struct trie_node *found;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return 0;
+
+    found = find_exact(string, strlen, 1);
+
+    if (found) {
+        if (live_value(found, expiry_now())) {
+            fn(&found->records, arg);
+            res = 1;
+        }
+        wordlock_unlock(&(found->lock));
+    }
+    return res;
+}
+
+/* Recursive helper for search_longest_suffix.  Walks the same path
+ * as _search, hand-over-hand, and copies out the deepest live value
+ * that ends on a label boundary while its node is still locked.
+ */
+void
+_search_suffix (struct trie_node *node, const char *string, size_t strlen,
+        uint32_t now, struct suffix_match *match, struct trie_node *prev_node) {
+
+    int keylen, cmp;
+    struct trie_node *next = NULL;
+    size_t next_strlen = strlen;
+
+    // First things first, check if we are NULL 
+    if (node == NULL) {
+        if (!prev_node)
+            pthread_mutex_unlock(&root_mutex);
+        else
+            wordlock_unlock(&(prev_node->lock));
+        return;
+    }
+
+    assert(node->strlen < MAX_KEY);
+
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // This node is on the path unless its key is longer than the string
+        if (node->strlen <= keylen) {
+            if (live_value(node, now) && (strlen == keylen || string[strlen - keylen - 1] == '.')) {
+                match->found = 1;
+                match->rest = strlen - keylen;
+                match->ip4_address = 0;
+                rrset_find_a(&node->records, &match->ip4_address);
+            }
+            if (strlen > keylen) {
+                next = node->children;
+                next_strlen = strlen - keylen;
+            }
+        }
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0)
+            next = node->next;
+    }
+
+    if (!next) {
+        wordlock_unlock(&(node->lock));
+        if (!prev_node)
+            pthread_mutex_unlock(&root_mutex);
+        else
+            wordlock_unlock(&(prev_node->lock));
+        return;
+    }
+    wordlock_lock(&(next->lock));
+    if (!prev_node)
+        pthread_mutex_unlock(&root_mutex);
+    else
+        wordlock_unlock(&(prev_node->lock));
+    _search_suffix(next, string, next_strlen, now, match, node);
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    struct suffix_match match = { 0, 0, 0 };
 
     // Skip strings of length 0
     if (strlen == 0)
@@ -224,17 +615,138 @@ int search  (const char *string, size_t strlen, int32_t *ip4_address) {
         pthread_mutex_unlock(&root_mutex);
         return 0;
     }
-    pthread_mutex_lock(&(root->mutex));
-    found = _search(root, string, strlen, NULL);
+    wordlock_lock(&(root->lock));
+    _search_suffix(root, string, strlen, expiry_now(), &match, NULL);
+
+    if (match.found) {
+        if (ip4_address)
+            *ip4_address = match.ip4_address;
+        if (suffix_len)
+            *suffix_len = strlen - match.rest;
+    }
+    return match.found;
+}
 
-    if (found && ip4_address)
-        *ip4_address = found->ip4_address;
+/* Recursive helper for cursor_next.  name is a MAX_KEY buffer whose
+ * last namelen bytes hold the full name of node's parent.  Walks node
+ * and its later siblings, which the caller has locked node for;
+ * children are locked before the parent is let go, and siblings
+ * hand-over-hand, so only the path from the root is ever held.
+ * Unlocks node (and root_mutex, if held_root is set) before
+ * returning.  Returns 1 once the walk should stop.
+ */
+int _cursor_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        struct trie_cursor *cursor, int *left, int held_root,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+
+    while (1) {
+        struct trie_node *next;
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+        int want, stop = 0;
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        want = cursor_check(cursor, start, strlen);
+        if (want & CURSOR_STOP)
+            stop = 1;
+        else if ((want & CURSOR_EMIT) && live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            cursor_advance(cursor, start, strlen);
+            stop = (--*left == 0);
+        }
+        if (!stop && (want & CURSOR_DESCEND) && node->children) {
+            wordlock_lock(&(node->children->lock));
+            stop = _cursor_walk(node->children, name, strlen, now, cursor, left, 0, fn, arg);
+        }
 
-    return (found != NULL);
+        next = stop ? NULL : node->next;
+        if (next)
+            wordlock_lock(&(next->lock));
+        wordlock_unlock(&(node->lock));
+        if (held_root) {
+            pthread_mutex_unlock(&root_mutex);
+            held_root = 0;
+        }
+        if (!next)
+            return stop;
+        node = next;
+    }
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    int left = max;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    pthread_mutex_lock(&delete_mutex);
+    pthread_mutex_lock(&root_mutex);
+    pthread_mutex_unlock(&delete_mutex);
+    if (!root)
+        pthread_mutex_unlock(&root_mutex);
+    else {
+        wordlock_lock(&(root->lock));
+        _cursor_walk(root, name, 0, expiry_now(), cursor, &left, 1, fn, arg);
+    }
+
+    // A page that isn't full means the walk ran out of names
+    if (left > 0)
+        cursor->done = 1;
+    return max - left;
+}
+
+/* The hand-over-hand walk of a lookup, then a change under the found
+ * node's lock; unlike _insert, no parent stays locked.
+ */
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    struct trie_node *found;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    found = find_exact(string, strlen, 1);
+    if (found) {
+        seq_write_begin(&found->seq);
+        if (live_value(found, expiry_now()))
+            res = rrset_set_a(&found->records, ip4_address);
+        seq_write_end(&found->seq);
+        if (res && use_cache)
+            cache_invalidate();
+        wordlock_unlock(&(found->lock));
+    }
+    return res;
+}
+
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    struct trie_node *found;
+    int32_t ip;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    found = find_exact(string, strlen, 1);
+    if (found) {
+        seq_write_begin(&found->seq);
+        if (live_value(found, expiry_now())
+                && rrset_find_a(&found->records, &ip) && ip == expected)
+            res = rrset_set_a(&found->records, ip4_address);
+        seq_write_end(&found->seq);
+        if (res && use_cache)
+            cache_invalidate();
+        wordlock_unlock(&(found->lock));
+    }
+    return res;
 }
 
 /* Recursive helper function */
-int _insert (const char *string, size_t strlen, int32_t ip4_address, 
+int _insert (const char *string, size_t strlen, const struct new_value *value,
         struct trie_node *node, struct trie_node *parent, struct trie_node *left) {
 
     int cmp, keylen;
@@ -247,10 +759,10 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
     // Check that parent, left, and node are locked
     if (parent)
-        assert(pthread_mutex_trylock(&(parent->mutex)));
+        assert(wordlock_trylock(&(parent->lock)));
     if (left)
-        assert(pthread_mutex_trylock(&(left->mutex)));
-    assert(pthread_mutex_trylock(&(node->mutex)));
+        assert(wordlock_trylock(&(left->lock)));
+    assert(wordlock_trylock(&(node->lock)));
 
     // Take the minimum of the two lengths
     cmp = compare_keys_substring (node->key, node->strlen, string, strlen, &keylen);
@@ -264,8 +776,9 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert(keylen == strlen);
             assert((!parent) || parent->children == node);
 
-            new_node = new_leaf (string, strlen, ip4_address);
-            pthread_mutex_lock(&(new_node->mutex));
+            new_node = new_leaf (string, strlen, value);
+            // Lookups must not see node cut short until new_node is above it
+            seq_write_begin(&node->seq);
             node->strlen -= keylen;
             new_node->children = node;
             new_node->next = node->next;
@@ -274,15 +787,20 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert ((!parent) || (!left));
 
             if (parent) {
+                seq_write_begin(&parent->seq);
                 parent->children = new_node;
-                pthread_mutex_unlock(&(parent->mutex));
+                seq_write_end(&parent->seq);
+                wordlock_unlock(&(parent->lock));
             } else if (left) {
+                seq_write_begin(&left->seq);
                 left->next = new_node;
-                pthread_mutex_unlock(&(left->mutex));
+                seq_write_end(&left->seq);
+                wordlock_unlock(&(left->lock));
             } else if ((!parent) || (!left))
                 root = new_node;
-            pthread_mutex_unlock(&(new_node->mutex));
-            pthread_mutex_unlock(&(node->mutex));
+            seq_write_end(&node->seq);
+            wordlock_unlock(&(new_node->lock));
+            wordlock_unlock(&(node->lock));
             if (!parent && !left)
                 pthread_mutex_unlock(&root_mutex);
             return 1;
@@ -292,44 +810,45 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
                 pthread_mutex_unlock(&root_mutex);
             if (node->children == NULL) {
                 // Insert leaf here
-                new_node = new_leaf (string, strlen - keylen, ip4_address);
-                pthread_mutex_lock(&(new_node->mutex));
+                new_node = new_leaf (string, strlen - keylen, value);
+                seq_write_begin(&node->seq);
                 node->children = new_node;
+                seq_write_end(&node->seq);
                 if (parent)
-                    pthread_mutex_unlock(&(parent->mutex));
+                    wordlock_unlock(&(parent->lock));
                 if (left)
-                    pthread_mutex_unlock(&(left->mutex));
-                pthread_mutex_unlock(&(node->mutex));
-                pthread_mutex_unlock(&(new_node->mutex));
+                    wordlock_unlock(&(left->lock));
+                wordlock_unlock(&(node->lock));
+                wordlock_unlock(&(new_node->lock));
                 return 1;
             } else {
                 // Recur on children list, store "parent" (loosely defined)
-                pthread_mutex_lock(&(node->children->mutex));
+                wordlock_lock(&(node->children->lock));
                 if (parent)
-                    pthread_mutex_unlock(&(parent->mutex));
+                    wordlock_unlock(&(parent->lock));
                 if (left)
-                    pthread_mutex_unlock(&(left->mutex));
-                return _insert(string, strlen - keylen, ip4_address,
+                    wordlock_unlock(&(left->lock));
+                return _insert(string, strlen - keylen, value,
                         node->children, node, NULL);
             }
         } else {
             if (!parent && !left)
                 pthread_mutex_unlock(&root_mutex);
             assert (strlen == keylen);
-            if (node->ip4_address == 0) {
-                node->ip4_address = ip4_address;
+            if (value->append || value->replace || !live_value(node, expiry_now())) {
+                set_value(node, value);
                 if (parent)
-                    pthread_mutex_unlock(&(parent->mutex));
+                    wordlock_unlock(&(parent->lock));
                 if (left)
-                    pthread_mutex_unlock(&(left->mutex));
-                pthread_mutex_unlock(&(node->mutex));
+                    wordlock_unlock(&(left->lock));
+                wordlock_unlock(&(node->lock));
                 return 1;
             } else {
                 if (parent)
-                    pthread_mutex_unlock(&(parent->mutex));
+                    wordlock_unlock(&(parent->lock));
                 if (left)
-                    pthread_mutex_unlock(&(left->mutex));
-                pthread_mutex_unlock(&(node->mutex));
+                    wordlock_unlock(&(left->lock));
+                wordlock_unlock(&(node->lock));
                 return 0;
             }
         }
@@ -350,9 +869,10 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
         if (overlap) {
             // Insert a common parent, recur
             int offset = strlen - keylen2;
-            new_node = new_leaf (&string[offset], keylen2, 0);
-            pthread_mutex_lock(&(new_node->mutex));
+            new_node = new_leaf (&string[offset], keylen2, NULL);
             assert ((node->strlen - keylen2) > 0);
+            // As above, node stays odd until new_node is linked in
+            seq_write_begin(&node->seq);
             node->strlen -= keylen2;
             new_node->children = node;
             new_node->next = node->next;
@@ -360,26 +880,31 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert ((!parent) || (!left));
 
             if (parent)
-                assert(pthread_mutex_trylock(&(parent->mutex)));
+                assert(wordlock_trylock(&(parent->lock)));
             if (left)
-                assert(pthread_mutex_trylock(&(left->mutex)));
-            assert(pthread_mutex_trylock(&(node->mutex)));
+                assert(wordlock_trylock(&(left->lock)));
+            assert(wordlock_trylock(&(node->lock)));
 
             if (node == root) {
                 root = new_node;
             } else if (parent) {
                 assert(parent->children == node);
+                seq_write_begin(&parent->seq);
                 parent->children = new_node;
-                pthread_mutex_unlock(&(parent->mutex));
+                seq_write_end(&parent->seq);
+                wordlock_unlock(&(parent->lock));
             } else if (left) {
                 assert(left->next == node);
+                seq_write_begin(&left->seq);
                 left->next = new_node;
-                pthread_mutex_unlock(&(left->mutex));
+                seq_write_end(&left->seq);
+                wordlock_unlock(&(left->lock));
             } else if ((!parent) && (!left))
                 root = new_node;
+            seq_write_end(&node->seq);
             if (!parent && !left)
                 pthread_mutex_unlock(&root_mutex);
-            return _insert(string, offset, ip4_address, node, new_node, NULL);
+            return _insert(string, offset, value, node, new_node, NULL);
         } else {
             cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
             if (cmp < 0) {
@@ -387,42 +912,48 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
                 if (!parent && !left)
                     pthread_mutex_unlock(&root_mutex);
                 if (node->next) {
-                    pthread_mutex_lock(&(node->next->mutex));
+                    wordlock_lock(&(node->next->lock));
                     if (parent)
-                        pthread_mutex_unlock(&(parent->mutex));
+                        wordlock_unlock(&(parent->lock));
                     if (left)
-                        pthread_mutex_unlock(&(left->mutex));
-                    return _insert(string, strlen, ip4_address, node->next, NULL, node);
+                        wordlock_unlock(&(left->lock));
+                    return _insert(string, strlen, value, node->next, NULL, node);
                 } else {
                     // Insert here
-                    new_node = new_leaf (string, strlen, ip4_address);
-                    pthread_mutex_lock(&(new_node->mutex));
+                    new_node = new_leaf (string, strlen, value);
+                    seq_write_begin(&node->seq);
                     node->next = new_node;
+                    seq_write_end(&node->seq);
                     if (parent)
-                        pthread_mutex_unlock(&(parent->mutex));
+                        wordlock_unlock(&(parent->lock));
                     if (left)
-                        pthread_mutex_unlock(&(left->mutex));
-                    pthread_mutex_unlock(&(node->mutex));
-                    pthread_mutex_unlock(&(new_node->mutex));
+                        wordlock_unlock(&(left->lock));
+                    wordlock_unlock(&(node->lock));
+                    wordlock_unlock(&(new_node->lock));
                     return 1;
                 }
             } else {
                 // Insert here
-                new_node = new_leaf (string, strlen, ip4_address);
-                pthread_mutex_lock(&(new_node->mutex));
+                new_node = new_leaf (string, strlen, value);
                 new_node->next = node;
+                __sync_synchronize();
                 if (node == root) {
                     root = new_node;
-                } else if (parent && parent->children == node)
+                } else if (parent && parent->children == node) {
+                    seq_write_begin(&parent->seq);
                     parent->children = new_node;
-                else if (left && left->next == node)
+                    seq_write_end(&parent->seq);
+                } else if (left && left->next == node) {
+                    seq_write_begin(&left->seq);
                     left->next = new_node;
-                pthread_mutex_unlock(&(new_node->mutex));
+                    seq_write_end(&left->seq);
+                }
+                wordlock_unlock(&(new_node->lock));
                 if (parent)
-                    pthread_mutex_unlock(&(parent->mutex));
+                    wordlock_unlock(&(parent->lock));
                 if (left)
-                    pthread_mutex_unlock(&(left->mutex));
-                pthread_mutex_unlock(&(node->mutex));
+                    wordlock_unlock(&(left->lock));
+                wordlock_unlock(&(node->lock));
                 if (!parent && !left)
                     pthread_mutex_unlock(&root_mutex);
                 return 1;
@@ -433,44 +964,101 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
 void assert_invariants();
 
+int insert_value (const char *string, size_t strlen, const struct new_value *value, int gated);
+
 int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+/* One try at a squatting insert, for waitq_until */
+int try_insert (void *arg) {
+    const struct new_value *value = arg;
+    return insert_value(value->name, value->name_len, value, 1);
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &value);
+    return insert_value(string, strlen, &value, 1);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, string, strlen };
+    return insert_value(string, strlen, &value, 1);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    struct new_value value = { record, 0, 0, 1, string, strlen };
+    return insert_value(string, strlen, &value, 1);
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen, 1 };
+    return insert_value(string, strlen, &value, 1);
+}
+
+/* Common code for inserting a value or a negative entry.  Pass gated
+ * unless the caller holds delete_mutex.
+ */
+int insert_value (const char *string, size_t strlen, const struct new_value *value, int gated) {
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
-    pthread_mutex_lock(&delete_mutex);
+    if (gated)
+        pthread_mutex_lock(&delete_mutex);
     pthread_mutex_lock(&root_mutex);
-    pthread_mutex_unlock(&delete_mutex);
+    if (gated)
+        pthread_mutex_unlock(&delete_mutex);
     int res;
     /* Edge case: root is null */
     if (root == NULL) {
-        root = new_leaf (string, strlen, ip4_address);
+        root = new_leaf (string, strlen, value);
+        wordlock_unlock(&(root->lock));
         pthread_mutex_unlock(&root_mutex);
-        return 1;
+        res = 1;
+    } else {
+        wordlock_lock(&(root->lock));
+        res = _insert(string, strlen, value, root, NULL, NULL);
+        //assert_invariants();
+        if (gated)
+            pthread_mutex_lock(&delete_mutex);
+        if ((node_count >= max_count || negative_count > max_negative) && separate_delete_thread)
+            pthread_cond_signal(&delete_cond);
+        if (gated)
+            pthread_mutex_unlock(&delete_mutex);
     }
-    pthread_mutex_lock(&(root->mutex));
-    res = _insert (string, strlen, ip4_address, root, NULL, NULL);
-    //assert_invariants();
-    pthread_mutex_lock(&delete_mutex);
-    if (node_count >= max_count  && separate_delete_thread)
-        pthread_cond_signal(&delete_cond);
-    pthread_mutex_unlock(&delete_mutex);
+
+    if (res && value->negative)
+        expiry_queue_push(&negative_queue, string, strlen, value->expires);
+    else if (res)
+        expiry_add(&wheel, string, strlen, value->expires);
     return res;
 }
 
+/* Mark a node that is about to be unlinked, so lookups that reach it
+ * from now on start again.  Its count stays odd for good.
+ */
+void retire_begin (struct trie_node *node) {
+    seq_write_begin(&node->seq);
+}
+
 /* Recursive helper function.
- * Returns a pointer to the node if found.
- * Stores an optional pointer to the 
- * parent, or what should be the parent if not found.
- * 
+ * Unlinks and retires the emptied nodes on the path to string, with
+ * every lock on the path held until its frame returns.  Returns a
+ * non-NULL pointer if the name's own node was empty.  Values are
+ * never cleared here; see clear_one.
  */
 struct trie_node * 
-_delete (struct trie_node *node, const char *string, 
+_prune (struct trie_node *node, const char *string, 
         size_t strlen, int unlock_root) {
     int keylen, cmp;
 
     /* Locking note:
-     * When _delete is called, node->mutex should ALREADY BE LOCKED 
+     * When _prune is called, node->lock should ALREADY BE LOCKED 
      */
 
     // First things first, check if we are NULL 
@@ -479,7 +1067,7 @@ _delete (struct trie_node *node, const char *string,
     assert(node->strlen < MAX_KEY);
 
     // Check if node is locked
-    assert(pthread_mutex_trylock(&(node->mutex)));
+    assert(wordlock_trylock(&(node->lock)));
 
 
     // See if this key is a substring of the string passed in
@@ -489,7 +1077,7 @@ _delete (struct trie_node *node, const char *string,
 
         // If this key is longer than our search string, the key isn't here
         if (node->strlen > keylen) {
-            pthread_mutex_unlock(&(node->mutex));
+            wordlock_unlock(&(node->lock));
             if (unlock_root)
                 pthread_mutex_unlock(&root_mutex);
             return NULL;
@@ -501,82 +1089,86 @@ _delete (struct trie_node *node, const char *string,
              */
 
             if (node->children)
-                pthread_mutex_lock(&(node->children->mutex));
+                wordlock_lock(&(node->children->lock));
 
-            struct trie_node *found =  _delete(node->children, string, strlen - keylen, 0);
+            struct trie_node *found =  _prune(node->children, string, strlen - keylen, 0);
             /* After the above returns, the lock on node->children should be free again. */
 
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
 
                     assert(node->children == found);
+                    retire_begin(found);
+                    seq_write_begin(&node->seq);
                     node->children = found->next;
+                    seq_write_end(&node->seq);
 
                     /* Locking note:
                      * Since we are freeing the current node, the parent must be locked.
                      * That's why unlocking is safe here.
                      */
-                    free(found);
+                    hazard_retire(&retired, found);
                     pthread_mutex_lock(&node_count_mutex);
                     node_count--;
                     pthread_mutex_unlock(&node_count_mutex);
                 }
 
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     /* Locking note:
                      * Since we are changing the root, we must aquire the lock on root->next
                      */
                     if (node->next)
-                        pthread_mutex_lock(&(node->next->mutex));
+                        wordlock_lock(&(node->next->lock));
 
+                    retire_begin(node);
                     root = node->next;
-                    pthread_mutex_unlock(&(node->mutex));
-                    free(node);
+                    wordlock_unlock(&(node->lock));
+                    hazard_retire(&retired, node);
                     pthread_mutex_lock(&node_count_mutex);
                     node_count--;
                     pthread_mutex_unlock(&node_count_mutex);
 
                     /* It's safe to release the root lock now */
                     if (root)
-                        pthread_mutex_unlock(&(root->mutex));
+                        wordlock_unlock(&(root->lock));
 
                     /* No locks held right now. That's probably fine. */
                 } else
-                    pthread_mutex_unlock(&(node->mutex));
+                    wordlock_unlock(&(node->lock));
                 if (unlock_root)
                     pthread_mutex_unlock(&root_mutex);
                 return node; /* Recursively delete needless interior nodes */
-            } else pthread_mutex_unlock(&(node->mutex));
+            } else wordlock_unlock(&(node->lock));
             if (unlock_root)
                 pthread_mutex_unlock(&root_mutex);
             return NULL;
         } else {
             assert (strlen == keylen);
 
-            /* We found it! Clear the ip4 address and return. */
-            if (node->ip4_address) {
-                node->ip4_address = 0;
-
+            /* We found it!  Report it if it is still empty; someone
+             * may have re-inserted the name since it was cleared. */
+            if (empty_node(node)) {
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
 
                     /* to change the root, aquire a lock first */
                     if (node->next)
-                        pthread_mutex_lock(&(node->next->mutex));
+                        wordlock_lock(&(node->next->lock));
+                    retire_begin(node);
                     root = node->next;
                     /* Release the old root lock */
-                    pthread_mutex_unlock(&(node->mutex));
-                    free(node);
+                    wordlock_unlock(&(node->lock));
+                    hazard_retire(&retired, node);
                     node = NULL;
                     pthread_mutex_lock(&node_count_mutex);
                     node_count--;
                     pthread_mutex_unlock(&node_count_mutex);
                     /* unlock the root */
                     if (root)
-                        pthread_mutex_unlock(&(root->mutex));
+                        wordlock_unlock(&(root->lock));
                     if (unlock_root)
                         pthread_mutex_unlock(&root_mutex);
                     return (struct trie_node *) 0x100100; /* XXX: Don't use this pointer for anything except 
@@ -586,7 +1178,7 @@ _delete (struct trie_node *node, const char *string,
                                                            */
                 } else {
                     if (node)
-                        pthread_mutex_unlock(&(node->mutex));
+                        wordlock_unlock(&(node->lock));
                     if (unlock_root)
                         pthread_mutex_unlock(&root_mutex);
                     return node;
@@ -594,7 +1186,7 @@ _delete (struct trie_node *node, const char *string,
             } else {
                 /* Just an interior node with no value */
                 if (node)
-                    pthread_mutex_unlock(&(node->mutex));
+                    wordlock_unlock(&(node->lock));
                 if (unlock_root)
                     pthread_mutex_unlock(&root_mutex);
                 return NULL;
@@ -609,33 +1201,36 @@ _delete (struct trie_node *node, const char *string,
              * We must lock the next node
              */
             if (node->next)
-                pthread_mutex_lock(&(node->next->mutex));
+                wordlock_lock(&(node->next->lock));
 
-            struct trie_node *found = _delete(node->next, string, strlen, 0);
+            struct trie_node *found = _prune(node->next, string, strlen, 0);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->next == found);
+                    retire_begin(found);
+                    seq_write_begin(&node->seq);
                     node->next = found->next;
-                    free(found);
+                    seq_write_end(&node->seq);
+                    hazard_retire(&retired, found);
                     pthread_mutex_lock(&node_count_mutex);
                     node_count--;
                     pthread_mutex_unlock(&node_count_mutex);
                 }
 
-                pthread_mutex_unlock(&(node->mutex));
+                wordlock_unlock(&(node->lock));
                 if (unlock_root)
                     pthread_mutex_unlock(&root_mutex);
                 return node; /* Recursively delete needless interior nodes */
             }
-            pthread_mutex_unlock(&(node->mutex));
+            wordlock_unlock(&(node->lock));
             if (unlock_root)
                 pthread_mutex_unlock(&root_mutex);
             return NULL;
         } else {
             // Quit early
-            pthread_mutex_unlock(&(node->mutex));
+            wordlock_unlock(&(node->lock));
             if (unlock_root)
                 pthread_mutex_unlock(&root_mutex);
             return NULL;
@@ -643,54 +1238,275 @@ _delete (struct trie_node *node, const char *string,
     }
 }
 
-int delete  (const char *string, size_t strlen) {
-    // Skip strings of length 0
-    pthread_mutex_lock(&delete_mutex);
+/* Logically delete one name: find it hand-over-hand, and clear its
+ * value under just its own lock, so deletes in different subtrees run
+ * in parallel.  The emptied node stays linked, and reads as a miss,
+ * until _prune unlinks it.  Sets *prunable if the node is now an
+ * empty leaf.  If expired_by is non-zero, only clear a value that
+ * expired at or before that tick.  If negative is set, clear a
+ * negative entry instead of a value.  Pass gated unless the caller
+ * holds delete_mutex.  Wakes any squatters on a name whose value it
+ * clears.
+ */
+int clear_one (const char *string, size_t strlen, uint32_t expired_by, int negative,
+        int gated, int *prunable) {
+    struct trie_node *found = find_exact(string, strlen, gated);
+    int res = 0;
+
+    *prunable = 0;
+    if (!found)
+        return 0;
+    if (deletable(found, expired_by, negative)) {
+        set_value(found, NULL);
+        res = 1;
+    }
+    *prunable = empty_node(found) && found->children == NULL;
+    wordlock_unlock(&(found->lock));
+    if (res && !negative)
+        waitq_wake(string, strlen);
+    return res;
+}
+
+/* Unlink the emptied nodes on the path to string.  This holds the
+ * whole path, so only the delete thread (or whoever holds
+ * delete_mutex) does it, off the path of client deletes.  Returns 1
+ * if the name's node was empty.
+ */
+int prune_one (const char *string, size_t strlen) {
+    int res = 0;
+
     pthread_mutex_lock(&root_mutex);
-    pthread_mutex_unlock(&delete_mutex);
-    if (strlen == 0 || !root) {
+    if (root) {
+        wordlock_lock(&(root->lock));
+        res = (_prune(root, string, strlen, 1) != NULL);
+    } else
         pthread_mutex_unlock(&root_mutex);
+    return res;
+}
+
+/* Prune everything that client deletes have queued up, up to
+ * COMPACT_BATCH names per hold of root_mutex.  Each _prune still locks
+ * its own path below the root, and lock-free lookups don't wait at
+ * all.  Called with delete_mutex held.
+ */
+void compact() {
+    struct expiry_entry *batch[COMPACT_BATCH];
+    int i, n;
+
+    do {
+        for (n = 0; n < COMPACT_BATCH && (batch[n] = expiry_queue_pop(&prune_queue, 0)); n++)
+            ;
+        if (n == 0)
+            break;
+        pthread_mutex_lock(&root_mutex);
+        for (i = 0; i < n && root; i++) {
+            wordlock_lock(&(root->lock));
+            _prune(root, batch[i]->key, batch[i]->strlen, 0);
+        }
+        pthread_mutex_unlock(&root_mutex);
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    } while (n == COMPACT_BATCH);
+}
+
+int delete  (const char *string, size_t strlen) {
+    int prunable, res;
+
+    // Skip strings of length 0
+    if (strlen == 0)
         return 0;
-    }
-    pthread_mutex_lock(&(root->mutex));
-    int res = (NULL != _delete(root, string, strlen, 1));
+
+    res = clear_one(string, strlen, 0, 0, 1, &prunable);
+    // Leave unlinking the node to check_max_nodes
+    if (prunable)
+        expiry_queue_push(&prune_queue, string, strlen, 0);
     //assert_invariants();
     return res;
 }
 
+/* A batch holds delete_mutex throughout, so no walk can start while
+ * it runs: every walk already under way is ahead of the batch's own,
+ * and none can pass another hand-over-hand, so each sees the batch
+ * either not at all or, once it is done, all of it.  Lookups that the
+ * hash index would answer without a walk queue for delete_mutex too.
+ * Lock-free lookups take no gate either; they check that batch_seq
+ * was even and unchanged around the walk, or ask again under locks.
+ */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    uint32_t now = expiry_now();
+    int i, done = 0;
+
+    pthread_mutex_lock(&delete_mutex);
+    __sync_fetch_and_add(&batch_seq, 1);
+
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        struct trie_node *found;
+        int prunable;
+
+        op->res = 0;
+        if (op->strlen == 0)
+            continue;
+        switch (op->op) {
+            case TRIE_OP_LOOKUP:
+                found = find_exact(op->name, op->strlen, 0);
+                if (found && live_value(found, now)) {
+                    if (rrset_find_a(&found->records, &op->ip4_address))
+                        op->res = LOOKUP_FOUND;
+                } else if (found && found->negative && found->expires > now)
+                    op->res = LOOKUP_NEGATIVE;
+                if (found)
+                    wordlock_unlock(&(found->lock));
+                break;
+            case TRIE_OP_INSERT: {
+                struct record record = { .type = RR_A, .data.a = op->ip4_address };
+                struct new_value value = { &record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen };
+                op->res = insert_value(op->name, op->strlen, &value, 0);
+                break;
+            }
+            case TRIE_OP_INSERT_NEGATIVE: {
+                struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, op->name, op->strlen };
+                op->res = insert_value(op->name, op->strlen, &value, 0);
+                break;
+            }
+            case TRIE_OP_UPSERT: {
+                struct record record = { .type = RR_A, .data.a = op->ip4_address };
+                struct new_value value = { &record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen, 1 };
+                op->res = insert_value(op->name, op->strlen, &value, 0);
+                break;
+            }
+            case TRIE_OP_UPDATE:
+                found = find_exact(op->name, op->strlen, 0);
+                if (found) {
+                    seq_write_begin(&found->seq);
+                    if (live_value(found, now))
+                        op->res = rrset_set_a(&found->records, op->ip4_address);
+                    seq_write_end(&found->seq);
+                    if (op->res && use_cache)
+                        cache_invalidate();
+                    wordlock_unlock(&(found->lock));
+                }
+                break;
+            case TRIE_OP_DELETE:
+                op->res = clear_one(op->name, op->strlen, 0, 0, 0, &prunable);
+                if (prunable)
+                    expiry_queue_push(&prune_queue, op->name, op->strlen, 0);
+                break;
+            default:
+                assert(0);
+        }
+        done += (op->res != 0);
+    }
+
+    __sync_fetch_and_add(&batch_seq, 1);
+    pthread_mutex_unlock(&delete_mutex);
+    return done;
+}
+
 /* Find one node to remove from the tree. 
  * Use any policy you like to select the node.
+ * Called with delete_mutex held.
  */
 int drop_one_node() {
-    // keep root node locked while traversing to maintain path
-    pthread_mutex_lock(&(root->mutex));
-    struct trie_node *node = root;
-    assert(node->key != NULL);
+    struct trie_node *node, *next;
+    int negative = 0, prunable, cleared;
     int size = MAX_KEY-1;
     char key[size+1];
     key[size] = '\0';
+
+    // Walk hand-over-hand down the first children to a leaf
+    pthread_mutex_lock(&root_mutex);
+    if (!root) {
+        pthread_mutex_unlock(&root_mutex);
+        return 0;
+    }
+    node = root;
+    wordlock_lock(&(node->lock));
     do {
         assert(node->key != NULL);
         size -= node->strlen;
         assert(size >= 0);
         memcpy(&key[size], node->key, node->strlen);
-        if (node->children)
-            pthread_mutex_lock(&(node->children->mutex));
-        if (node != root)
-            pthread_mutex_unlock(&(node->mutex));
-    } while ((node = node->children));
-    assert(node == NULL);
-    return (_delete(root, &key[size], strlen(&key[size]), 1) != NULL);
+        negative = node->negative;
+        next = node->children;
+        if (next)
+            wordlock_lock(&(next->lock));
+        if (node == root)
+            pthread_mutex_unlock(&root_mutex);
+        wordlock_unlock(&(node->lock));
+    } while ((node = next));
+
+    // The leaf may already be an empty node waiting to be pruned
+    cleared = clear_one(&key[size], strlen(&key[size]), 0, negative, 0, &prunable);
+    return prune_one(&key[size], strlen(&key[size])) || cleared;
+}
+
+/* Delete one name's expired value or negative entry, and unlink its
+ * node straight away.  Called with delete_mutex held.
+ */
+int reap_one(const char *string, size_t strlen, uint32_t expired_by, int negative) {
+    int prunable, res;
+
+    res = clear_one(string, strlen, expired_by, negative, 0, &prunable);
+    if (prunable)
+        prune_one(string, strlen);
+    return res;
+}
+
+/* Drop the oldest negative entry.  Returns 0 if there are none.
+ * Called with delete_mutex held.
+ */
+int drop_one_negative() {
+    struct expiry_entry *entry;
+    int res = 0;
+
+    while (!res && (entry = expiry_queue_pop(&negative_queue, 0))) {
+        res = reap_one(entry->key, entry->strlen, 0, 1);
+        free(entry);
+    }
+    return res;
 }
 
 
+/* Delete every name whose TTL has run out.  The wheel hands us
+ * just the names that came due, so the tree is never scanned.
+ * Called with delete_mutex held.
+ */
+void reap_expired() {
+    uint32_t now = expiry_now();
+    struct expiry_entry *entry = expiry_advance(&wheel, now), *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        reap_one(entry->key, entry->strlen, now, 0);
+        free(entry);
+    }
+
+    // Negative entries all share one TTL, so their queue is in expiry order
+    while ((entry = expiry_queue_pop(&negative_queue, now))) {
+        reap_one(entry->key, entry->strlen, now, 1);
+        free(entry);
+    }
+}
+
 /* Check the total node count; see if we have exceeded a the max. */
 void check_max_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    if (separate_delete_thread)
-        pthread_cond_wait(&delete_cond, &delete_mutex);
+    if (separate_delete_thread) {
+        /* Wake up at least once a tick to reap expired names */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+    }
+    compact();
+    reap_expired();
+    while (negative_count > max_negative && drop_one_negative())
+        ;
+    // Negative entries go first
     while (node_count > max_count) {
-        pthread_mutex_lock(&root_mutex);
+        if (drop_one_negative())
+            continue;
         assert(drop_one_node());
     }
     pthread_mutex_unlock(&delete_mutex);
@@ -698,12 +1514,11 @@ void check_max_nodes() {
 
 void delete_all_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    pthread_mutex_lock(&root_mutex);
-
+    compact();
     while (node_count)
-        drop_one_node();
+        assert(drop_one_node());
     assert(node_count == 0);
-    pthread_mutex_unlock(&root_mutex);
+    hazard_scan(&retired);
     pthread_mutex_unlock(&delete_mutex);
 }
 
@@ -713,10 +1528,13 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
         printf("└");
     else
         printf("├");
-    printf ("%.*s, IP %d, This %p, Next %p, Children %p\n",
-            node->strlen, node->key, node->ip4_address, node, node->next, node->children);
+    int32_t ip4_address = 0;
+    rrset_find_a(&node->records, &ip4_address);
+    printf ("%.*s, IP %d, Records %d%s, This %p, Next %p, Children %p\n",
+            node->strlen, node->key, ip4_address, node->records.count, node->negative ? " (negative)" : "",
+            node, node->next, node->children);
     if (node->children) {
-        pthread_mutex_lock(&(node->children->mutex));
+        wordlock_lock(&(node->children->lock));
         if (node->next)
             strcat(lines, "| ");
         else strcat(lines, "  ");
@@ -724,10 +1542,10 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
         lines[2*depth] = '\0';
     }
     if (node->next) {
-        pthread_mutex_lock(&(node->next->mutex));
+        wordlock_lock(&(node->next->lock));
         count = _print(node->next, depth, lines, count+1);
     }
-    pthread_mutex_unlock(&(node->mutex));
+    wordlock_unlock(&(node->lock));
     return count;
 }
 
@@ -740,7 +1558,7 @@ void print() {
     lines[0] = '\0';
     int count = 0;
     if (root)
-        pthread_mutex_lock(&root->mutex);
+        wordlock_lock(&root->lock);
     if (root)
         count = _print(root, 0, lines, 1);
     pthread_mutex_unlock(&root_mutex);
@@ -750,6 +1568,11 @@ void print() {
     assert(count == node_count);
 }
 
+void print_stats() {
+    if (use_filter)
+        printf ("Filter false positive rate %.4f\n", bloom_false_positive_rate(&filter));
+}
+
 int num_nodes() {
     return node_count;
 }
@@ -758,11 +1581,11 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     int count = 1;
 
     int len = prefix_length + node->strlen;
-    assert(!pthread_mutex_trylock(&(node->mutex)));
-    pthread_mutex_unlock(&(node->mutex));
+    assert(!wordlock_trylock(&(node->lock)));
+    wordlock_unlock(&(node->lock));
     if (len > MAX_KEY) {
-        printf("key too long at node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+        printf("key too long at node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
         *error = 1;
         return count;
     }
@@ -770,8 +1593,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     if (node->children) {
         count += _assert_invariants(node->children, len, error);
         if (*error) {
-            printf("Unwinding tree on error: node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                    node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+            printf("Unwinding tree on error: node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                    node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
             return count;
         }
     }
@@ -0,0 +1,96 @@
+/* Hash index of full names.  See hashindex.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashindex.h"
+
+/* FNV-1a */
+static unsigned int _index_hash (const char *string, size_t strlen) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < strlen; i++) {
+        hash ^= (unsigned char) string[i];
+        hash *= 16777619;
+    }
+    return hash % INDEX_BUCKETS;
+}
+
+void index_init (struct hash_index *index, int locked) {
+    int i;
+    index->locked = locked;
+    for (i = 0; i < INDEX_BUCKETS; i++) {
+        pthread_mutex_init(&index->mutexes[i], NULL);
+        index->buckets[i] = NULL;
+    }
+}
+
+struct index_entry * index_add (struct hash_index *index, const char *string, size_t strlen, void *node) {
+    struct index_entry *entry = malloc(sizeof(struct index_entry));
+    if (!entry) {
+        printf ("WARNING: Index entry allocation failed.  Lookups will be slower.\n");
+        return NULL;
+    }
+    assert(strlen < MAX_KEY);
+    entry->node = node;
+    entry->bucket = _index_hash(string, strlen);
+    entry->strlen = strlen;
+    memcpy(entry->key, string, strlen);
+
+    if (index->locked)
+        pthread_mutex_lock(&index->mutexes[entry->bucket]);
+    entry->next = index->buckets[entry->bucket];
+    index->buckets[entry->bucket] = entry;
+    if (index->locked)
+        pthread_mutex_unlock(&index->mutexes[entry->bucket]);
+    return entry;
+}
+
+void index_remove (struct hash_index *index, struct index_entry *entry) {
+    struct index_entry **prev;
+
+    if (index->locked)
+        pthread_mutex_lock(&index->mutexes[entry->bucket]);
+    for (prev = &index->buckets[entry->bucket]; *prev != entry; prev = &(*prev)->next)
+        assert(*prev);
+    *prev = entry->next;
+    if (index->locked)
+        pthread_mutex_unlock(&index->mutexes[entry->bucket]);
+    free(entry);
+}
+
+void index_clear (struct hash_index *index) {
+    struct index_entry *entry, *next;
+    int i;
+
+    for (i = 0; i < INDEX_BUCKETS; i++) {
+        for (entry = index->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+        index->buckets[i] = NULL;
+    }
+}
+
+void * index_find (struct hash_index *index, const char *string, size_t strlen,
+        int (*pin) (void *node), int *busy) {
+    unsigned int bucket = _index_hash(string, strlen);
+    struct index_entry *entry;
+    void *node = NULL;
+
+    if (index->locked)
+        pthread_mutex_lock(&index->mutexes[bucket]);
+    for (entry = index->buckets[bucket]; entry; entry = entry->next) {
+        if (entry->strlen == strlen && memcmp(entry->key, string, strlen) == 0) {
+            node = entry->node;
+            if (pin && !pin(node)) {
+                *busy = 1;
+                node = NULL;
+            }
+            break;
+        }
+    }
+    if (index->locked)
+        pthread_mutex_unlock(&index->mutexes[bucket]);
+    return node;
+}
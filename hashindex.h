@@ -0,0 +1,56 @@
+#ifndef __HASHINDEX_H__
+#define __HASHINDEX_H__
+
+#include <pthread.h>
+#include "trie.h"
+
+/* A hash table from full names to the trie nodes that hold them, so
+ * exact-match lookups skip the walk down the tree.  Only nodes that
+ * hold a value (or a negative entry) are indexed; each trie adds and
+ * removes entries as a node gains or loses its value, and keeps the
+ * entry pointer in the node so removal needs no name.
+ *
+ * An index created with locked set has a mutex per bucket, for tries
+ * whose writers don't exclude each other; otherwise the trie's own
+ * lock must cover the index.
+ */
+
+#define INDEX_BUCKETS 1024
+
+struct index_entry {
+    struct index_entry *next;
+    void *node; /* The trie node */
+    unsigned int bucket;
+    unsigned int strlen;
+    char key[MAX_KEY];
+};
+
+struct hash_index {
+    int locked;
+    pthread_mutex_t mutexes[INDEX_BUCKETS];
+    struct index_entry *buckets[INDEX_BUCKETS];
+};
+
+void index_init (struct hash_index *index, int locked);
+
+/* Returns the new entry, or NULL if memory ran out (the name is then
+ * just missing from the index, and lookups fall back to the tree).
+ */
+struct index_entry * index_add (struct hash_index *index, const char *string, size_t strlen, void *node);
+
+void index_remove (struct hash_index *index, struct index_entry *entry);
+
+/* Free every entry, leaving the index empty.  Nobody else may be
+ * using the index, so its nodes must be unreachable too.
+ */
+void index_clear (struct hash_index *index);
+
+/* Return the node for string, or NULL.  If pin is not NULL, it is
+ * called on the node with the bucket still locked, to lock the node
+ * before anyone can remove it; it must not block.  If it fails, *busy
+ * is set and NULL returned.
+ */
+void * index_find (struct hash_index *index, const char *string, size_t strlen,
+        int (*pin) (void *node), int *busy);
+
+#endif /* __HASHINDEX_H__ */
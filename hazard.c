@@ -0,0 +1,68 @@
+/* Hazard pointers.  See hazard.h. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "hazard.h"
+
+static struct hazard_record * volatile records = NULL;  //Every thread's, newest first
+static __thread struct hazard_record *mine = NULL;
+
+struct hazard_record * hazard_mine () {
+    struct hazard_record *record;
+    int i;
+
+    if (mine)
+        return mine;
+    record = aligned_alloc(CACHE_LINE, sizeof(struct hazard_record));
+    assert(record);
+    for (i = 0; i < HAZARDS; i++)
+        record->slots[i] = NULL;
+    do
+        record->next = records;
+    while (!__sync_bool_compare_and_swap(&records, record->next, record));
+    mine = record;
+    return record;
+}
+
+void hazard_clear (struct hazard_record *me) {
+    int i;
+    for (i = 0; i < HAZARDS; i++)
+        me->slots[i] = NULL;
+}
+
+/* Is p in anyone's slots? */
+static int _hazardous (void *p) {
+    struct hazard_record *record;
+    int i;
+
+    for (record = records; record; record = record->next)
+        for (i = 0; i < HAZARDS; i++)
+            if (record->slots[i] == p)
+                return 1;
+    return 0;
+}
+
+void hazard_scan (struct hazard_list *list) {
+    int i, kept = 0;
+
+    // The unlinks must be visible before we read the slots
+    __sync_synchronize();
+    for (i = 0; i < list->count; i++) {
+        if (_hazardous(list->nodes[i]))
+            list->nodes[kept++] = list->nodes[i];
+        else
+            free(list->nodes[i]);
+    }
+    list->count = kept;
+}
+
+void hazard_retire (struct hazard_list *list, void *node) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : HAZARD_SCAN;
+        list->nodes = realloc(list->nodes, list->capacity * sizeof(void *));
+        assert(list->nodes);
+    }
+    list->nodes[list->count++] = node;
+    if (list->count >= HAZARD_SCAN)
+        hazard_scan(list);
+}
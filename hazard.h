@@ -0,0 +1,56 @@
+#ifndef __HAZARD_H__
+#define __HAZARD_H__
+
+#include "locks.h"
+
+/* Hazard pointers (Michael), so the fine-grained trie's searches can
+ * walk nodes without locking them.  A reader publishes each node it
+ * is about to read in one of its slots, then checks that the node is
+ * still linked; a writer that unlinks a node retires it instead of
+ * freeing it, and it is only freed once no slot points at it.
+ *
+ * Each thread gets its own record of HAZARDS slots, on its own cache
+ * line, the first time it asks; records are never freed.  Readers
+ * only ever write to their own record.
+ */
+
+#define HAZARDS 2 /* Slots per thread: the node we are on, and the next */
+#define HAZARD_SCAN 64 /* Retired nodes to collect before a scan */
+
+struct hazard_record {
+    void * volatile slots[HAZARDS];
+    struct hazard_record *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Nodes unlinked but maybe still in use.  Not thread-safe: each list
+ * needs its own lock, or one owner.
+ */
+struct hazard_list {
+    void **nodes;
+    int count;
+    int capacity;
+};
+
+/* This thread's record */
+struct hazard_record * hazard_mine ();
+
+/* Publish p in slot i, and make sure every other thread can see it
+ * before we look at p again.
+ */
+static inline void hazard_set (struct hazard_record *me, int i, void *p) {
+    me->slots[i] = p;
+    __sync_synchronize();
+}
+
+/* Let go of everything this thread has published */
+void hazard_clear (struct hazard_record *me);
+
+/* Free node once no slot points at it.  Scans the slots every
+ * HAZARD_SCAN retirements, freeing what it can.
+ */
+void hazard_retire (struct hazard_list *list, void *node);
+
+/* Free whatever on the list no slot points at now */
+void hazard_scan (struct hazard_list *list);
+
+#endif /* __HAZARD_H__ */
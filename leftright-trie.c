@@ -0,0 +1,278 @@
+/* A (reverse) trie for read-mostly zones, kept as two copies of the
+ * sequential trie (sequential-trie.c, built as shard-trie.o) under
+ * left-right concurrency control (locks.h).  Readers never block,
+ * take a lock or retry: they read whichever copy no writer is
+ * changing.  Writers take turns, and make each change twice, once to
+ * each copy, waiting in between for readers to leave the second copy.
+ *
+ * Each change runs the same sequential code on both copies, so they
+ * hold the same names.  The writer stops its clock (expiry_freeze)
+ * for the length of the change, so both runs compute the same
+ * expiries, reap the same names and so evict the same ones too.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trie.h"
+#include "expiry.h"
+#include "shard.h"
+#include "locks.h"
+#include "async.h"
+#include "waitq.h"
+
+static struct trie_state *copies[2];
+static struct leftright lr;
+static __thread int dirty = 0;  //This thread has made a change since check_max_nodes
+static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
+extern int separate_delete_thread;
+
+void init(int numthreads) {
+    int i;
+    lr_init(&lr);
+    for (i = 0; i < 2; i++) {
+        copies[i] = shard_new();
+        shard_use(copies[i]);
+        shard_init(1);
+    }
+}
+
+void shutdown_delete_thread() {
+    if (separate_delete_thread) {
+        pthread_mutex_lock(&delete_mutex);
+        pthread_cond_signal(&delete_cond);
+        pthread_mutex_unlock(&delete_mutex);
+    }
+    return;
+}
+
+/* Point this thread's shard_* calls at the copy readers may use now.
+ * Returns the version to pass to lr_read_end.
+ */
+int read_begin () {
+    int version;
+    shard_use(copies[lr_read_begin(&lr, &version)]);
+    return version;
+}
+
+/* ... and at the copy the writer changes first.  Both runs of the
+ * change see the tick it starts in.
+ */
+void write_begin () {
+    shard_use(copies[lr_write_begin(&lr)]);
+    expiry_freeze(expiry_now());
+    dirty = 1;
+}
+
+/* ... and then at the other copy */
+void write_swap () {
+    shard_use(copies[lr_write_swap(&lr)]);
+}
+
+/* Done with both copies */
+void write_end () {
+    expiry_thaw();
+    lr_write_end(&lr);
+}
+
+int search (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+int lookup (const char *string, size_t strlen, int32_t *ip4_address) {
+    int version = read_begin();
+    int res = shard_lookup(string, strlen, ip4_address);
+    lr_read_end(&lr, version);
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    int version = read_begin();
+    int res = shard_search_records(string, strlen, fn, arg);
+    lr_read_end(&lr, version);
+    return res;
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    int version = read_begin();
+    int res = shard_search_longest_suffix(string, strlen, ip4_address, suffix_len);
+    lr_read_end(&lr, version);
+    return res;
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    int version = read_begin();
+    int res = shard_cursor_next(cursor, max, fn, arg);
+    lr_read_end(&lr, version);
+    return res;
+}
+
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    write_begin();
+    int res = shard_update(string, strlen, ip4_address);
+    write_swap();
+    shard_update(string, strlen, ip4_address);
+    write_end();
+    return res;
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    write_begin();
+    int res = shard_upsert(string, strlen, ip4_address, ttl);
+    write_swap();
+    shard_upsert(string, strlen, ip4_address, ttl);
+    write_end();
+    return res;
+}
+
+/* Both copies hold the same address, so the second run agrees */
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    write_begin();
+    int res = shard_cas_value(string, strlen, expected, ip4_address);
+    write_swap();
+    shard_cas_value(string, strlen, expected, ip4_address);
+    write_end();
+    return res;
+}
+
+int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+/* An insert_ttl call, for waitq_until to retry */
+struct squat {
+    const char *string;
+    size_t strlen;
+    int32_t ip4_address;
+    uint32_t ttl;
+};
+
+int try_insert (void *arg) {
+    struct squat *squat = arg;
+    write_begin();
+    int res = shard_insert_ttl(squat->string, squat->strlen, squat->ip4_address, squat->ttl);
+    write_swap();
+    shard_insert_ttl(squat->string, squat->strlen, squat->ip4_address, squat->ttl);
+    write_end();
+    return res;
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct squat squat = { string, strlen, ip4_address, ttl };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &squat);
+    return try_insert(&squat);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    write_begin();
+    int res = shard_insert_negative(string, strlen);
+    write_swap();
+    shard_insert_negative(string, strlen);
+    write_end();
+    return res;
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    write_begin();
+    int res = shard_insert_record(string, strlen, record);
+    write_swap();
+    shard_insert_record(string, strlen, record);
+    write_end();
+    return res;
+}
+
+int delete  (const char *string, size_t strlen) {
+    write_begin();
+    int res = shard_delete(string, strlen);
+    write_swap();
+    shard_delete(string, strlen);
+    write_end();
+    return res;
+}
+
+/* Readers see the batch all at once, as they only move to a copy
+ * once it holds the whole batch.  The second run works on a copy of
+ * the ops, so the first run's results stand.
+ */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    struct trie_op *again;
+
+    if (n <= 0)
+        return 0;
+    again = malloc(n * sizeof(struct trie_op));
+    assert(again);
+    memcpy(again, ops, n * sizeof(struct trie_op));
+
+    write_begin();
+    int res = shard_apply_batch(ops, n);
+    write_swap();
+    shard_apply_batch(again, n);
+    write_end();
+    free(again);
+    return res;
+}
+
+void compact() {
+    write_begin();
+    shard_compact();
+    write_swap();
+    shard_compact();
+    write_end();
+}
+
+/* Readers can't change the tree, so only a client that has written
+ * since its last check needs to make one.  The delete thread checks
+ * once a tick.
+ */
+void check_max_nodes() {
+    if (separate_delete_thread) {
+        struct timespec deadline;
+        pthread_mutex_lock(&delete_mutex);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+        pthread_mutex_unlock(&delete_mutex);
+    } else if (!dirty)
+        return;
+
+    write_begin();
+    shard_check_max_nodes();
+    write_swap();
+    shard_check_max_nodes();
+    write_end();
+    dirty = 0;
+}
+
+void delete_all_nodes() {
+    write_begin();
+    shard_delete_all_nodes();
+    write_swap();
+    shard_delete_all_nodes();
+    write_end();
+}
+
+void print() {
+    int version = read_begin();
+    shard_print();
+    lr_read_end(&lr, version);
+}
+
+void print_stats() {
+    int version = read_begin();
+    shard_print_stats();
+    lr_read_end(&lr, version);
+}
+
+int num_nodes() {
+    int version = read_begin();
+    int res = shard_num_nodes();
+    lr_read_end(&lr, version);
+    return res;
+}
@@ -0,0 +1,332 @@
+/* Reader-writer locks for the rw trie, and the fine-grained trie's
+ * node lock.  See locks.h. */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "locks.h"
+
+static int next_slot = 0;
+static __thread int my_slot = -1;
+
+/* This thread's reader slot, handed out round-robin on first use */
+static int _thread_slot () {
+    if (my_slot < 0)
+        my_slot = __sync_fetch_and_add(&next_slot, 1) % BRLOCK_SLOTS;
+    return my_slot;
+}
+
+static struct brlock_slot * _brlock_slot (struct brlock *lock) {
+    return &lock->slots[_thread_slot()];
+}
+
+void brlock_init (struct brlock *lock) {
+    pthread_mutex_init(&lock->writer, NULL);
+    lock->writing = 0;
+    memset(lock->slots, 0, sizeof(lock->slots));
+}
+
+void brlock_rdlock (struct brlock *lock) {
+    struct brlock_slot *slot = _brlock_slot(lock);
+
+    while (1) {
+        // The atomic add is a full barrier, so either the writer sees
+        // our count or we see its flag
+        __sync_fetch_and_add(&slot->readers, 1);
+        if (!lock->writing)
+            return;
+        __sync_fetch_and_sub(&slot->readers, 1);
+        while (lock->writing)
+            sched_yield();
+    }
+}
+
+void brlock_rdunlock (struct brlock *lock) {
+    __sync_fetch_and_sub(&_brlock_slot(lock)->readers, 1);
+}
+
+void brlock_wrlock (struct brlock *lock) {
+    int i;
+
+    pthread_mutex_lock(&lock->writer);
+    lock->writing = 1;
+    __sync_synchronize();
+    for (i = 0; i < BRLOCK_SLOTS; i++) {
+        while (lock->slots[i].readers)
+            sched_yield();
+    }
+}
+
+void brlock_wrunlock (struct brlock *lock) {
+    __sync_synchronize();
+    lock->writing = 0;
+    pthread_mutex_unlock(&lock->writer);
+}
+
+void futex_wait (volatile int *word, int val) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void futex_wake (volatile int *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void wordlock_init (struct wordlock *lock) {
+    lock->state = 0;
+}
+
+void wordlock_lock (struct wordlock *lock) {
+    int c = __sync_val_compare_and_swap(&lock->state, 0, 1);
+    if (c == 0)
+        return;
+
+    // Mark the lock contended, and sleep until it is released.  Once
+    // we have waited we can't tell if others are, so we always take it
+    // as contended, and the unlock wakes someone.
+    if (c != 2)
+        c = __sync_lock_test_and_set(&lock->state, 2);
+    while (c != 0) {
+        futex_wait(&lock->state, 2);
+        c = __sync_lock_test_and_set(&lock->state, 2);
+    }
+}
+
+int wordlock_trylock (struct wordlock *lock) {
+    return __sync_bool_compare_and_swap(&lock->state, 0, 1) ? 0 : EBUSY;
+}
+
+void wordlock_unlock (struct wordlock *lock) {
+    if (__sync_fetch_and_sub(&lock->state, 1) != 1) {
+        lock->state = 0;
+        futex_wake(&lock->state, 1);
+    }
+}
+
+void mcs_init (struct mcs_lock *lock, int park) {
+    lock->tail = NULL;
+    lock->park = park;
+}
+
+void mcs_lock (struct mcs_lock *lock, struct mcs_node *me) {
+    struct mcs_node *prev;
+    int spins = 0;
+
+    me->next = NULL;
+    me->waiting = 1;
+    prev = __sync_lock_test_and_set(&lock->tail, me);
+    if (!prev)
+        return;
+
+    __sync_synchronize();
+    prev->next = me;
+    while (me->waiting) {
+        if (++spins < MCS_SPINS)
+            continue;
+        spins = 0;
+        if (lock->park && __sync_bool_compare_and_swap(&me->waiting, 1, 2))
+            futex_wait(&me->waiting, 2);
+        else
+            sched_yield();
+    }
+    __sync_synchronize();
+}
+
+void mcs_unlock (struct mcs_lock *lock, struct mcs_node *me) {
+    if (!me->next) {
+        // Nobody behind us, unless one is between the swap and the link
+        if (__sync_bool_compare_and_swap(&lock->tail, me, NULL))
+            return;
+        while (!me->next)
+            sched_yield();
+    }
+
+    struct mcs_node *next = me->next;
+    if (__sync_lock_test_and_set(&next->waiting, 0) == 2)
+        futex_wake(&next->waiting, 1);
+}
+
+static __thread int my_fc_slot = -1;
+
+void fc_init (struct fc_lock *fc) {
+    pthread_mutex_init(&fc->lock, NULL);
+    fc->passes = fc->combined = 0;
+    memset(fc->slots, 0, sizeof(fc->slots));
+}
+
+/* Run every posted section.  Called with fc's lock held. */
+static void _fc_combine (struct fc_lock *fc) {
+    int i, ran = 0;
+
+    for (i = 0; i < FC_SLOTS; i++) {
+        struct fc_slot *slot = &fc->slots[i];
+        if (slot->fn) {
+            __sync_synchronize();
+            slot->fn(slot->arg);
+            __sync_synchronize();
+            slot->fn = NULL;
+            ran++;
+        }
+    }
+    if (ran) {
+        fc->passes++;
+        fc->combined += ran;
+    }
+}
+
+void fc_run (struct fc_lock *fc, void (*fn) (void *), void *arg) {
+    struct fc_slot *slot;
+
+    if (my_fc_slot < 0)
+        my_fc_slot = __sync_fetch_and_add(&next_slot, 1) % FC_SLOTS;
+    slot = &fc->slots[my_fc_slot];
+
+    // Someone we share the slot with is using it; go it alone
+    if (!__sync_bool_compare_and_swap(&slot->busy, 0, 1)) {
+        pthread_mutex_lock(&fc->lock);
+        fn(arg);
+        _fc_combine(fc);
+        pthread_mutex_unlock(&fc->lock);
+        return;
+    }
+
+    slot->arg = arg;
+    __sync_synchronize();
+    slot->fn = fn;
+
+    while (slot->fn) {
+        if (pthread_mutex_trylock(&fc->lock) == 0) {
+            _fc_combine(fc);
+            pthread_mutex_unlock(&fc->lock);
+        } else
+            sched_yield();
+    }
+    __sync_synchronize();
+    slot->busy = 0;
+}
+
+void fc_stats_print (struct fc_lock *fc) {
+    printf ("Combining passes %lu, %.2f operations per pass\n", fc->passes,
+            fc->passes ? (double) fc->combined / fc->passes : 0.0);
+}
+
+void lr_init (struct leftright *lr) {
+    pthread_mutex_init(&lr->writer, NULL);
+    lr->left_right = 0;
+    lr->version = 0;
+    memset(lr->readers, 0, sizeof(lr->readers));
+}
+
+int lr_read_begin (struct leftright *lr, int *version) {
+    int v = lr->version;
+    // The atomic add is a full barrier, so the writer either sees us
+    // arrive or we see the copy it switched to
+    __sync_fetch_and_add(&lr->readers[v][_thread_slot()].readers, 1);
+    *version = v;
+    return lr->left_right;
+}
+
+void lr_read_end (struct leftright *lr, int version) {
+    __sync_fetch_and_sub(&lr->readers[version][_thread_slot()].readers, 1);
+}
+
+int lr_write_begin (struct leftright *lr) {
+    pthread_mutex_lock(&lr->writer);
+    return !lr->left_right;
+}
+
+/* Wait until no reader is counted under version */
+static void _lr_drain (struct leftright *lr, int version) {
+    int i;
+    for (i = 0; i < BRLOCK_SLOTS; i++)
+        while (lr->readers[version][i].readers)
+            sched_yield();
+}
+
+int lr_write_swap (struct leftright *lr) {
+    int prev = lr->version;
+
+    __sync_synchronize();
+    lr->left_right = !lr->left_right;
+    __sync_synchronize();
+
+    // Readers that arrive from now on use the new copy.  Any still in
+    // the old one counted themselves under one of the two versions:
+    // empty the other version, move new readers onto it, then empty
+    // the one they were using.
+    _lr_drain(lr, !prev);
+    lr->version = !prev;
+    __sync_synchronize();
+    _lr_drain(lr, prev);
+    return !lr->left_right;
+}
+
+void lr_write_end (struct leftright *lr) {
+    pthread_mutex_unlock(&lr->writer);
+}
+
+void pflock_init (struct pflock *lock) {
+    lock->rin = lock->rout = 0;
+    lock->win = lock->wout = 0;
+}
+
+void pflock_rdlock (struct pflock *lock) {
+    unsigned int w = __sync_fetch_and_add(&lock->rin, PF_RINC) & PF_WBITS;
+
+    // Wait out a present writer, until its phase changes
+    if (w != 0) {
+        while ((lock->rin & PF_WBITS) == w)
+            sched_yield();
+    }
+}
+
+void pflock_rdunlock (struct pflock *lock) {
+    __sync_fetch_and_add(&lock->rout, PF_RINC);
+}
+
+void pflock_wrlock (struct pflock *lock) {
+    unsigned int ticket = __sync_fetch_and_add(&lock->win, 1);
+    unsigned int readers;
+
+    // Wait for the writers ahead of us
+    while (lock->wout != ticket)
+        sched_yield();
+
+    // Block new readers, then wait for the ones already inside
+    readers = __sync_fetch_and_add(&lock->rin, PF_PRES | (ticket & PF_PHID));
+    readers &= ~PF_WBITS;
+    while (lock->rout != readers)
+        sched_yield();
+}
+
+void pflock_wrunlock (struct pflock *lock) {
+    __sync_fetch_and_and(&lock->rin, ~PF_WBITS);
+    __sync_fetch_and_add(&lock->wout, 1);
+}
+
+uint64_t lock_clock () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void lock_stats_add (struct lock_stats *stats, uint64_t ns) {
+    uint64_t max = stats->max_ns;
+
+    __sync_fetch_and_add(&stats->waits, 1);
+    __sync_fetch_and_add(&stats->total_ns, ns);
+    while (ns > max && !__sync_bool_compare_and_swap(&stats->max_ns, max, ns))
+        max = stats->max_ns;
+}
+
+void lock_stats_print (const char *name, struct lock_stats *stats) {
+    unsigned long waits = stats->waits;
+
+    printf ("%s: %lu acquisitions, mean wait %llu us, max wait %llu us\n", name, waits,
+            (unsigned long long) (waits ? stats->total_ns / waits / 1000 : 0),
+            (unsigned long long) (stats->max_ns / 1000));
+}
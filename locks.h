@@ -0,0 +1,227 @@
+#ifndef __LOCKS_H__
+#define __LOCKS_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+/* Reader-writer locks for the rw trie, as alternatives to
+ * pthread_rwlock_t (see rw-trie.c for how one is picked), a queue
+ * lock and a flat combiner for the mutex trie, the left-right trie's
+ * concurrency control, and the fine-grained trie's per-node lock.
+ */
+
+#define CACHE_LINE 64
+
+/* A "big reader" lock.  Each reading thread bumps a counter in its
+ * own slot, on its own cache line, so readers never write a shared
+ * word; a writer sets the writing flag and then waits for every slot
+ * to drain.  Readers back off while a writer is waiting, so writers
+ * (like check_max_nodes) cannot be starved.  Threads beyond
+ * BRLOCK_SLOTS share slots, which is still correct, just slower.
+ */
+#define BRLOCK_SLOTS 64
+
+struct brlock_slot {
+    volatile int readers;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct brlock {
+    pthread_mutex_t writer; /* Serializes writers */
+    volatile int writing; /* A writer holds or is waiting for the lock */
+    struct brlock_slot slots[BRLOCK_SLOTS];
+};
+
+void brlock_init (struct brlock *lock);
+void brlock_rdlock (struct brlock *lock);
+void brlock_rdunlock (struct brlock *lock);
+void brlock_wrlock (struct brlock *lock);
+void brlock_wrunlock (struct brlock *lock);
+
+/* A phase-fair ticket lock (Brandenburg and Anderson).  Readers and
+ * writers take turns by phase: a writer waits for at most the readers
+ * already inside, and readers that arrive after a writer wait for at
+ * most that one writer.  So neither side can starve the other, and a
+ * writer's wait is bounded by one read phase plus the writers ahead of
+ * it.  rin and rout count readers in and out (in units of PF_RINC);
+ * the low bits of rin say whether a writer is present, and which
+ * phase it is in.  win and wout are the writers' ticket lock.
+ */
+#define PF_RINC 0x100
+#define PF_WBITS 0x3
+#define PF_PRES 0x2
+#define PF_PHID 0x1
+
+struct pflock {
+    volatile unsigned int rin;
+    volatile unsigned int rout;
+    volatile unsigned int win;
+    volatile unsigned int wout;
+};
+
+void pflock_init (struct pflock *lock);
+void pflock_rdlock (struct pflock *lock);
+void pflock_rdunlock (struct pflock *lock);
+void pflock_wrlock (struct pflock *lock);
+void pflock_wrunlock (struct pflock *lock);
+
+/* Left-right concurrency control (Ramalhete and Correia), for two
+ * copies of a data structure.  Readers read the copy that left_right
+ * names, and never wait: they only count themselves in and out under
+ * the current version, in their own slot, as with brlock.  The one
+ * writer at a time changes the other copy, switches left_right to it,
+ * waits for every reader of the old copy to leave, and then makes the
+ * same change to the old copy.
+ *
+ *     w = lr_write_begin(lr);   change copy w
+ *     w = lr_write_swap(lr);    change copy w the same way
+ *     lr_write_end(lr);
+ */
+struct leftright {
+    pthread_mutex_t writer;
+    volatile int left_right; /* The copy readers use */
+    volatile int version; /* The read indicator new readers count in */
+    struct brlock_slot readers[2][BRLOCK_SLOTS];
+};
+
+void lr_init (struct leftright *lr);
+
+/* Return the copy to read.  Pass the version it stores to lr_read_end. */
+int lr_read_begin (struct leftright *lr, int *version);
+void lr_read_end (struct leftright *lr, int version);
+
+/* Take the writer's lock, and return the copy that no one is reading */
+int lr_write_begin (struct leftright *lr);
+
+/* Let readers at the copy just changed, wait until the other one has
+ * no readers, and return it.
+ */
+int lr_write_swap (struct leftright *lr);
+void lr_write_end (struct leftright *lr);
+
+/* Sleep while *word is val, or wake up to count sleepers on word. */
+void futex_wait (volatile int *word, int val);
+void futex_wake (volatile int *word, int count);
+
+/* An MCS queue lock (Mellor-Crummey and Scott).  Each waiter
+ * enqueues its own node and spins on a flag in it, so waiting
+ * threads don't bounce the lock's cache line between them, and the
+ * lock is handed over in FIFO order.  A thread may hold only one MCS
+ * lock per node it owns.
+ *
+ * A waiter spins MCS_SPINS times before it gives up the CPU.  If the
+ * lock was made with park set, it then sleeps on its flag with
+ * futex, and the releaser wakes it; otherwise it yields and spins
+ * again.  Parking keeps waiters from burning CPUs that the holder
+ * could use when there are more threads than cores.
+ */
+#define MCS_SPINS 1000
+
+struct mcs_node {
+    struct mcs_node * volatile next;
+    volatile int waiting; /* 1 spinning, 2 parked, 0 lock handed over */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct mcs_lock {
+    struct mcs_node * volatile tail; /* Last waiter, or NULL if free */
+    int park;
+};
+
+void mcs_init (struct mcs_lock *lock, int park);
+void mcs_lock (struct mcs_lock *lock, struct mcs_node *me);
+void mcs_unlock (struct mcs_lock *lock, struct mcs_node *me);
+
+/* Flat combining (Hendler et al.).  Rather than each thread taking
+ * the lock for its own short critical section, threads post the
+ * section (a function and its argument) in their own slot.  Whoever
+ * gets the lock runs every posted section in one pass, while the
+ * data is hot in its cache, and the others just wait for their slot
+ * to be cleared.  The lock can also be taken directly, for sections
+ * that aren't worth posting.  Threads beyond FC_SLOTS share slots;
+ * one that finds its slot busy runs its section under the lock
+ * itself.
+ */
+#define FC_SLOTS 64
+
+struct fc_slot {
+    volatile int busy; /* Claimed by a thread */
+    void (* volatile fn) (void *); /* Posted section, NULL once it ran */
+    void *arg;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct fc_lock {
+    pthread_mutex_t lock;
+    unsigned long passes; /* Combining passes that ran anything */
+    unsigned long combined; /* Sections they ran */
+    struct fc_slot slots[FC_SLOTS];
+};
+
+void fc_init (struct fc_lock *fc);
+
+/* Run fn(arg) under fc's lock, by us or by another thread. */
+void fc_run (struct fc_lock *fc, void (*fn) (void *), void *arg);
+
+/* Print the average number of sections run per pass */
+void fc_stats_print (struct fc_lock *fc);
+
+/* A mutex in one word, for the fine-grained trie's nodes, where a
+ * 40-byte pthread_mutex_t was as big as the rest of the node's
+ * header.  The state is 0 when free, 1 when held, and 2 when held
+ * with (possibly) sleeping waiters, as in Drepper's "Futexes Are
+ * Tricky".  Uncontended lock and unlock are one atomic op each, and
+ * waiters sleep in the kernel rather than spin.  Not recursive.
+ */
+struct wordlock {
+    volatile int state;
+};
+
+void wordlock_init (struct wordlock *lock);
+void wordlock_lock (struct wordlock *lock);
+/* Like pthread_mutex_trylock: 0 if we got the lock, EBUSY if not. */
+int wordlock_trylock (struct wordlock *lock);
+void wordlock_unlock (struct wordlock *lock);
+
+/* A sequence counter, for data that readers may read without a lock.
+ * The count is odd while a writer is changing the data; readers
+ * retry if it was odd, or changed, across their read.  Writers
+ * exclude each other by moving the count from even to odd.
+ */
+static inline unsigned int seq_read_begin (volatile unsigned int *seq) {
+    unsigned int start;
+    while ((start = *seq) & 1)
+        sched_yield();
+    __sync_synchronize();
+    return start;
+}
+
+static inline int seq_read_retry (volatile unsigned int *seq, unsigned int start) {
+    __sync_synchronize();
+    return *seq != start;
+}
+
+static inline void seq_write_begin (volatile unsigned int *seq) {
+    unsigned int start;
+    do {
+        start = *seq;
+    } while ((start & 1) || !__sync_bool_compare_and_swap(seq, start, start + 1));
+}
+
+static inline void seq_write_end (volatile unsigned int *seq) {
+    __sync_fetch_and_add(seq, 1);
+}
+
+/* How long lockers waited, in nanoseconds. */
+struct lock_stats {
+    unsigned long waits;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* CLOCK_MONOTONIC, in nanoseconds */
+uint64_t lock_clock ();
+
+void lock_stats_add (struct lock_stats *stats, uint64_t ns);
+
+void lock_stats_print (const char *name, struct lock_stats *stats);
+
+#endif /* __LOCKS_H__ */
@@ -0,0 +1,74 @@
+/* Per-thread lookup cache.  See lookupcache.h. */
+
+#include <string.h>
+#include "lookupcache.h"
+
+struct cache_slot {
+    unsigned long epoch; /* 0 = empty */
+    uint32_t expires;
+    int res;
+    int has_a;
+    int32_t ip4_address;
+    unsigned int strlen;
+    char key[MAX_KEY];
+};
+
+/* Start at 1, so empty slots never match */
+static volatile unsigned long epoch = 1;
+
+static __thread struct cache_slot slots[CACHE_SLOTS];
+static __thread unsigned long hits, misses;
+
+static struct cache_slot * _cache_slot (const char *string, size_t strlen) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < strlen; i++) {
+        hash ^= (unsigned char) string[i];
+        hash *= 16777619;
+    }
+    return &slots[hash % CACHE_SLOTS];
+}
+
+unsigned long cache_epoch () {
+    return epoch;
+}
+
+void cache_invalidate () {
+    __sync_fetch_and_add(&epoch, 1);
+}
+
+int cache_get (const char *string, size_t strlen, unsigned long current, uint32_t now,
+        int *res, int32_t *ip4_address) {
+    struct cache_slot *slot = _cache_slot(string, strlen);
+
+    if (slot->epoch != current || slot->strlen != strlen
+            || memcmp(slot->key, string, strlen) != 0
+            || (slot->expires && slot->expires <= now)) {
+        misses++;
+        return 0;
+    }
+    hits++;
+    *res = slot->res;
+    if (ip4_address && slot->has_a)
+        *ip4_address = slot->ip4_address;
+    return 1;
+}
+
+void cache_put (const char *string, size_t strlen, unsigned long current,
+        int res, int has_a, int32_t ip4_address, uint32_t expires) {
+    struct cache_slot *slot = _cache_slot(string, strlen);
+
+    assert(strlen < MAX_KEY);
+    slot->epoch = current;
+    slot->expires = expires;
+    slot->res = res;
+    slot->has_a = has_a;
+    slot->ip4_address = ip4_address;
+    slot->strlen = strlen;
+    memcpy(slot->key, string, strlen);
+}
+
+void cache_stats (unsigned long *hits_out, unsigned long *misses_out) {
+    *hits_out = hits;
+    *misses_out = misses;
+}
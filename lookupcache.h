@@ -0,0 +1,43 @@
+#ifndef __LOOKUPCACHE_H__
+#define __LOOKUPCACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "trie.h"
+
+/* A small, direct-mapped cache of recent lookup results, private to
+ * each thread, so hot names are answered with no lock and no writes to
+ * shared memory.
+ *
+ * Every change to any name bumps one global epoch, after the change is
+ * made, and an entry is only good for the epoch that was current when
+ * its lookup started.  So invalidation is a single increment, and a
+ * reader's only shared access on a hit is reading the epoch.  Entries
+ * also remember when their answer expires, since TTLs run out without
+ * any change being made.
+ */
+
+#define CACHE_SLOTS 256
+
+/* The current epoch.  Read it before a lookup that may fill the cache. */
+unsigned long cache_epoch ();
+
+/* Invalidate every thread's cache.  Call after the change is visible. */
+void cache_invalidate ();
+
+/* Return 1 and the cached result (and address, if it has one) if this
+ * thread has a valid entry for string; 0 otherwise.
+ */
+int cache_get (const char *string, size_t strlen, unsigned long epoch, uint32_t now,
+        int *res, int32_t *ip4_address);
+
+/* Remember a result that was looked up during epoch.  has_a says
+ * whether ip4_address is meaningful; expires is 0 for never.
+ */
+void cache_put (const char *string, size_t strlen, unsigned long epoch,
+        int res, int has_a, int32_t ip4_address, uint32_t expires);
+
+/* This thread's hit and miss counts */
+void cache_stats (unsigned long *hits, unsigned long *misses);
+
+#endif /* __LOOKUPCACHE_H__ */
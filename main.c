@@ -14,10 +14,29 @@
 #include <assert.h>
 #include <ctype.h>
 #include "trie.h"
+#include "cursor.h"
+#include "lookupcache.h"
+#include "async.h"
+#include "waitq.h"
+#ifdef TRIE_SNAPSHOTS
+#include "snapshot.h"
+#endif
+#ifdef TRIE_RELOAD
+#include "zone.h"
+#endif
 
 int separate_delete_thread = 0;
+int negative_caching = 0;
+int use_hash_index = 0;
+int use_filter = 0;
+int use_cache = 0;
+int use_upsert = 0;
+int allow_squatting = 0;
 int simulation_length = 30; // default to 30 seconds
+int read_percent = -1; // -1 keeps the even search/insert/delete mix
+int async_depth = 0; // Asynchronous operations each client keeps in flight, 0 for none
 volatile int finished = 0;
+unsigned long total_ops = 0; // Operations completed by all clients
 
 #ifdef DEBUG
 #define DEBUG_PRINT(...) printf(__VA_ARGS__)
@@ -35,6 +54,21 @@ delete_thread(void *arg) {
 int32_t global_salt = 0;
 int use_global_salt = 0;
 
+/* Wait for some of this client's asynchronous operations to finish,
+ * and do what the client would have done after each one.  Stores up
+ * to max of them in done, and returns how many.
+ */
+int finish_async (struct trie_op **done, int max) {
+    int i, n = trie_poll(done, max, 1);
+    for (i = 0; i < n; i++) {
+        if (done[i]->op == TRIE_OP_LOOKUP && done[i]->res == LOOKUP_MISS && negative_caching)
+            insert_negative(done[i]->name, done[i]->strlen);
+        if (!separate_delete_thread)
+            check_max_nodes();
+    }
+    return n;
+}
+
     static void *
 client(void *arg)
 {
@@ -54,6 +88,16 @@ client(void *arg)
     // temporarily setting this to a fixed value.
     initstate_r(salt, rand_state, sizeof(rand_state), &rd);
 
+    unsigned long ops = 0;
+    struct trie_op *pool = NULL, **spare = NULL;
+    int nspare = 0;
+    if (async_depth) {
+        pool = calloc(async_depth, sizeof(struct trie_op));
+        spare = calloc(async_depth, sizeof(struct trie_op *));
+        for (nspare = 0; nspare < async_depth; nspare++)
+            spare[nspare] = &pool[nspare];
+    }
+
     while (!finished) {
         /* Pick a random operation, string, and ip */
         int32_t code;
@@ -93,10 +137,35 @@ client(void *arg)
         }
 
         DEBUG_PRINT ("Random string is %s\n", buf);
-        switch (code % 3) {
+        int op = code % 3;
+        if (read_percent >= 0)
+            op = (code % 100) < read_percent ? 0 : 1 + (code / 100) % 2;
+
+        // Keep async_depth operations in flight, counting them as they finish
+        if (async_depth) {
+            if (nspare == 0) {
+                nspare = finish_async(spare, async_depth);
+                ops += nspare;
+            }
+            struct trie_op *next = spare[--nspare];
+            next->op = op == 0 ? TRIE_OP_LOOKUP : op == 2 ? TRIE_OP_DELETE
+                : use_upsert ? TRIE_OP_UPSERT : TRIE_OP_INSERT;
+            memcpy(next->name, buf, length);
+            next->strlen = length;
+            next->ttl = 0;
+            if (op == 1 && (rv = random_r(&rd, &next->ip4_address))) {
+                printf("Failed to get random number - %d\n", rv);
+                return NULL;
+            }
+            trie_submit(next);
+            continue;
+        }
+
+        switch (op) {
             case 0: // Search
                 DEBUG_PRINT ("Search\n");
-                search (buf, length, NULL);
+                if (lookup (buf, length, NULL) == LOOKUP_MISS && negative_caching)
+                    insert_negative (buf, length);
                 break;
             case 1: // insert
                 DEBUG_PRINT ("insert\n");
@@ -105,7 +174,10 @@ client(void *arg)
                     printf("Failed to get random number - %d\n", rv);
                     return NULL;
                 }
-                insert (buf, length, ip4_addr);
+                if (use_upsert)
+                    upsert (buf, length, ip4_addr, 0);
+                else
+                    insert (buf, length, ip4_addr);
                 break;
             case 2: // delete
                 DEBUG_PRINT ("delete\n");
@@ -121,8 +193,24 @@ client(void *arg)
          */
         if (!separate_delete_thread)
             check_max_nodes();
+        ops++;
     }
 
+    // Let the last asynchronous operations finish
+    while (nspare < async_depth) {
+        int n = finish_async(&spare[nspare], async_depth - nspare);
+        nspare += n;
+        ops += n;
+    }
+    free(spare);
+    free(pool);
+
+    __sync_fetch_and_add(&total_ops, ops);
+    if (use_cache) {
+        unsigned long hits, misses;
+        cache_stats(&hits, &misses);
+        printf ("Client %ld: lookup cache hits %lu, misses %lu\n", (long) arg, hits, misses);
+    }
     return NULL;
 }
 
@@ -149,9 +237,37 @@ client(void *arg)
     if (!rv) die ("Failed to delete key " ky "\n"); \
 } while (0)					    
 
+/* search_records callback for the self-tests: count the records */
+void count_records (const struct rrset *records, void *arg) {
+    *(int *) arg = records->count;
+}
+
+#ifdef TRIE_SQUATTING
+/* A second client, to squat on a name the self-tests hold */
+void * squat_thread (void *arg) {
+    return (void *) (long) insert("squat.test", 10, 81);
+}
+#endif
+
+/* trie_op callback for the self-tests: count finished operations */
+void count_done (struct trie_op *op, void *arg) {
+    (*(int *) arg)++;
+}
+
+/* cursor_next callback for the self-tests: append the name to a
+ * comma-separated list */
+void list_names (const char *name, size_t len, const struct rrset *records, void *arg) {
+    char *list = arg;
+    sprintf(&list[strlen(list)], "%.*s,", (int) len, name);
+}
+
 int self_tests() {
     int rv;
     int32_t ip = 0;
+    int squatting = allow_squatting;
+
+    // Inserts over live names must fail here, not wait; -q is for the run
+    allow_squatting = 0;
 
     rv = insert ("abc", 3, 4);
     if (!rv) die ("Failed to insert key abc\n");
@@ -320,6 +436,281 @@ int self_tests() {
     print();
     INSERT_TEST("azbz", 4, 7);
 
+    // TTL tests.  Deletes may leave emptied nodes for check_max_nodes
+    // to unlink, so settle the tree before counting.
+    check_max_nodes();
+    int before = num_nodes();
+    rv = insert_ttl("ttl", 3, 9, 1);
+    if (!rv) die ("Failed to insert key ttl\n");
+    rv = insert_ttl("reaped.ttl", 10, 10, 1);
+    if (!rv) die ("Failed to insert key reaped.ttl\n");
+    SEARCH_TEST("ttl", 3, 9);
+    rv = insert("ttl", 3, 11);
+    if (rv) die ("Inserted over live key ttl\n");
+    sleep(2);
+    rv = search("ttl", 3, NULL);
+    if (rv) die ("Found expired key ttl\n");
+    INSERT_TEST("ttl", 3, 11);
+    SEARCH_TEST("ttl", 3, 11);
+    DELETE_TEST("ttl", 3);
+    check_max_nodes();
+    if (num_nodes() != before) die ("Expired key reaped.ttl was not reaped\n");
+
+    // Negative cache tests
+    rv = insert_negative("nxdomain", 8);
+    if (!rv) die ("Failed to insert negative key nxdomain\n");
+    if (lookup("nxdomain", 8, NULL) != LOOKUP_NEGATIVE) die ("Missed negative key nxdomain\n");
+    rv = search("nxdomain", 8, NULL);
+    if (rv) die ("Found negative key nxdomain\n");
+    rv = insert_negative("azbz", 4);
+    if (rv) die ("Inserted negative entry over live key azbz\n");
+    INSERT_TEST("nxdomain", 8, 12);
+    SEARCH_TEST("nxdomain", 8, 12);
+    DELETE_TEST("nxdomain", 8);
+    if (lookup("nxdomain", 8, NULL) != LOOKUP_MISS) die ("Bad lookup of deleted key nxdomain\n");
+
+    // Overflow the negative budget; the oldest entries go first
+    for (int k = 0; k < 25; k++) {
+        char neg[8];
+        sprintf(neg, "neg%02d", k);
+        rv = insert_negative(neg, 5);
+        if (!rv) die ("Failed to insert a negative key\n");
+    }
+    check_max_nodes();
+    if (lookup("neg00", 5, NULL) != LOOKUP_MISS) die ("Oldest negative key neg00 was not evicted\n");
+    if (lookup("neg24", 5, NULL) != LOOKUP_NEGATIVE) die ("Newest negative key neg24 was evicted\n");
+
+    // Records: 0.0.0.0 is a real address, and a name can hold several types
+    INSERT_TEST("zero", 4, 0);
+    SEARCH_TEST("zero", 4, 0);
+    {
+        struct record aaaa = { .type = RR_AAAA, .data.aaaa = { 0x20, 0x01, 0x0d, 0xb8 } };
+        struct record txt = { .type = RR_TXT, .len = 5, .data.text = "hello" };
+        int count = 0;
+
+        if (!insert_record("zero", 4, &aaaa)) die ("Failed to add AAAA record to key zero\n");
+        if (!insert_record("zero", 4, &txt)) die ("Failed to add TXT record to key zero\n");
+        if (!search_records("zero", 4, count_records, &count) || count != 3)
+            die ("Found wrong record count for key zero\n");
+        SEARCH_TEST("zero", 4, 0);
+        DELETE_TEST("zero", 4);
+        if (search_records("zero", 4, count_records, &count)) die ("Found deleted key zero\n");
+
+        // A name with no A record has no address to find
+        if (!insert_record("six", 3, &aaaa)) die ("Failed to add AAAA record to key six\n");
+        if (search("six", 3, &ip) || lookup("six", 3, &ip) != LOOKUP_MISS)
+            die ("Found an address for AAAA-only key six\n");
+        DELETE_TEST("six", 3);
+    }
+
+    // Longest suffix: the most specific enclosing name, on whole labels only
+    INSERT_TEST("example.test", 12, 20);
+    INSERT_TEST("b.example.test", 14, 21);
+    {
+        size_t suffix_len = 0;
+
+        if (!search_longest_suffix("a.b.example.test", 16, &ip, &suffix_len) || ip != 21 || suffix_len != 14)
+            die ("Found wrong enclosing name for a.b.example.test\n");
+        if (!search_longest_suffix("xb.example.test", 15, &ip, &suffix_len) || ip != 20 || suffix_len != 12)
+            die ("Found wrong enclosing name for xb.example.test\n");
+        if (!search_longest_suffix("example.test", 12, &ip, &suffix_len) || ip != 20 || suffix_len != 12)
+            die ("Found wrong enclosing name for example.test\n");
+        if (search_longest_suffix("anexample.test", 14, &ip, &suffix_len))
+            die ("Matched example.test inside a label of anexample.test\n");
+    }
+    DELETE_TEST("b.example.test", 14);
+    DELETE_TEST("example.test", 12);
+
+    // Cursor: every name under a suffix, in order, a page at a time
+    INSERT_TEST("b.zone.test", 11, 30);
+    INSERT_TEST("zone.test", 9, 31);
+    INSERT_TEST("c.b.zone.test", 13, 32);
+    INSERT_TEST("a.zone.test", 11, 33);
+    INSERT_TEST("xzone.test", 10, 34);
+    INSERT_TEST("other.test", 10, 35);
+    {
+        struct trie_cursor cursor;
+        char list[256] = "";
+        int pages = 0;
+
+        cursor_init(&cursor, "zone.test", 9);
+        while (cursor_next(&cursor, 2, list_names, list) == 2)
+            pages++;
+        if (strcmp(list, "zone.test,a.zone.test,b.zone.test,c.b.zone.test,") || pages != 2)
+            die ("Cursor walked the wrong names under zone.test\n");
+    }
+    DELETE_TEST("b.zone.test", 11);
+    DELETE_TEST("zone.test", 9);
+    DELETE_TEST("c.b.zone.test", 13);
+    DELETE_TEST("a.zone.test", 11);
+    DELETE_TEST("xzone.test", 10);
+    DELETE_TEST("other.test", 10);
+
+    // Update: change an existing name's address in place
+    INSERT_TEST("moved.test", 10, 40);
+    if (!update("moved.test", 10, 41)) die ("Failed to update key moved.test\n");
+    SEARCH_TEST("moved.test", 10, 41);
+    if (update("absent.test", 11, 42)) die ("Updated missing key absent.test\n");
+    DELETE_TEST("moved.test", 10);
+    if (update("moved.test", 10, 43)) die ("Updated deleted key moved.test\n");
+
+    // Tombstones: a delete leaves the node linked until compact
+    check_max_nodes();
+    before = num_nodes();
+    INSERT_TEST("tomb.test", 9, 44);
+    int inserted = num_nodes();
+    DELETE_TEST("tomb.test", 9);
+    rv = search("tomb.test", 9, NULL);
+    if (rv) die ("Found deleted key tomb.test\n");
+    if (num_nodes() != inserted) die ("Deleted key tomb.test was unlinked right away\n");
+    INSERT_TEST("tomb.test", 9, 45);
+    SEARCH_TEST("tomb.test", 9, 45);
+    DELETE_TEST("tomb.test", 9);
+    compact();
+    if (num_nodes() != before) die ("Tombstone tomb.test was not compacted\n");
+
+    // Upserts refresh a name in place; cas_value only changes what it expects
+    before = num_nodes();
+    if (!upsert("fresh.test", 10, 70, 0)) die ("Failed to upsert new key fresh.test\n");
+    SEARCH_TEST("fresh.test", 10, 70);
+    inserted = num_nodes();
+    if (!upsert("fresh.test", 10, 71, 0)) die ("Failed to upsert key fresh.test again\n");
+    SEARCH_TEST("fresh.test", 10, 71);
+    if (num_nodes() != inserted) die ("Upsert of fresh.test added nodes\n");
+    if (cas_value("fresh.test", 10, 70, 72)) die ("Swapped fresh.test from a stale value\n");
+    if (!cas_value("fresh.test", 10, 71, 72)) die ("Failed to swap fresh.test\n");
+    SEARCH_TEST("fresh.test", 10, 72);
+    if (cas_value("stale.test", 10, 0, 73)) die ("Swapped missing key stale.test\n");
+    DELETE_TEST("fresh.test", 10);
+    compact();
+    if (num_nodes() != before) die ("Upserted key fresh.test was not compacted\n");
+
+    // Asynchronous operations: submit a batch, then collect it in any order
+    struct trie_op aops[2], *adone[2];
+    int finished_ops = 0, k;
+    async_init(1);
+    memset(aops, 0, sizeof(aops));
+    for (k = 0; k < 2; k++) {
+        sprintf(aops[k].name, "a%d.async", k);
+        aops[k].strlen = 8;
+        aops[k].op = TRIE_OP_INSERT;
+        aops[k].ip4_address = 50 + k;
+        aops[k].done = count_done;
+        aops[k].arg = &finished_ops;
+        trie_submit(&aops[k]);
+    }
+    for (k = 0; k < 2; k += rv)
+        rv = trie_poll(&adone[k], 2 - k, 1);
+    if (finished_ops != 2 || !aops[0].res || !aops[1].res) die ("Failed to insert keys asynchronously\n");
+    SEARCH_TEST("a1.async", 8, 51);
+    aops[0].op = TRIE_OP_LOOKUP;
+    aops[1].op = TRIE_OP_DELETE;
+    trie_submit(&aops[0]);
+    trie_submit(&aops[1]);
+    for (k = 0; k < 2; k += rv)
+        rv = trie_poll(&adone[k], 2 - k, 1);
+    if (aops[0].res != LOOKUP_FOUND || aops[0].ip4_address != 50) die ("Failed async lookup of a0.async\n");
+    if (!aops[1].res) die ("Failed to delete key a1.async asynchronously\n");
+    if (search("a1.async", 8, NULL)) die ("Found async-deleted key a1.async\n");
+    aops[0].op = TRIE_OP_UPSERT;
+    aops[0].ip4_address = 55;
+    trie_submit(&aops[0]);
+    for (k = 0; k < 1; k += rv)
+        rv = trie_poll(&adone[k], 1 - k, 1);
+    if (!aops[0].res) die ("Failed to upsert key a0.async asynchronously\n");
+    SEARCH_TEST("a0.async", 8, 55);
+    DELETE_TEST("a0.async", 8);
+
+    // Batches: each op sees the ones before it, and all land at once
+    struct trie_op bops[6];
+    int bkinds[6] = { TRIE_OP_INSERT, TRIE_OP_INSERT, TRIE_OP_LOOKUP,
+                      TRIE_OP_UPDATE, TRIE_OP_DELETE, TRIE_OP_DELETE };
+    memset(bops, 0, sizeof(bops));
+    for (k = 0; k < 6; k++) {
+        sprintf(bops[k].name, "b%d.batch", k == 3 ? 1 : k % 2);
+        bops[k].strlen = 8;
+        bops[k].op = bkinds[k];
+        bops[k].ip4_address = 60 + k;
+    }
+    strcpy(bops[5].name, "b9.batch");  // Not there, so this one fails
+    rv = trie_apply_batch(bops, 6);
+    if (rv != 5) die ("Batch did not apply exactly 5 ops\n");
+    if (bops[2].res != LOOKUP_FOUND || bops[2].ip4_address != 60) die ("Batch lookup missed b0.batch\n");
+    if (!bops[3].res || bops[5].res) die ("Batch update or delete gave the wrong result\n");
+    if (search("b0.batch", 8, NULL)) die ("Found batch-deleted key b0.batch\n");
+    SEARCH_TEST("b1.batch", 8, 63);
+    bops[0].op = TRIE_OP_UPSERT;
+    strcpy(bops[0].name, "b1.batch");
+    bops[0].ip4_address = 64;
+    if (trie_apply_batch(bops, 1) != 1) die ("Batch upsert of b1.batch failed\n");
+    SEARCH_TEST("b1.batch", 8, 64);
+    DELETE_TEST("b1.batch", 8);
+
+#ifdef TRIE_SQUATTING
+    // A squatting insert waits for the name to be freed, then takes it
+    pthread_t squatter;
+    void *squatted;
+    allow_squatting = 1;
+    INSERT_TEST("squat.test", 10, 80);
+    pthread_create(&squatter, NULL, squat_thread, NULL);
+    usleep(10000);
+    SEARCH_TEST("squat.test", 10, 80);
+    DELETE_TEST("squat.test", 10);
+    pthread_join(squatter, &squatted);
+    if (!squatted) die ("Squatter failed to take squat.test\n");
+    SEARCH_TEST("squat.test", 10, 81);
+    DELETE_TEST("squat.test", 10);
+    allow_squatting = 0;
+#endif
+
+#ifdef TRIE_SNAPSHOTS
+    // A snapshot keeps the tree as it was, while writers go on
+    {
+        char then[8192] = "", now[8192] = "";
+        struct trie_snapshot *snap;
+        int count;
+
+        INSERT_TEST("old.snap", 8, 60);
+        snap = snapshot_take();
+        DELETE_TEST("old.snap", 8);
+        INSERT_TEST("new.snap", 8, 61);
+        compact();
+        count = snapshot_walk(snap, list_names, then);
+        if (!strstr(then, "old.snap,") || strstr(then, "new.snap,"))
+            die ("Snapshot changed under writers\n");
+        snapshot_release(snap);
+
+        snap = snapshot_take();
+        if (snapshot_walk(snap, list_names, now) != count)
+            die ("Snapshot has the wrong number of names\n");
+        if (strstr(now, "old.snap,") || !strstr(now, "new.snap,"))
+            die ("Snapshot missed the latest writes\n");
+        snapshot_release(snap);
+        DELETE_TEST("new.snap", 8);
+    }
+#endif
+
+#ifdef TRIE_RELOAD
+    // A reload swaps a whole new zone in at once
+    {
+        struct zone_name zone[] = {
+            { "www.new.zone", 12, 70, 0 },
+            { "mail.new.zone", 13, 71, 0 },
+            { "new.zone", 8, 72, 0 },
+        };
+
+        INSERT_TEST("old.zone", 8, 69);
+        if (reload(zone, 3) != 3) die ("Failed to reload a zone\n");
+        if (search("old.zone", 8, NULL)) die ("Found key old.zone after a reload\n");
+        SEARCH_TEST("www.new.zone", 12, 70);
+        SEARCH_TEST("mail.new.zone", 13, 71);
+        SEARCH_TEST("new.zone", 8, 72);
+        if (num_nodes() != 4) die ("Reloaded zone has the wrong number of nodes\n");
+        INSERT_TEST("old.zone", 8, 69);
+        SEARCH_TEST("old.zone", 8, 69);
+    }
+#endif
+
     //Test delete thread
     if (separate_delete_thread) {
         srandom(time(0));
@@ -435,16 +826,27 @@ int self_tests() {
     printf("End of self-tests, tree is:\n");
     print();
     printf("End of self-tests\n");
+    allow_squatting = squatting;
     return 0;
 }
 
 void help() {
     printf ("DNS Simulator.  Usage: ./dns-[variant] [options]\n\n");
     printf ("Options:\n");
+    printf ("\t-a depth - Keep depth operations in flight per client, run by a pool\n"
+            "\t           of depth worker threads.\n");
     printf ("\t-c numclients - Use numclients threads.\n");
+    printf ("\t-f - Reject absent names with a Bloom filter before searching.\n");
     printf ("\t-h - Print this help.\n");
     printf ("\t-l length - Run clients for length seconds.\n");
+    printf ("\t-n - Cache negative entries for names that searches miss.\n");
+    printf ("\t-p - Keep a per-thread cache of recent lookup results.\n");
+    printf ("\t-q - Let inserts of names that are taken wait until they are freed.\n");
+    printf ("\t-r percent - Make percent of operations searches, and split the rest\n"
+            "\t             between inserts and deletes.  Default is an even mix.\n");
     printf ("\t-t  - Run a separate delete thread.\n");
+    printf ("\t-u  - Write with upsert, refreshing names already there, instead of insert.\n");
+    printf ("\t-x  - Answer exact-match lookups from a hash index.\n");
     printf ("\n\n");
 }
 
@@ -456,17 +858,35 @@ int main(int argc, char ** argv) {
     // Read options from command line:
     //   # clients from command line, as well as seed file
     //   Simulation length
-    while ((c = getopt (argc, argv, "c:hl:s:t")) != -1) {
+    while ((c = getopt (argc, argv, "a:c:fhl:npqr:s:tux")) != -1) {
         switch (c) {
+            case 'a':
+                async_depth = atoi(optarg);
+                break;
             case 'c':
                 numthreads = atoi(optarg);
                 break;
+            case 'f':
+                use_filter = 1;
+                break;
             case 'h':
                 help();
                 return 0;
             case 'l':
                 simulation_length = atoi(optarg);
                 break;
+            case 'n':
+                negative_caching = 1;
+                break;
+            case 'p':
+                use_cache = 1;
+                break;
+            case 'q':
+                allow_squatting = 1;
+                break;
+            case 'r':
+                read_percent = atoi(optarg);
+                break;
             case 's':
                 use_global_salt = 1;
                 global_salt = atoi(optarg);
@@ -474,6 +894,12 @@ int main(int argc, char ** argv) {
             case 't':
                 separate_delete_thread = 1;
                 break;
+            case 'u':
+                use_upsert = 1;
+                break;
+            case 'x':
+                use_hash_index = 1;
+                break;
             default:
                 printf ("Unknown option\n");
                 help();
@@ -484,6 +910,8 @@ int main(int argc, char ** argv) {
     // Create initial data structure, populate with initial entries
     // Note: Each variant of the tree has a different init function, statically compiled in
     init(numthreads);
+    if (async_depth)
+        async_init(async_depth);
     srandom(time(0));
 
     tinfo = calloc(numthreads + separate_delete_thread, sizeof(pthread_t));
@@ -508,7 +936,7 @@ int main(int argc, char ** argv) {
     for (i = 0; i < numthreads; i++) {
 
         rv = pthread_create(&tinfo[i], NULL,
-                &client, NULL);
+                &client, (void *) (long) i);
         if (rv != 0) {
             printf ("Thread creation failed %d\n", rv);
             return rv;
@@ -520,7 +948,9 @@ int main(int argc, char ** argv) {
     finished = 1;
 
     // Wait for all clients to exit.  If we are allowing blocking,
-    // cancel the threads, since they may hang forever
+    // wake the squatters, since they may hang forever
+    if (allow_squatting)
+        waitq_shutdown();
     if (separate_delete_thread) {
         shutdown_delete_thread();
     }
@@ -531,6 +961,10 @@ int main(int argc, char ** argv) {
             printf ("Uh oh.  pthread_join failed %d\n", rv);
     }
 
+    printf ("%lu operations in %d seconds, %lu per second\n",
+            total_ops, simulation_length, total_ops / (simulation_length ? simulation_length : 1));
+    print_stats();
+
 #ifdef DEBUG  
     /* Print the final tree for fun */
     print();
@@ -5,25 +5,163 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "trie.h"
+#include "expiry.h"
+#include "cursor.h"
+#include "hashindex.h"
+#include "bloom.h"
+#include "lookupcache.h"
+#include "locks.h"
+#include "async.h"
+#include "waitq.h"
+#include "zone.h"
 
 struct trie_node {
     struct trie_node *next;  /* parent list */
     unsigned int strlen; /* Length of the key */
-    int32_t ip4_address; /* 4 octets */
+    struct rrset records; /* The name's records, if present */
+    unsigned char present; /* Does this node hold a value? */
+    uint32_t expires; /* Tick when the value or negative entry expires, 0 = never */
+    unsigned char negative; /* A cached "known absent" entry rather than a value */
+    struct index_entry *indexed; /* In the hash index, if it is on */
+    unsigned char filtered; /* Counted in the filter, if it is on */
+    uint64_t filter_hash; /* Of the full name, to remove it from the filter */
     struct trie_node *children; /* Sorted list of children */
     char key[MAX_KEY]; /* Up to MAX_KEY chars */
 };
 
-static struct trie_node * root = NULL;
-static int node_count = 0;
+/* What _insert stores at a name */
+struct new_value {
+    const struct record *record; /* Record to add, NULL for a negative entry */
+    uint32_t expires; /* Tick when it expires, 0 = never */
+    int negative; /* Store a negative entry instead of a record */
+    int append; /* Add to a live record set, rather than failing */
+    const char *name; /* The full name, for the hash index */
+    size_t name_len;
+    int replace; /* Overwrite a live value too (upsert) */
+};
+
+/* Best match so far in search_longest_suffix */
+struct suffix_match {
+    int found;
+    size_t rest; /* Length of the string in front of the match */
+    int32_t ip4_address;
+};
+
+/* A tree and its counts: the live one, under the trie lock, or a zone
+ * that reload is building off to the side.  Each thread works on the
+ * one draft points to.
+ */
+struct draft {
+    struct trie_node *root;
+    int node_count;
+    int negative_count;
+    struct hash_index *index;
+};
+static struct draft live = { NULL, 0, 0, NULL };
+static __thread struct draft *draft = &live;
+
+#define root (draft->root)
+#define node_count (draft->node_count)
+#define negative_count (draft->negative_count)
+#define name_index (*draft->index)
+
 static int max_count = 100;  //Try to stay under 100 nodes
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct expiry_wheel wheel;
+static int max_negative = 20;  //Negative entries get their own, smaller budget
+static uint32_t negative_ttl = 5;  //Seconds
+static struct expiry_queue negative_queue;
+static struct expiry_queue prune_queue;  //Names of tombstones awaiting compact()
+extern int use_hash_index;
+static struct bloom filter;
+extern int use_filter;
+extern int use_cache;
 static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct brlock reload_gate;  //Writers share it, so reload can hold them off while it builds
 static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
 extern int separate_delete_thread;
 
-struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_address) {
+/* The one trie-wide lock.  By default this is a pthread mutex.  With
+ * -DMUTEX_MCS (dns-mutex-mcs) it is an MCS queue lock (locks.h), whose
+ * waiters spin on their own nodes and then park; build with
+ * -DMCS_PARK=0 to have them yield instead.  With -DMUTEX_FC
+ * (dns-mutex-fc) it is a flat combiner's lock: lookup, insert and
+ * delete post their critical sections (see run_locked), and whoever
+ * holds the lock runs everyone's at once.
+ */
+#if defined(MUTEX_MCS)
+#ifndef MCS_PARK
+#define MCS_PARK 1
+#endif
+static struct mcs_lock mutex;
+static __thread struct mcs_node my_node;
+
+void trie_lock () {
+    mcs_lock(&mutex, &my_node);
+}
+
+void trie_unlock () {
+    mcs_unlock(&mutex, &my_node);
+}
+#elif defined(MUTEX_FC)
+static struct fc_lock mutex;
+
+void trie_lock () {
+    pthread_mutex_lock(&mutex.lock);
+}
+
+void trie_unlock () {
+    pthread_mutex_unlock(&mutex.lock);
+}
+#else
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void trie_lock () {
+    pthread_mutex_lock(&mutex);
+}
+
+void trie_unlock () {
+    pthread_mutex_unlock(&mutex);
+}
+#endif
+
+/* The arguments and results of one lookup, insert or delete's
+ * critical section, so that a combiner can run it for us.
+ */
+struct locked_op {
+    const char *string;
+    size_t strlen;
+    const struct new_value *value; /* insert */
+    uint32_t now; /* lookup */
+    int res;
+    int has_a; /* lookup */
+    int32_t ip; /* lookup */
+    uint32_t expires; /* lookup */
+    int prunable; /* delete */
+    int32_t expected; /* cas_value */
+};
+
+/* Run fn(op) under the trie lock, passing through delete_mutex first
+ * so a waiting delete thread gets its turn.  op is usually a struct
+ * locked_op, but a batch passes a struct locked_batch.
+ */
+void run_locked (void (*fn) (void *), void *op) {
+    pthread_mutex_lock(&delete_mutex);
+#if defined(MUTEX_FC)
+    pthread_mutex_unlock(&delete_mutex);
+    fc_run(&mutex, fn, op);
+#else
+    trie_lock();
+    pthread_mutex_unlock(&delete_mutex);
+    fn(op);
+    trie_unlock();
+#endif
+}
+
+void set_value (struct trie_node *node, const struct new_value *value);
+
+struct trie_node * new_leaf (const char *string, size_t strlen, const struct new_value *value) {
     struct trie_node *new_node = malloc(sizeof(struct trie_node));
     node_count++;
     if (!new_node) {
@@ -36,12 +174,77 @@ struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_addr
     new_node->strlen = strlen;
     strncpy(new_node->key, string, strlen);
     new_node->key[strlen] = '\0';
-    new_node->ip4_address = ip4_address;
+    rrset_init(&new_node->records);
+    new_node->indexed = NULL;
+    new_node->filtered = 0;
+    new_node->present = 0;
+    new_node->expires = 0;
+    new_node->negative = 0;
     new_node->children = NULL;
+    if (value)
+        set_value(new_node, value);
 
     return new_node;
 }
 
+/* Does this node hold a value that has not expired by tick now? */
+int live_value (struct trie_node *node, uint32_t now) {
+    return node->present && (node->expires == 0 || node->expires > now);
+}
+
+/* Does this node hold nothing at all, not even a negative entry? */
+int empty_node (struct trie_node *node) {
+    return !node->present && !node->negative;
+}
+
+/* Store a record or a negative entry, or clear the node if value
+ * is NULL, keeping negative_count in step.
+ */
+void set_value (struct trie_node *node, const struct new_value *value) {
+    int negative = value && value->negative;
+
+    negative_count += negative - node->negative;
+    node->negative = negative;
+
+    // Appending to a live set keeps its records and its TTL
+    if (!value || !value->append || !live_value(node, expiry_now())) {
+        rrset_clear(&node->records);
+        node->expires = value ? value->expires : 0;
+    }
+    if (value && value->record)
+        rrset_add(&node->records, value->record);
+    node->present = (node->records.count > 0);
+
+    // Index exactly the nodes that hold something
+    if (use_hash_index) {
+        if (!empty_node(node) && !node->indexed)
+            node->indexed = index_add(&name_index, value->name, value->name_len, node);
+        else if (empty_node(node) && node->indexed) {
+            index_remove(&name_index, node->indexed);
+            node->indexed = NULL;
+        }
+    }
+    if (use_filter) {
+        if (!empty_node(node) && !node->filtered) {
+            node->filter_hash = bloom_hash(value->name, value->name_len);
+            bloom_add(&filter, node->filter_hash);
+            node->filtered = 1;
+        } else if (empty_node(node) && node->filtered) {
+            bloom_remove(&filter, node->filter_hash);
+            node->filtered = 0;
+        }
+    }
+    if (use_cache)
+        cache_invalidate();
+}
+
+/* Would _delete remove what this node holds? */
+int deletable (struct trie_node *node, uint32_t expired_by, int negative) {
+    if (negative ? !node->negative : !node->present)
+        return 0;
+    return !expired_by || (node->expires && node->expires <= expired_by);
+}
+
 // Compare strings backward.  Unlike strncmp, we assume
 // that we will not stop at a null termination, only after
 // n chars (or a difference).  Base code borrowed from musl
@@ -96,6 +299,19 @@ int compare_keys_substring (const char *string1, int len1, const char *string2,
 
 void init(int numthreads) {
     root = NULL;
+#if defined(MUTEX_MCS)
+    mcs_init(&mutex, MCS_PARK);
+#elif defined(MUTEX_FC)
+    fc_init(&mutex);
+#endif
+    expiry_init(&wheel);
+    expiry_queue_init(&negative_queue);
+    expiry_queue_init(&prune_queue);
+    bloom_init(&filter);
+    brlock_init(&reload_gate);
+    live.index = malloc(sizeof(struct hash_index));
+    assert(live.index);
+    index_init(&name_index, 0);
 }
 
 void shutdown_delete_thread() {
@@ -152,26 +368,253 @@ _search (struct trie_node *node, const char *string, size_t strlen) {
     }
 }
 
-int search  (const char *string, size_t strlen, int32_t *ip4_address) {
+/* Exact-match search, from the hash index if it is on.  The caller
+ * holds the trie's lock, which also covers the index.
+ */
+struct trie_node * find_exact (const char *string, size_t strlen) {
+    if (use_hash_index)
+        return index_find(&name_index, string, strlen, NULL, NULL);
+    return _search(root, string, strlen);
+}
+
+int search (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+/* lookup's critical section */
+void _lookup_locked (void *arg) {
+    struct locked_op *op = arg;
+    struct trie_node *found = find_exact(op->string, op->strlen);
+
+    if (found && live_value(found, op->now)) {
+        op->has_a = rrset_find_a(&found->records, &op->ip);
+        op->res = op->has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+        op->expires = found->expires;
+    } else if (found && found->negative && found->expires > op->now) {
+        op->res = LOOKUP_NEGATIVE;
+        op->expires = found->expires;
+    }
+}
+
+int lookup (const char *string, size_t strlen, int32_t *ip4_address) {
+    uint32_t now = expiry_now();
+    int res = LOOKUP_MISS;
+    unsigned long epoch = cache_epoch();
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    // Hot names are answered from this thread's cache, without locks
+    if (use_cache && cache_get(string, strlen, epoch, now, &res, ip4_address))
+        return res;
+
+    // Most absent names stop here, without any locks
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return LOOKUP_MISS;
+
+    struct locked_op op = { string, strlen, NULL, now, LOOKUP_MISS, 0, 0, 0, 0 };
+    run_locked(_lookup_locked, &op);
+    res = op.res;
+    if (use_filter && res == LOOKUP_MISS)
+        bloom_false_positive(&filter);
+    if (use_cache)
+        cache_put(string, strlen, epoch, res, op.has_a, op.ip, op.expires);
+    if (ip4_address && op.has_a)
+        *ip4_address = op.ip;
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
     struct trie_node *found;
+    int res = 0;
 
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return 0;
+
     pthread_mutex_lock(&delete_mutex);
-    pthread_mutex_lock(&mutex);
+    trie_lock();
     pthread_mutex_unlock(&delete_mutex);
-    found = _search(root, string, strlen);
+    found = find_exact(string, strlen);
 
-    if (found && ip4_address)
-        *ip4_address = found->ip4_address;
-    pthread_mutex_unlock(&mutex);
-    return (found != NULL);
+    if (found && live_value(found, expiry_now())) {
+        fn(&found->records, arg);
+        res = 1;
+    }
+    trie_unlock();
+    return res;
+}
+
+/* Recursive helper for search_longest_suffix.  Walks the same path
+ * as _search, remembering the deepest live value that ends on a
+ * label boundary.
+ */
+void
+_search_suffix (struct trie_node *node, const char *string, size_t strlen,
+        uint32_t now, struct suffix_match *match) {
+
+    int keylen, cmp;
+
+    // First things first, check if we are NULL 
+    if (node == NULL) return;
+
+    assert(node->strlen < MAX_KEY);
+
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // This node is on the path unless its key is longer than the string
+        if (node->strlen > keylen)
+            return;
+        if (live_value(node, now) && (strlen == keylen || string[strlen - keylen - 1] == '.')) {
+            match->found = 1;
+            match->rest = strlen - keylen;
+            match->ip4_address = 0;
+            rrset_find_a(&node->records, &match->ip4_address);
+        }
+        if (strlen > keylen)
+            _search_suffix(node->children, string, strlen - keylen, now, match);
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0)
+            _search_suffix(node->next, string, strlen, now, match);
+    }
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    struct suffix_match match = { 0, 0, 0 };
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    pthread_mutex_lock(&delete_mutex);
+    trie_lock();
+    pthread_mutex_unlock(&delete_mutex);
+    _search_suffix(root, string, strlen, expiry_now(), &match);
+    trie_unlock();
+
+    if (match.found) {
+        if (ip4_address)
+            *ip4_address = match.ip4_address;
+        if (suffix_len)
+            *suffix_len = strlen - match.rest;
+    }
+    return match.found;
+}
+
+/* Recursive helper for cursor_next.  name is a MAX_KEY buffer whose
+ * last namelen bytes hold the full name of node's parent.  Walks node
+ * and its later siblings.  Returns 1 once the walk should stop.
+ */
+int _cursor_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        struct trie_cursor *cursor, int *left,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+
+    for (; node; node = node->next) {
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+        int want;
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        want = cursor_check(cursor, start, strlen);
+        if (want & CURSOR_STOP)
+            return 1;
+        if ((want & CURSOR_EMIT) && live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            cursor_advance(cursor, start, strlen);
+            if (--*left == 0)
+                return 1;
+        }
+        if ((want & CURSOR_DESCEND) && _cursor_walk(node->children, name, strlen, now, cursor, left, fn, arg))
+            return 1;
+    }
+    return 0;
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    int left = max;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    pthread_mutex_lock(&delete_mutex);
+    trie_lock();
+    pthread_mutex_unlock(&delete_mutex);
+    _cursor_walk(root, name, 0, expiry_now(), cursor, &left, fn, arg);
+    trie_unlock();
+
+    // A page that isn't full means the walk ran out of names
+    if (left > 0)
+        cursor->done = 1;
+    return max - left;
+}
+
+/* update's critical section */
+void _update_locked (void *arg) {
+    struct locked_op *op = arg;
+    struct trie_node *found = find_exact(op->string, op->strlen);
+
+    if (found && live_value(found, expiry_now()))
+        op->res = rrset_set_a(&found->records, op->ip);
+    if (op->res && use_cache)
+        cache_invalidate();
+}
+
+/* With a single lock there is no cheaper read side, but update at
+ * least skips _insert and its allocation.
+ */
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    struct locked_op op = { string, strlen, NULL, 0, 0, 0, ip4_address, 0, 0 };
+    brlock_rdlock(&reload_gate);
+    pthread_mutex_lock(&delete_mutex);
+    trie_lock();
+    pthread_mutex_unlock(&delete_mutex);
+    _update_locked(&op);
+    trie_unlock();
+    brlock_rdunlock(&reload_gate);
+    return op.res;
+}
+
+/* cas_value's critical section */
+void _cas_locked (void *arg) {
+    struct locked_op *op = arg;
+    struct trie_node *found = find_exact(op->string, op->strlen);
+    int32_t ip;
+
+    if (found && live_value(found, expiry_now())
+            && rrset_find_a(&found->records, &ip) && ip == op->expected)
+        op->res = rrset_set_a(&found->records, op->ip);
+    if (op->res && use_cache)
+        cache_invalidate();
+}
+
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    struct locked_op op = { string, strlen, NULL, 0, 0, 0, ip4_address, 0, 0, expected };
+    brlock_rdlock(&reload_gate);
+    run_locked(_cas_locked, &op);
+    brlock_rdunlock(&reload_gate);
+    return op.res;
 }
 
 /* Recursive helper function */
-int _insert (const char *string, size_t strlen, int32_t ip4_address, 
+int _insert (const char *string, size_t strlen, const struct new_value *value,
         struct trie_node *node, struct trie_node *parent, struct trie_node *left) {
 
     int cmp, keylen;
@@ -193,7 +636,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert(keylen == strlen);
             assert((!parent) || parent->children == node);
 
-            new_node = new_leaf (string, strlen, ip4_address);
+            new_node = new_leaf (string, strlen, value);
             node->strlen -= keylen;
             new_node->children = node;
             new_node->next = node->next;
@@ -214,18 +657,18 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
             if (node->children == NULL) {
                 // Insert leaf here
-                struct trie_node *new_node = new_leaf (string, strlen - keylen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen - keylen, value);
                 node->children = new_node;
                 return 1;
             } else {
                 // Recur on children list, store "parent" (loosely defined)
-                return _insert(string, strlen - keylen, ip4_address,
+                return _insert(string, strlen - keylen, value,
                         node->children, node, NULL);
             }
         } else {
             assert (strlen == keylen);
-            if (node->ip4_address == 0) {
-                node->ip4_address = ip4_address;
+            if (value->append || value->replace || !live_value(node, expiry_now())) {
+                set_value(node, value);
                 return 1;
             } else {
                 return 0;
@@ -248,7 +691,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
         if (overlap) {
             // Insert a common parent, recur
             int offset = strlen - keylen2;
-            struct trie_node *new_node = new_leaf (&string[offset], keylen2, 0);
+            struct trie_node *new_node = new_leaf (&string[offset], keylen2, NULL);
             assert ((node->strlen - keylen2) > 0);
             node->strlen -= keylen2;
             new_node->children = node;
@@ -267,23 +710,23 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
                 root = new_node;
             }
 
-            return _insert(string, offset, ip4_address,
+            return _insert(string, offset, value,
                     node, new_node, NULL);
         } else {
             cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
             if (cmp < 0) {
                 // No, recur right (the node's key is "less" than  the search key)
                 if (node->next)
-                    return _insert(string, strlen, ip4_address, node->next, NULL, node);
+                    return _insert(string, strlen, value, node->next, NULL, node);
                 else {
                     // Insert here
-                    struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                    struct trie_node *new_node = new_leaf (string, strlen, value);
                     node->next = new_node;
                     return 1;
                 }
             } else {
                 // Insert here
-                struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen, value);
                 new_node->next = node;
                 if (node == root)
                     root = new_node;
@@ -299,39 +742,160 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
 void assert_invariants();
 
+int insert_value (const char *string, size_t strlen, const struct new_value *value);
+
 int insert (const char *string, size_t strlen, int32_t ip4_address) {
-    // Skip strings of length 0
-    if (strlen == 0)
-        return 0;
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
 
-    assert(strlen < MAX_KEY);
+/* One try at a squatting insert, for waitq_until */
+int try_insert (void *arg) {
+    const struct new_value *value = arg;
+    return insert_value(value->name, value->name_len, value);
+}
 
-    pthread_mutex_lock(&delete_mutex);
-    pthread_mutex_lock(&mutex);
-    pthread_mutex_unlock(&delete_mutex);
-    int insert_res;
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &value);
+    return insert_value(string, strlen, &value);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    struct new_value value = { record, 0, 0, 1, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen, 1 };
+    return insert_value(string, strlen, &value);
+}
+
+/* insert_value's critical section */
+void _insert_locked (void *arg) {
+    struct locked_op *op = arg;
 
     /* Edge case: root is null */
     if (root == NULL) {
-        root = new_leaf(string, strlen, ip4_address);
-        insert_res = 1;
-    } else insert_res = _insert(string, strlen, ip4_address, root, NULL, NULL);
+        root = new_leaf(op->string, op->strlen, op->value);
+        op->res = 1;
+    } else op->res = _insert(op->string, op->strlen, op->value, root, NULL, NULL);
     assert_invariants();
-    if (node_count > max_count && separate_delete_thread)
+    if ((node_count > max_count || negative_count > max_negative) && separate_delete_thread)
         pthread_cond_signal(&delete_cond);
-    pthread_mutex_unlock(&mutex);
+}
+
+/* Common code for inserting a value or a negative entry */
+int insert_value (const char *string, size_t strlen, const struct new_value *value) {
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    assert(strlen < MAX_KEY);
+
+    struct locked_op op = { string, strlen, value, 0, 0, 0, 0, 0, 0 };
+    brlock_rdlock(&reload_gate);
+    run_locked(_insert_locked, &op);
+    int insert_res = op.res;
+
+    if (insert_res && value->negative)
+        expiry_queue_push(&negative_queue, string, strlen, value->expires);
+    else if (insert_res)
+        expiry_add(&wheel, string, strlen, value->expires);
+    brlock_rdunlock(&reload_gate);
     return insert_res;
 }
 
+/* Free a tree that nothing can reach any more, taking its names out
+ * of the filter.  Its index entries go with its draft's index.
+ */
+void _free_tree (struct trie_node *node) {
+    struct trie_node *next;
+
+    for (; node; node = next) {
+        next = node->next;
+        _free_tree(node->children);
+        if (node->filtered)
+            bloom_remove(&filter, node->filter_hash);
+        rrset_clear(&node->records);
+        free(node);
+    }
+}
+
+/* Readers only look at the tree under the trie lock, so once the swap
+ * has it nobody is left in the old tree, and it can be freed at once.
+ */
+int reload (const struct zone_name *zone, int n) {
+    struct draft fresh = { NULL, 0, 0, NULL }, old;
+    int i, loaded = 0;
+
+    fresh.index = malloc(sizeof(struct hash_index));
+    assert(fresh.index);
+    index_init(fresh.index, 0);
+
+    // Build the new tree in this thread's own draft; nothing else sees
+    // it, and writers wait at the gate so that none of theirs is lost
+    brlock_wrlock(&reload_gate);
+    draft = &fresh;
+    for (i = 0; i < n; i++) {
+        struct record record = { .type = RR_A, .data.a = zone[i].ip4_address };
+        struct new_value value = { &record, expiry_from_ttl(zone[i].ttl), 0, 0,
+            zone[i].name, zone[i].strlen };
+        int res;
+
+        if (zone[i].strlen == 0)
+            continue;
+        if (root == NULL) {
+            root = new_leaf (zone[i].name, zone[i].strlen, &value);
+            res = 1;
+        } else
+            res = _insert(zone[i].name, zone[i].strlen, &value, root, NULL, NULL);
+        if (res) {
+            expiry_add(&wheel, zone[i].name, zone[i].strlen, value.expires);
+            loaded++;
+        }
+    }
+    assert_invariants();
+    draft = &live;
+
+    // ... and swap it in for the live tree
+    pthread_mutex_lock(&delete_mutex);
+    trie_lock();
+    old = live;
+    live = fresh;
+    trie_unlock();
+    pthread_mutex_unlock(&delete_mutex);
+    brlock_wrunlock(&reload_gate);
+    if (use_cache)
+        cache_invalidate();
+
+    // The old tree is ours alone now
+    draft = &old;
+    _free_tree(root);
+    index_clear(&name_index);
+    draft = &live;
+    free(old.index);
+    return loaded;
+}
+
 /* Recursive helper function.
  * Returns a pointer to the node if found.
  * Stores an optional pointer to the 
  * parent, or what should be the parent if not found.
- * 
+ * If expired_by is non-zero, only delete a value that 
+ * expired at or before that tick.  If negative is set,
+ * delete a negative entry instead of a value.
  */
 struct trie_node * 
 _delete (struct trie_node *node, const char *string, 
-        size_t strlen) {
+        size_t strlen, uint32_t expired_by, int negative) {
     int keylen, cmp;
 
     // First things first, check if we are NULL 
@@ -348,11 +912,11 @@ _delete (struct trie_node *node, const char *string,
         if (node->strlen > keylen) {
             return NULL;
         } else if (strlen > keylen) {
-            struct trie_node *found =  _delete(node->children, string, strlen - keylen);
+            struct trie_node *found =  _delete(node->children, string, strlen - keylen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->children == found);
                     node->children = found->next;
                     free(found);
@@ -360,7 +924,7 @@ _delete (struct trie_node *node, const char *string,
                 }
 
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -372,12 +936,16 @@ _delete (struct trie_node *node, const char *string,
         } else {
             assert (strlen == keylen);
 
-            /* We found it! Clear the ip4 address and return. */
-            if (node->ip4_address) {
-                node->ip4_address = 0;
-
+            /* We found it! Clear the records if we may, and report the
+             * node if that leaves it empty, so it (and any emptied
+             * ancestors) get unlinked.  The reaper only takes values that
+             * have really expired, since the name may have been
+             * re-inserted with a new TTL. */
+            if (deletable(node, expired_by, negative))
+                set_value(node, NULL);
+            if (empty_node(node)) {
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -389,7 +957,7 @@ _delete (struct trie_node *node, const char *string,
                 }
                 return node;
             } else {
-                /* Just an interior node with no value */
+                /* Still holds a value */
                 return NULL;
             }
         }
@@ -398,11 +966,11 @@ _delete (struct trie_node *node, const char *string,
         cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
         if (cmp < 0) {
             // No, look right (the node's key is "less" than  the search key)
-            struct trie_node *found = _delete(node->next, string, strlen);
+            struct trie_node *found = _delete(node->next, string, strlen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->next == found);
                     node->next = found->next;
                     free(found);
@@ -419,25 +987,143 @@ _delete (struct trie_node *node, const char *string,
     }
 }
 
+/* delete's critical section.  Only clear the value.  The node stays
+ * linked as a tombstone, which searches already treat as a miss,
+ * until compact() gets to it.
+ */
+void _delete_locked (void *arg) {
+    struct locked_op *op = arg;
+    struct trie_node *found = find_exact(op->string, op->strlen);
+
+    if (found && deletable(found, 0, 0)) {
+        set_value(found, NULL);
+        op->prunable = (found->children == NULL);
+        op->res = 1;
+        waitq_wake(op->string, op->strlen);
+    }
+    assert_invariants();
+}
+
 int delete  (const char *string, size_t strlen) {
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
-    pthread_mutex_lock(&delete_mutex);
-    pthread_mutex_lock(&mutex);
-    pthread_mutex_unlock(&delete_mutex);
-    struct trie_node *delete_result = _delete(root, string, strlen);
-    assert_invariants();
-    pthread_mutex_unlock(&mutex);
-    return (NULL != delete_result);
+    struct locked_op op = { string, strlen, NULL, 0, 0, 0, 0, 0, 0 };
+    brlock_rdlock(&reload_gate);
+    run_locked(_delete_locked, &op);
+
+    if (op.prunable)
+        expiry_queue_push(&prune_queue, string, strlen, 0);
+    brlock_rdunlock(&reload_gate);
+    return op.res;
+}
+
+/* One of a batch's operations, ready for its critical section */
+struct batch_slot {
+    struct locked_op locked;
+    struct new_value value; /* inserts */
+    struct record record;
+};
+
+/* trie_apply_batch's arguments to run_locked */
+struct locked_batch {
+    struct trie_op *ops;
+    struct batch_slot *slots;
+    int n;
+};
+
+/* trie_apply_batch's critical section: each op's own, in turn */
+void _batch_locked (void *arg) {
+    struct locked_batch *batch = arg;
+    int i;
+
+    for (i = 0; i < batch->n; i++) {
+        struct locked_op *op = &batch->slots[i].locked;
+        if (op->strlen == 0)
+            continue;
+        switch (batch->ops[i].op) {
+            case TRIE_OP_LOOKUP:
+                _lookup_locked(op);
+                break;
+            case TRIE_OP_INSERT:
+            case TRIE_OP_INSERT_NEGATIVE:
+            case TRIE_OP_UPSERT:
+                _insert_locked(op);
+                break;
+            case TRIE_OP_UPDATE:
+                _update_locked(op);
+                break;
+            case TRIE_OP_DELETE:
+                _delete_locked(op);
+                break;
+            default:
+                assert(0);
+        }
+    }
+}
+
+/* The whole batch is one critical section, so with -DMUTEX_FC it is
+ * also one combined op.
+ */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    struct locked_batch batch = { ops, NULL, n };
+    uint32_t now = expiry_now();
+    int i, done = 0;
+
+    if (n <= 0)
+        return 0;
+    brlock_rdlock(&reload_gate);
+    batch.slots = calloc(n, sizeof(struct batch_slot));
+    assert(batch.slots);
+
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        struct batch_slot *slot = &batch.slots[i];
+
+        assert(op->strlen < MAX_KEY);
+        slot->locked.string = op->name;
+        slot->locked.strlen = op->strlen;
+        slot->locked.value = &slot->value;
+        slot->locked.now = now;
+        slot->locked.ip = op->ip4_address;
+        if (op->op == TRIE_OP_INSERT || op->op == TRIE_OP_UPSERT) {
+            slot->record.type = RR_A;
+            slot->record.data.a = op->ip4_address;
+            slot->value = (struct new_value) { &slot->record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen,
+                op->op == TRIE_OP_UPSERT };
+        } else if (op->op == TRIE_OP_INSERT_NEGATIVE)
+            slot->value = (struct new_value) { NULL, expiry_from_ttl(negative_ttl), 1, 0, op->name, op->strlen };
+    }
+
+    run_locked(_batch_locked, &batch);
+
+    // Then what each plain call does after it unlocks
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        struct batch_slot *slot = &batch.slots[i];
+
+        op->res = slot->locked.res;
+        if (op->op == TRIE_OP_LOOKUP && slot->locked.has_a)
+            op->ip4_address = slot->locked.ip;
+        else if (op->op == TRIE_OP_INSERT_NEGATIVE && op->res)
+            expiry_queue_push(&negative_queue, op->name, op->strlen, slot->value.expires);
+        else if ((op->op == TRIE_OP_INSERT || op->op == TRIE_OP_UPSERT) && op->res)
+            expiry_add(&wheel, op->name, op->strlen, slot->value.expires);
+        else if (op->op == TRIE_OP_DELETE && slot->locked.prunable)
+            expiry_queue_push(&prune_queue, op->name, op->strlen, 0);
+        done += (op->res != 0);
+    }
+    free(batch.slots);
+    brlock_rdunlock(&reload_gate);
+    return done;
 }
 
 /* Find one node to remove from the tree. 
  * Use any policy you like to select the node.
  */
 int drop_one_node() {
-    struct trie_node *node = root;
+    struct trie_node *node = root, *leaf;
     assert(node->key != NULL);
     int size = MAX_KEY-1;
     char key[size+1];
@@ -447,32 +1133,112 @@ int drop_one_node() {
         size -= node->strlen;
         assert(size >= 0);
         memcpy(&key[size], node->key, node->strlen);
+        leaf = node;
     } while ((node = node->children));
     assert(node == NULL);
-    return (_delete(root, &key[size], strlen(&key[size])) != NULL);
+    int negative = leaf->negative;
+    if (_delete(root, &key[size], strlen(&key[size]), 0, negative) == NULL)
+        return 0;
+    if (!negative)
+        waitq_wake(&key[size], strlen(&key[size]));
+    return 1;
+}
+
+/* Drop the oldest negative entry.  Returns 0 if there are none.
+ * Called with the trie locked for writing.
+ */
+int drop_one_negative() {
+    struct expiry_entry *entry;
+    int res = 0;
+
+    while (!res && (entry = expiry_queue_pop(&negative_queue, 0))) {
+        res = (_delete(root, entry->key, entry->strlen, 0, 1) != NULL);
+        free(entry);
+    }
+    return res;
+}
+
+/* Delete every name whose TTL has run out.  The wheel hands us
+ * just the names that came due, so the tree is never scanned.
+ * Called with the trie locked for writing.
+ */
+void reap_expired() {
+    uint32_t now = expiry_now();
+    struct expiry_entry *entry = expiry_advance(&wheel, now), *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        if (_delete(root, entry->key, entry->strlen, now, 0))
+            waitq_wake(entry->key, entry->strlen);
+        free(entry);
+    }
+
+    // Negative entries all share one TTL, so their queue is in expiry order
+    while ((entry = expiry_queue_pop(&negative_queue, now))) {
+        _delete(root, entry->key, entry->strlen, now, 1);
+        free(entry);
+    }
+}
+/* Unlink the tombstones that deletes have left behind, up to
+ * COMPACT_BATCH of them per hold of the lock. Called with delete_mutex held.
+ */
+void compact() {
+    struct expiry_entry *batch[COMPACT_BATCH];
+    int i, n;
+
+    do {
+        for (n = 0; n < COMPACT_BATCH && (batch[n] = expiry_queue_pop(&prune_queue, 0)); n++)
+            ;
+        if (n == 0)
+            break;
+        trie_lock();
+        for (i = 0; i < n; i++) {
+            struct trie_node *node = _search(root, batch[i]->key, batch[i]->strlen);
+            // It may have been re-inserted, or unlinked along with another name
+            if (node && empty_node(node) && node->children == NULL)
+                _delete(root, batch[i]->key, batch[i]->strlen, 0, 0);
+        }
+        assert_invariants();
+        trie_unlock();
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    } while (n == COMPACT_BATCH);
 }
 
+
 /* Check the total node count; see if we have exceeded a the max.
 */
 void check_max_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    if (separate_delete_thread)
-        pthread_cond_wait(&delete_cond, &delete_mutex);
-    pthread_mutex_lock(&mutex);
+    if (separate_delete_thread) {
+        /* Wake up at least once a tick to reap expired names */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+    }
+    compact();
+    trie_lock();
+    reap_expired();
+    while (negative_count > max_negative && drop_one_negative())
+        ;
+    // Negative entries go first
     while (node_count > max_count)
-        assert(drop_one_node());
+        if (!drop_one_negative())
+            assert(drop_one_node());
     assert(node_count <= max_count);
-    pthread_mutex_unlock(&mutex);
+    trie_unlock();
     pthread_mutex_unlock(&delete_mutex);
 }
 
 void delete_all_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    pthread_mutex_lock(&mutex);
+    compact();
+    trie_lock();
     while (node_count)
         assert(drop_one_node());
     assert(node_count == 0);
-    pthread_mutex_unlock(&mutex);
+    trie_unlock();
     pthread_mutex_unlock(&delete_mutex);
 }
 
@@ -482,8 +1248,11 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
         printf("└");
     else
         printf("├");
-    printf ("%.*s, IP %d, This %p, Next %p, Children %p\n",
-            node->strlen, node->key, node->ip4_address, node, node->next, node->children);
+    int32_t ip4_address = 0;
+    rrset_find_a(&node->records, &ip4_address);
+    printf ("%.*s, IP %d, Records %d%s, This %p, Next %p, Children %p\n",
+            node->strlen, node->key, ip4_address, node->records.count, node->negative ? " (negative)" : "",
+            node, node->next, node->children);
     if (node->children) {
         if (node->next)
             strcat(lines, "| ");
@@ -497,7 +1266,7 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
 }
 
 void print() {
-    pthread_mutex_lock(&mutex);
+    trie_lock();
     printf ("Root is at %p\n", root);
     char lines[100];
     lines[0] = '\0';
@@ -508,7 +1277,15 @@ void print() {
     printf("node_count: %d\nActual node count: %d\n", node_count, count);
 #endif
     assert(count == node_count);
-    pthread_mutex_unlock(&mutex);
+    trie_unlock();
+}
+
+void print_stats() {
+#if defined(MUTEX_FC)
+    fc_stats_print(&mutex);
+#endif
+    if (use_filter)
+        printf ("Filter false positive rate %.4f\n", bloom_false_positive_rate(&filter));
 }
 
 int num_nodes() {
@@ -520,8 +1297,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
 
     int len = prefix_length + node->strlen;
     if (len > MAX_KEY) {
-        printf("key too long at node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+        printf("key too long at node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
         *error = 1;
         return count;
     }
@@ -529,8 +1306,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     if (node->children) {
         count += _assert_invariants(node->children, len, error);
         if (*error) {
-            printf("Unwinding tree on error: node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                    node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+            printf("Unwinding tree on error: node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                    node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
             return count;
         }
     }
@@ -0,0 +1,91 @@
+/* Record sets.  See records.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "records.h"
+
+void rrset_init (struct rrset *set) {
+    memset(set, 0, sizeof(struct rrset));
+}
+
+/* Copy record into slot, duplicating any text it points to. */
+static int _record_copy (struct record *slot, const struct record *record) {
+    *slot = *record;
+    if (record->type == RR_CNAME || record->type == RR_TXT) {
+        slot->data.text = malloc(record->len ? record->len : 1);
+        if (!slot->data.text) {
+            printf ("WARNING: Record memory allocation failed.  Results may be bogus.\n");
+            return 0;
+        }
+        memcpy(slot->data.text, record->data.text, record->len);
+    }
+    return 1;
+}
+
+static void _record_free (struct record *record) {
+    if (record->type == RR_CNAME || record->type == RR_TXT)
+        free(record->data.text);
+}
+
+int rrset_add (struct rrset *set, const struct record *record) {
+    if (set->count == 0) {
+        if (!_record_copy(&set->first, record))
+            return 0;
+        set->count = 1;
+        return 1;
+    }
+
+    if (set->count - 1 == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 2;
+        struct record *more = realloc(set->more, capacity * sizeof(struct record));
+        if (!more) {
+            printf ("WARNING: Record memory allocation failed.  Results may be bogus.\n");
+            return 0;
+        }
+        set->more = more;
+        set->capacity = capacity;
+    }
+
+    if (!_record_copy(&set->more[set->count - 1], record))
+        return 0;
+    set->count++;
+    return 1;
+}
+
+void rrset_clear (struct rrset *set) {
+    int i;
+    for (i = 0; i < set->count; i++)
+        _record_free((struct record *) rrset_get(set, i));
+    free(set->more);
+    rrset_init(set);
+}
+
+const struct record * rrset_get (const struct rrset *set, int i) {
+    return i == 0 ? &set->first : &set->more[i - 1];
+}
+
+int rrset_find_a (const struct rrset *set, int32_t *ip4_address) {
+    int i;
+    for (i = 0; i < set->count; i++) {
+        const struct record *record = rrset_get(set, i);
+        if (record->type == RR_A) {
+            if (ip4_address)
+                *ip4_address = record->data.a;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int rrset_set_a (struct rrset *set, int32_t ip4_address) {
+    int i;
+    for (i = 0; i < set->count; i++) {
+        struct record *record = (struct record *) rrset_get(set, i);
+        if (record->type == RR_A) {
+            record->data.a = ip4_address;
+            return 1;
+        }
+    }
+    return 0;
+}
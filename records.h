@@ -0,0 +1,56 @@
+#ifndef __RECORDS_H__
+#define __RECORDS_H__
+
+#include <stdint.h>
+
+/* Typed DNS records, and the record set stored at each name. */
+
+/* Record types, numbered as on the wire */
+#define RR_A     1
+#define RR_CNAME 5
+#define RR_TXT   16
+#define RR_AAAA  28
+
+struct record {
+    uint16_t type; /* RR_* */
+    uint16_t len; /* Bytes of text, for RR_CNAME and RR_TXT */
+    union {
+        int32_t a; /* 4 octets */
+        uint8_t aaaa[16]; /* 16 octets */
+        char *text; /* len bytes, not NUL terminated */
+    } data;
+};
+
+/* All of the records for one name.  The first record is stored
+ * inline, so the common single-A case needs no allocation beyond the
+ * node; any further records live in an out-of-line array.
+ */
+struct rrset {
+    uint16_t count; /* Total records, including first */
+    uint16_t capacity; /* Of more */
+    struct record first;
+    struct record *more; /* count - 1 records */
+};
+
+void rrset_init (struct rrset *set);
+
+/* Append a copy of record (including any text).  Return 1 on
+ * success, 0 if memory ran out.
+ */
+int rrset_add (struct rrset *set, const struct record *record);
+
+/* Free everything the set owns and leave it empty. */
+void rrset_clear (struct rrset *set);
+
+/* The i'th record, for 0 <= i < set->count */
+const struct record * rrset_get (const struct rrset *set, int i);
+
+/* Store the first A record in *ip4_address.  Return 1 if there is one. */
+int rrset_find_a (const struct rrset *set, int32_t *ip4_address);
+
+/* Change the first A record's address in place.  Never allocates.
+ * Return 0 if the set has no A record.
+ */
+int rrset_set_a (struct rrset *set, int32_t ip4_address);
+
+#endif /* __RECORDS_H__ */
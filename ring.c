@@ -0,0 +1,75 @@
+/* Multi-producer, single-consumer ring.  See ring.h. */
+
+#include <sched.h>
+#include <string.h>
+#include "ring.h"
+
+void ring_init (struct ring *ring) {
+    unsigned long i;
+
+    memset(ring, 0, sizeof(struct ring));
+    for (i = 0; i < RING_SIZE; i++)
+        ring->cells[i].seq = i;
+}
+
+int ring_push (struct ring *ring, void *data) {
+    unsigned long pos = ring->tail;
+    struct ring_cell *cell;
+
+    while (1) {
+        cell = &ring->cells[pos & (RING_SIZE - 1)];
+        long diff = (long) (cell->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&ring->tail, pos, pos + 1))
+                break;
+        } else if (diff < 0)
+            return 0; // The consumer hasn't freed this cell from the last lap
+        pos = ring->tail;
+    }
+
+    cell->data = data;
+    __sync_synchronize();
+    cell->seq = pos + 1;
+
+    // Either the consumer sees our cell before it sleeps, or we see
+    // that it is sleeping
+    __sync_synchronize();
+    if (ring->sleeping && __sync_bool_compare_and_swap(&ring->sleeping, 1, 0))
+        futex_wake(&ring->sleeping, 1);
+    return 1;
+}
+
+void * ring_pop (struct ring *ring) {
+    struct ring_cell *cell = &ring->cells[ring->head & (RING_SIZE - 1)];
+    void *data;
+
+    if (cell->seq != ring->head + 1)
+        return NULL;
+    __sync_synchronize();
+    data = cell->data;
+    __sync_synchronize();
+    cell->seq = ring->head + RING_SIZE;
+    ring->head++;
+    return data;
+}
+
+void * ring_wait (struct ring *ring) {
+    void *data;
+    int spins = 0;
+
+    while (!(data = ring_pop(ring))) {
+        if (++spins < RING_SPINS) {
+            sched_yield();
+            continue;
+        }
+        spins = 0;
+        ring->sleeping = 1;
+        __sync_synchronize();
+        if ((data = ring_pop(ring))) {
+            ring->sleeping = 0;
+            break;
+        }
+        futex_wait(&ring->sleeping, 1);
+    }
+    return data;
+}
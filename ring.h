@@ -0,0 +1,44 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "locks.h"
+
+/* A bounded, lock-free queue of pointers with many producers and one
+ * consumer (after Vyukov's bounded queue).  Each cell's sequence
+ * number says whose turn it is: a producer claims a position with a
+ * CAS on tail, fills the cell, and publishes it by bumping the cell's
+ * sequence; the consumer takes cells in order and hands them back a
+ * lap later.  Each producer's pushes come out in the order it made
+ * them.
+ *
+ * The consumer may sleep when the queue is empty, and the next push
+ * wakes it.
+ */
+
+#define RING_SIZE 1024 /* A power of 2 */
+#define RING_SPINS 100 /* Empty polls before the consumer sleeps */
+
+struct ring_cell {
+    volatile unsigned long seq;
+    void *data;
+};
+
+struct ring {
+    volatile unsigned long tail __attribute__((aligned(CACHE_LINE))); /* Producers' next position */
+    volatile int sleeping; /* The consumer is (about to be) asleep */
+    unsigned long head __attribute__((aligned(CACHE_LINE))); /* The consumer's next position */
+    struct ring_cell cells[RING_SIZE];
+};
+
+void ring_init (struct ring *ring);
+
+/* Queue data, which must not be NULL.  Return 0 if the ring is full. */
+int ring_push (struct ring *ring, void *data);
+
+/* Take the oldest entry, or NULL if there is none.  Consumer only. */
+void * ring_pop (struct ring *ring);
+
+/* Like ring_pop, but sleep until there is an entry. */
+void * ring_wait (struct ring *ring);
+
+#endif /* __RING_H__ */
@@ -5,25 +5,163 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "trie.h"
+#include "expiry.h"
+#include "cursor.h"
+#include "hashindex.h"
+#include "bloom.h"
+#include "lookupcache.h"
+#include "locks.h"
+#include "async.h"
+#include "waitq.h"
+#include "zone.h"
 
 struct trie_node {
     struct trie_node *next;  /* parent list */
     unsigned int strlen; /* Length of the key */
-    int32_t ip4_address; /* 4 octets */
+    struct rrset records; /* The name's records, if present */
+    unsigned char present; /* Does this node hold a value? */
+    volatile unsigned int seq; /* Odd while update() changes the value */
+    uint32_t expires; /* Tick when the value or negative entry expires, 0 = never */
+    unsigned char negative; /* A cached "known absent" entry rather than a value */
+    struct index_entry *indexed; /* In the hash index, if it is on */
+    unsigned char filtered; /* Counted in the filter, if it is on */
+    uint64_t filter_hash; /* Of the full name, to remove it from the filter */
     struct trie_node *children; /* Sorted list of children */
     char key[MAX_KEY]; /* Up to MAX_KEY chars */
 };
 
-static struct trie_node * root = NULL;
-static int node_count = 0;
+/* What _insert stores at a name */
+struct new_value {
+    const struct record *record; /* Record to add, NULL for a negative entry */
+    uint32_t expires; /* Tick when it expires, 0 = never */
+    int negative; /* Store a negative entry instead of a record */
+    int append; /* Add to a live record set, rather than failing */
+    const char *name; /* The full name, for the hash index */
+    size_t name_len;
+    int replace; /* Overwrite a live value too (upsert) */
+};
+
+/* Best match so far in search_longest_suffix */
+struct suffix_match {
+    int found;
+    size_t rest; /* Length of the string in front of the match */
+    int32_t ip4_address;
+};
+
+/* A tree and its counts: the live one, under the trie lock, or a zone
+ * that reload is building off to the side.  Each thread works on the
+ * one draft points to.
+ */
+struct draft {
+    struct trie_node *root;
+    int node_count;
+    int negative_count;
+    struct hash_index *index;
+};
+static struct draft live = { NULL, 0, 0, NULL };
+static __thread struct draft *draft = &live;
+
+#define root (draft->root)
+#define node_count (draft->node_count)
+#define negative_count (draft->negative_count)
+#define name_index (*draft->index)
+
 static int max_count = 100;  //Try to stay under 100 nodes
+static struct expiry_wheel wheel;
+static int max_negative = 20;  //Negative entries get their own, smaller budget
+static uint32_t negative_ttl = 5;  //Seconds
+static struct expiry_queue negative_queue;
+static struct expiry_queue prune_queue;  //Names of tombstones awaiting compact()
+extern int use_hash_index;
+static struct bloom filter;
+extern int use_filter;
+extern int use_cache;
 static pthread_mutex_t delete_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static struct brlock reload_gate;  //Writers share it, so reload can hold them off while it builds
 static pthread_cond_t delete_cond = PTHREAD_COND_INITIALIZER;
 extern int separate_delete_thread;
 
-struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_address) {
+/* The lock policy is picked at compile time.  By default this is a
+ * pthread_rwlock_t, with readers passing through delete_mutex so a
+ * waiting delete thread is not starved by glibc's reader preference.
+ * With -DRW_BRLOCK (dns-rw-brlock) it is a per-thread reader lock,
+ * and with -DRW_PHASE_FAIR (dns-rw-pf) a phase-fair lock (locks.h).
+ * Both of those already keep writers from starving.
+ */
+#if defined(RW_BRLOCK)
+static struct brlock rwlock;
+
+void read_lock () {
+    brlock_rdlock(&rwlock);
+}
+
+void read_unlock () {
+    brlock_rdunlock(&rwlock);
+}
+
+void _write_lock () {
+    brlock_wrlock(&rwlock);
+}
+
+void write_unlock () {
+    brlock_wrunlock(&rwlock);
+}
+#elif defined(RW_PHASE_FAIR)
+static struct pflock rwlock;
+
+void read_lock () {
+    pflock_rdlock(&rwlock);
+}
+
+void read_unlock () {
+    pflock_rdunlock(&rwlock);
+}
+
+void _write_lock () {
+    pflock_wrlock(&rwlock);
+}
+
+void write_unlock () {
+    pflock_wrunlock(&rwlock);
+}
+#else
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+void read_lock () {
+    pthread_mutex_lock(&delete_mutex);
+    pthread_rwlock_rdlock(&rwlock);
+    pthread_mutex_unlock(&delete_mutex);
+}
+
+void read_unlock () {
+    pthread_rwlock_unlock(&rwlock);
+}
+
+void _write_lock () {
+    pthread_rwlock_wrlock(&rwlock);
+}
+
+void write_unlock () {
+    pthread_rwlock_unlock(&rwlock);
+}
+#endif
+
+/* Instrumentation, printed by print_stats */
+static struct lock_stats writer_stats;
+static int peak_count = 0;  //Most nodes ever in the tree at once
+
+/* Take the write lock, recording how long we waited for it */
+void write_lock () {
+    uint64_t start = lock_clock();
+    _write_lock();
+    lock_stats_add(&writer_stats, lock_clock() - start);
+}
+
+void set_value (struct trie_node *node, const struct new_value *value);
+
+struct trie_node * new_leaf (const char *string, size_t strlen, const struct new_value *value) {
     struct trie_node *new_node = malloc(sizeof(struct trie_node));
     node_count++;
     if (!new_node) {
@@ -36,12 +174,78 @@ struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_addr
     new_node->strlen = strlen;
     strncpy(new_node->key, string, strlen);
     new_node->key[strlen] = '\0';
-    new_node->ip4_address = ip4_address;
+    rrset_init(&new_node->records);
+    new_node->indexed = NULL;
+    new_node->filtered = 0;
+    new_node->seq = 0;
+    new_node->present = 0;
+    new_node->expires = 0;
+    new_node->negative = 0;
     new_node->children = NULL;
+    if (value)
+        set_value(new_node, value);
 
     return new_node;
 }
 
+/* Does this node hold a value that has not expired by tick now? */
+int live_value (struct trie_node *node, uint32_t now) {
+    return node->present && (node->expires == 0 || node->expires > now);
+}
+
+/* Does this node hold nothing at all, not even a negative entry? */
+int empty_node (struct trie_node *node) {
+    return !node->present && !node->negative;
+}
+
+/* Store a record or a negative entry, or clear the node if value
+ * is NULL, keeping negative_count in step.
+ */
+void set_value (struct trie_node *node, const struct new_value *value) {
+    int negative = value && value->negative;
+
+    negative_count += negative - node->negative;
+    node->negative = negative;
+
+    // Appending to a live set keeps its records and its TTL
+    if (!value || !value->append || !live_value(node, expiry_now())) {
+        rrset_clear(&node->records);
+        node->expires = value ? value->expires : 0;
+    }
+    if (value && value->record)
+        rrset_add(&node->records, value->record);
+    node->present = (node->records.count > 0);
+
+    // Index exactly the nodes that hold something
+    if (use_hash_index) {
+        if (!empty_node(node) && !node->indexed)
+            node->indexed = index_add(&name_index, value->name, value->name_len, node);
+        else if (empty_node(node) && node->indexed) {
+            index_remove(&name_index, node->indexed);
+            node->indexed = NULL;
+        }
+    }
+    if (use_filter) {
+        if (!empty_node(node) && !node->filtered) {
+            node->filter_hash = bloom_hash(value->name, value->name_len);
+            bloom_add(&filter, node->filter_hash);
+            node->filtered = 1;
+        } else if (empty_node(node) && node->filtered) {
+            bloom_remove(&filter, node->filter_hash);
+            node->filtered = 0;
+        }
+    }
+    if (use_cache)
+        cache_invalidate();
+}
+
+/* Would _delete remove what this node holds? */
+int deletable (struct trie_node *node, uint32_t expired_by, int negative) {
+    if (negative ? !node->negative : !node->present)
+        return 0;
+    return !expired_by || (node->expires && node->expires <= expired_by);
+}
+
 // Compare strings backward.  Unlike strncmp, we assume
 // that we will not stop at a null termination, only after
 // n chars (or a difference).  Base code borrowed from musl
@@ -54,6 +258,19 @@ int reverse_strncmp(const char *left, const char *right, size_t n)
     return *l - *r;
 }
 
+/* Read the node's first A record.  update() may change it under just
+ * the read lock, so retry if it did.  Return 1 if there is one.
+ */
+int read_a (struct trie_node *node, int32_t *ip4_address) {
+    unsigned int seq;
+    int res;
+    do {
+        seq = seq_read_begin(&node->seq);
+        res = rrset_find_a(&node->records, ip4_address);
+    } while (seq_read_retry(&node->seq, seq));
+    return res;
+}
+
 int compare_keys (const char *string1, int len1, const char *string2, int len2, int *pKeylen) {
     int keylen, offset;
     char scratch[MAX_KEY];
@@ -96,6 +313,19 @@ int compare_keys_substring (const char *string1, int len1, const char *string2,
 
 void init(int numthreads) {
     root = NULL;
+#if defined(RW_BRLOCK)
+    brlock_init(&rwlock);
+#elif defined(RW_PHASE_FAIR)
+    pflock_init(&rwlock);
+#endif
+    expiry_init(&wheel);
+    expiry_queue_init(&negative_queue);
+    expiry_queue_init(&prune_queue);
+    bloom_init(&filter);
+    brlock_init(&reload_gate);
+    live.index = malloc(sizeof(struct hash_index));
+    assert(live.index);
+    index_init(&name_index, 0);
 }
 
 void shutdown_delete_thread() {
@@ -153,29 +383,245 @@ _search (struct trie_node *node, const char *string, size_t strlen) {
     }
 }
 
+/* Exact-match search, from the hash index if it is on.  The caller
+ * holds the trie's lock, which also covers the index.
+ */
+struct trie_node * find_exact (const char *string, size_t strlen) {
+    if (use_hash_index)
+        return index_find(&name_index, string, strlen, NULL, NULL);
+    return _search(root, string, strlen);
+}
+
 int search (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
 
+int lookup (const char *string, size_t strlen, int32_t *ip4_address) {
     struct trie_node *found;
+    uint32_t now = expiry_now();
+    int res = LOOKUP_MISS;
+    int32_t ip = 0;
+    int has_a = 0;
+    uint32_t expires = 0;
+    unsigned long epoch = cache_epoch();
 
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
-    //ensure delete thread is not running
-    pthread_mutex_lock(&delete_mutex);
-    pthread_rwlock_rdlock(&rwlock);
-    pthread_mutex_unlock(&delete_mutex);
-    found = _search(root, string, strlen);
+    // Hot names are answered from this thread's cache, without locks
+    if (use_cache && cache_get(string, strlen, epoch, now, &res, ip4_address))
+        return res;
 
-    if (found && ip4_address)
-        *ip4_address = found->ip4_address;
+    // Most absent names stop here, without any locks
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return LOOKUP_MISS;
 
-    pthread_rwlock_unlock(&rwlock);
-    return (found != NULL);
+    read_lock();
+    found = find_exact(string, strlen);
+
+    if (found && live_value(found, now)) {
+        has_a = read_a(found, &ip);
+        res = has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+        expires = found->expires;
+    } else if (found && found->negative && found->expires > now) {
+        res = LOOKUP_NEGATIVE;
+        expires = found->expires;
+    }
+    read_unlock();
+    if (use_filter && res == LOOKUP_MISS)
+        bloom_false_positive(&filter);
+    if (use_cache)
+        cache_put(string, strlen, epoch, res, has_a, ip, expires);
+    if (ip4_address && has_a)
+        *ip4_address = ip;
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    struct trie_node *found;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return 0;
+
+    read_lock();
+    found = find_exact(string, strlen);
+
+    if (found && live_value(found, expiry_now())) {
+        fn(&found->records, arg);
+        res = 1;
+    }
+    read_unlock();
+    return res;
+}
+
+/* Recursive helper for search_longest_suffix.  Walks the same path
+ * as _search, remembering the deepest live value that ends on a
+ * label boundary.
+ */
+void
+_search_suffix (struct trie_node *node, const char *string, size_t strlen,
+        uint32_t now, struct suffix_match *match) {
+
+    int keylen, cmp;
+
+    // First things first, check if we are NULL 
+    if (node == NULL) return;
+
+    assert(node->strlen < MAX_KEY);
+
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // This node is on the path unless its key is longer than the string
+        if (node->strlen > keylen)
+            return;
+        if (live_value(node, now) && (strlen == keylen || string[strlen - keylen - 1] == '.')) {
+            match->found = 1;
+            match->rest = strlen - keylen;
+            match->ip4_address = 0;
+            read_a(node, &match->ip4_address);
+        }
+        if (strlen > keylen)
+            _search_suffix(node->children, string, strlen - keylen, now, match);
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0)
+            _search_suffix(node->next, string, strlen, now, match);
+    }
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    struct suffix_match match = { 0, 0, 0 };
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    read_lock();
+    _search_suffix(root, string, strlen, expiry_now(), &match);
+    read_unlock();
+
+    if (match.found) {
+        if (ip4_address)
+            *ip4_address = match.ip4_address;
+        if (suffix_len)
+            *suffix_len = strlen - match.rest;
+    }
+    return match.found;
+}
+
+/* Recursive helper for cursor_next.  name is a MAX_KEY buffer whose
+ * last namelen bytes hold the full name of node's parent.  Walks node
+ * and its later siblings.  Returns 1 once the walk should stop.
+ */
+int _cursor_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        struct trie_cursor *cursor, int *left,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+
+    for (; node; node = node->next) {
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+        int want;
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        want = cursor_check(cursor, start, strlen);
+        if (want & CURSOR_STOP)
+            return 1;
+        if ((want & CURSOR_EMIT) && live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            cursor_advance(cursor, start, strlen);
+            if (--*left == 0)
+                return 1;
+        }
+        if ((want & CURSOR_DESCEND) && _cursor_walk(node->children, name, strlen, now, cursor, left, fn, arg))
+            return 1;
+    }
+    return 0;
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    int left = max;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    read_lock();
+    _cursor_walk(root, name, 0, expiry_now(), cursor, &left, fn, arg);
+    read_unlock();
+
+    // A page that isn't full means the walk ran out of names
+    if (left > 0)
+        cursor->done = 1;
+    return max - left;
+}
+
+/* Only the read lock is needed, since the tree's shape and the record
+ * set's storage don't change.  The node's sequence counter orders us
+ * against other updates and lets readers spot a torn value.
+ */
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    struct trie_node *found;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    brlock_rdlock(&reload_gate);
+    read_lock();
+    found = find_exact(string, strlen);
+    if (found && live_value(found, expiry_now())) {
+        seq_write_begin(&found->seq);
+        res = rrset_set_a(&found->records, ip4_address);
+        seq_write_end(&found->seq);
+        if (use_cache)
+            cache_invalidate();
+    }
+    read_unlock();
+    brlock_rdunlock(&reload_gate);
+    return res;
+}
+
+/* The compare happens inside the node's write section, so two callers
+ * can't both see expected.
+ */
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    struct trie_node *found;
+    int32_t ip;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    brlock_rdlock(&reload_gate);
+    read_lock();
+    found = find_exact(string, strlen);
+    if (found && live_value(found, expiry_now())) {
+        seq_write_begin(&found->seq);
+        if (rrset_find_a(&found->records, &ip) && ip == expected)
+            res = rrset_set_a(&found->records, ip4_address);
+        seq_write_end(&found->seq);
+        if (res && use_cache)
+            cache_invalidate();
+    }
+    read_unlock();
+    brlock_rdunlock(&reload_gate);
+    return res;
 }
 
 /* Recursive helper function */
-int _insert (const char *string, size_t strlen, int32_t ip4_address, 
+int _insert (const char *string, size_t strlen, const struct new_value *value,
         struct trie_node *node, struct trie_node *parent, struct trie_node *left) {
 
     int cmp, keylen;
@@ -197,7 +643,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert(keylen == strlen);
             assert((!parent) || parent->children == node);
 
-            new_node = new_leaf (string, strlen, ip4_address);
+            new_node = new_leaf (string, strlen, value);
             node->strlen -= keylen;
             new_node->children = node;
             new_node->next = node->next;
@@ -218,18 +664,18 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
             if (node->children == NULL) {
                 // Insert leaf here
-                struct trie_node *new_node = new_leaf (string, strlen - keylen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen - keylen, value);
                 node->children = new_node;
                 return 1;
             } else {
                 // Recur on children list, store "parent" (loosely defined)
-                return _insert(string, strlen - keylen, ip4_address,
+                return _insert(string, strlen - keylen, value,
                         node->children, node, NULL);
             }
         } else {
             assert (strlen == keylen);
-            if (node->ip4_address == 0) {
-                node->ip4_address = ip4_address;
+            if (value->append || value->replace || !live_value(node, expiry_now())) {
+                set_value(node, value);
                 return 1;
             } else {
                 return 0;
@@ -252,7 +698,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
         if (overlap) {
             // Insert a common parent, recur
             int offset = strlen - keylen2;
-            struct trie_node *new_node = new_leaf (&string[offset], keylen2, 0);
+            struct trie_node *new_node = new_leaf (&string[offset], keylen2, NULL);
             assert ((node->strlen - keylen2) > 0);
             node->strlen -= keylen2;
             new_node->children = node;
@@ -271,23 +717,23 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
                 root = new_node;
             }
 
-            return _insert(string, offset, ip4_address,
+            return _insert(string, offset, value,
                     node, new_node, NULL);
         } else {
             cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
             if (cmp < 0) {
                 // No, recur right (the node's key is "less" than  the search key)
                 if (node->next)
-                    return _insert(string, strlen, ip4_address, node->next, NULL, node);
+                    return _insert(string, strlen, value, node->next, NULL, node);
                 else {
                     // Insert here
-                    struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                    struct trie_node *new_node = new_leaf (string, strlen, value);
                     node->next = new_node;
                     return 1;
                 }
             } else {
                 // Insert here
-                struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen, value);
                 new_node->next = node;
                 if (node == root)
                     root = new_node;
@@ -303,7 +749,71 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
 void assert_invariants();
 
+int insert_value (const char *string, size_t strlen, const struct new_value *value);
+
 int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+/* One try at a squatting insert, for waitq_until */
+int try_insert (void *arg) {
+    const struct new_value *value = arg;
+    return insert_value(value->name, value->name_len, value);
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen };
+    if (allow_squatting)
+        return waitq_until(string, strlen, try_insert, &value);
+    return insert_value(string, strlen, &value);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    struct new_value value = { record, 0, 0, 1, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+/* Refreshing a name that holds just one live A record only changes
+ * that record and its TTL, so like update it is done in place under
+ * the read lock.  Anything else takes the write lock in insert_value.
+ */
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen, 1 };
+    struct trie_node *found;
+    int res = 0;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    read_lock();
+    found = find_exact(string, strlen);
+    if (found && live_value(found, expiry_now()) && found->records.count == 1) {
+        seq_write_begin(&found->seq);
+        res = rrset_set_a(&found->records, ip4_address);
+        if (res)
+            found->expires = value.expires;
+        seq_write_end(&found->seq);
+        if (res && use_cache)
+            cache_invalidate();
+    }
+    read_unlock();
+
+    if (!res)
+        return insert_value(string, strlen, &value);
+    expiry_add(&wheel, string, strlen, value.expires);
+    return 1;
+}
+
+/* Common code for inserting a value or a negative entry */
+int insert_value (const char *string, size_t strlen, const struct new_value *value) {
 
     // Skip strings of length 0
     if (strlen == 0)
@@ -311,32 +821,117 @@ int insert (const char *string, size_t strlen, int32_t ip4_address) {
 
     int insert_res;
 
+    brlock_rdlock(&reload_gate);
     pthread_mutex_lock(&delete_mutex);
-    pthread_rwlock_wrlock(&rwlock);
+    write_lock();
     pthread_mutex_unlock(&delete_mutex);
 
     /* Edge case: root is null */
     if (root == NULL) {
-        root = new_leaf(string, strlen, ip4_address);
+        root = new_leaf(string, strlen, value);
         insert_res = 1;
-    } else insert_res = _insert(string, strlen, ip4_address, root, NULL, NULL);
+    } else insert_res = _insert(string, strlen, value, root, NULL, NULL);
 
+    if (node_count > peak_count)
+        peak_count = node_count;
     assert_invariants();
-    if (node_count > max_count && separate_delete_thread)
+    if ((node_count > max_count || negative_count > max_negative) && separate_delete_thread)
         pthread_cond_signal(&delete_cond);
-    pthread_rwlock_unlock(&rwlock);
+    write_unlock();
+
+    if (insert_res && value->negative)
+        expiry_queue_push(&negative_queue, string, strlen, value->expires);
+    else if (insert_res)
+        expiry_add(&wheel, string, strlen, value->expires);
+    brlock_rdunlock(&reload_gate);
     return insert_res;
 }
 
+/* Free a tree that nothing can reach any more, taking its names out
+ * of the filter.  Its index entries go with its draft's index.
+ */
+void _free_tree (struct trie_node *node) {
+    struct trie_node *next;
+
+    for (; node; node = next) {
+        next = node->next;
+        _free_tree(node->children);
+        if (node->filtered)
+            bloom_remove(&filter, node->filter_hash);
+        rrset_clear(&node->records);
+        free(node);
+    }
+}
+
+/* Readers only look at the tree under a read lock, so once the swap
+ * has it nobody is left in the old tree, and it can be freed at once.
+ */
+int reload (const struct zone_name *zone, int n) {
+    struct draft fresh = { NULL, 0, 0, NULL }, old;
+    int i, loaded = 0;
+
+    fresh.index = malloc(sizeof(struct hash_index));
+    assert(fresh.index);
+    index_init(fresh.index, 0);
+
+    // Build the new tree in this thread's own draft; nothing else sees
+    // it, and writers wait at the gate so that none of theirs is lost
+    brlock_wrlock(&reload_gate);
+    draft = &fresh;
+    for (i = 0; i < n; i++) {
+        struct record record = { .type = RR_A, .data.a = zone[i].ip4_address };
+        struct new_value value = { &record, expiry_from_ttl(zone[i].ttl), 0, 0,
+            zone[i].name, zone[i].strlen };
+        int res;
+
+        if (zone[i].strlen == 0)
+            continue;
+        if (root == NULL) {
+            root = new_leaf (zone[i].name, zone[i].strlen, &value);
+            res = 1;
+        } else
+            res = _insert(zone[i].name, zone[i].strlen, &value, root, NULL, NULL);
+        if (res) {
+            expiry_add(&wheel, zone[i].name, zone[i].strlen, value.expires);
+            loaded++;
+        }
+    }
+    assert_invariants();
+    draft = &live;
+
+    // ... and swap it in for the live tree
+    pthread_mutex_lock(&delete_mutex);
+    write_lock();
+    old = live;
+    live = fresh;
+    if (node_count > peak_count)
+        peak_count = node_count;
+    write_unlock();
+    pthread_mutex_unlock(&delete_mutex);
+    brlock_wrunlock(&reload_gate);
+    if (use_cache)
+        cache_invalidate();
+
+    // The old tree is ours alone now
+    draft = &old;
+    _free_tree(root);
+    index_clear(&name_index);
+    draft = &live;
+    free(old.index);
+    return loaded;
+}
+
 /* Recursive helper function.
  * Returns a pointer to the node if found.
  * Stores an optional pointer to the 
  * parent, or what should be the parent if not found.
- * 
+ * If expired_by is non-zero, only delete a value that 
+ * expired at or before that tick.  If negative is set,
+ * delete a negative entry instead of a value.
  */
 struct trie_node * 
 _delete (struct trie_node *node, const char *string, 
-        size_t strlen) {
+        size_t strlen, uint32_t expired_by, int negative) {
     int keylen, cmp;
 
     // First things first, check if we are NULL 
@@ -353,11 +948,11 @@ _delete (struct trie_node *node, const char *string,
         if (node->strlen > keylen) {
             return NULL;
         } else if (strlen > keylen) {
-            struct trie_node *found =  _delete(node->children, string, strlen - keylen);
+            struct trie_node *found =  _delete(node->children, string, strlen - keylen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->children == found);
                     node->children = found->next;
                     free(found);
@@ -365,7 +960,7 @@ _delete (struct trie_node *node, const char *string,
                 }
 
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -377,12 +972,16 @@ _delete (struct trie_node *node, const char *string,
         } else {
             assert (strlen == keylen);
 
-            /* We found it! Clear the ip4 address and return. */
-            if (node->ip4_address) {
-                node->ip4_address = 0;
-
+            /* We found it! Clear the records if we may, and report the
+             * node if that leaves it empty, so it (and any emptied
+             * ancestors) get unlinked.  The reaper only takes values that
+             * have really expired, since the name may have been
+             * re-inserted with a new TTL. */
+            if (deletable(node, expired_by, negative))
+                set_value(node, NULL);
+            if (empty_node(node)) {
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -394,7 +993,7 @@ _delete (struct trie_node *node, const char *string,
                 }
                 return node;
             } else {
-                /* Just an interior node with no value */
+                /* Still holds a value */
                 return NULL;
             }
         }
@@ -403,11 +1002,11 @@ _delete (struct trie_node *node, const char *string,
         cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
         if (cmp < 0) {
             // No, look right (the node's key is "less" than  the search key)
-            struct trie_node *found = _delete(node->next, string, strlen);
+            struct trie_node *found = _delete(node->next, string, strlen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->next == found);
                     node->next = found->next;
                     free(found);
@@ -425,23 +1024,155 @@ _delete (struct trie_node *node, const char *string,
 }
 
 int delete  (const char *string, size_t strlen) {
+    struct trie_node *found;
+    int res = 0, prunable = 0;
+
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
+
+    brlock_rdlock(&reload_gate);
     pthread_mutex_lock(&delete_mutex);
-    pthread_rwlock_wrlock(&rwlock);
+    write_lock();
     pthread_mutex_unlock(&delete_mutex);
-    struct trie_node *delete_result = _delete(root, string, strlen);
+    /* Only clear the value.  The node stays linked as a tombstone,
+     * which searches already treat as a miss, until compact() gets
+     * to it. */
+    found = find_exact(string, strlen);
+    if (found && deletable(found, 0, 0)) {
+        set_value(found, NULL);
+        prunable = (found->children == NULL);
+        res = 1;
+    }
     assert_invariants();
-    pthread_rwlock_unlock(&rwlock);
-    return (NULL != delete_result);
+    write_unlock();
+
+    if (prunable)
+        expiry_queue_push(&prune_queue, string, strlen, 0);
+    if (res)
+        waitq_wake(string, strlen);
+    brlock_rdunlock(&reload_gate);
+    return res;
+}
+
+/* What a batch keeps for each of its operations */
+struct batch_slot {
+    struct new_value value; /* inserts */
+    struct record record;
+    int prunable; /* deletes */
+};
+
+/* Run one of a batch's operations, under the write lock, as the plain
+ * call would under its own lock.
+ */
+void _apply_locked (struct trie_op *op, struct batch_slot *slot, uint32_t now) {
+    struct trie_node *found;
+
+    op->res = 0;
+    if (op->strlen == 0)
+        return;
+
+    switch (op->op) {
+        case TRIE_OP_LOOKUP:
+            found = find_exact(op->name, op->strlen);
+            if (found && live_value(found, now)) {
+                if (rrset_find_a(&found->records, &op->ip4_address))
+                    op->res = LOOKUP_FOUND;
+            } else if (found && found->negative && found->expires > now)
+                op->res = LOOKUP_NEGATIVE;
+            break;
+        case TRIE_OP_INSERT:
+        case TRIE_OP_INSERT_NEGATIVE:
+        case TRIE_OP_UPSERT:
+            if (root == NULL) {
+                root = new_leaf(op->name, op->strlen, &slot->value);
+                op->res = 1;
+            } else op->res = _insert(op->name, op->strlen, &slot->value, root, NULL, NULL);
+            break;
+        case TRIE_OP_UPDATE:
+            // No readers to fence off with the node's seq under the write lock
+            found = find_exact(op->name, op->strlen);
+            if (found && live_value(found, now)) {
+                op->res = rrset_set_a(&found->records, op->ip4_address);
+                if (use_cache)
+                    cache_invalidate();
+            }
+            break;
+        case TRIE_OP_DELETE:
+            found = find_exact(op->name, op->strlen);
+            if (found && deletable(found, 0, 0)) {
+                set_value(found, NULL);
+                slot->prunable = (found->children == NULL);
+                op->res = 1;
+            }
+            break;
+        default:
+            assert(0);
+    }
+}
+
+/* Readers see the batch all at once, since it holds the write lock
+ * from the first op to the last.
+ */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    struct batch_slot *slots;
+    uint32_t now = expiry_now();
+    int i, done = 0;
+
+    if (n <= 0)
+        return 0;
+    brlock_rdlock(&reload_gate);
+    slots = calloc(n, sizeof(struct batch_slot));
+    assert(slots);
+
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        assert(op->strlen < MAX_KEY);
+        if (op->op == TRIE_OP_INSERT || op->op == TRIE_OP_UPSERT) {
+            slots[i].record.type = RR_A;
+            slots[i].record.data.a = op->ip4_address;
+            slots[i].value = (struct new_value) { &slots[i].record, expiry_from_ttl(op->ttl), 0, 0, op->name, op->strlen,
+                op->op == TRIE_OP_UPSERT };
+        } else if (op->op == TRIE_OP_INSERT_NEGATIVE)
+            slots[i].value = (struct new_value) { NULL, expiry_from_ttl(negative_ttl), 1, 0, op->name, op->strlen };
+    }
+
+    pthread_mutex_lock(&delete_mutex);
+    write_lock();
+    pthread_mutex_unlock(&delete_mutex);
+    for (i = 0; i < n; i++)
+        _apply_locked(&ops[i], &slots[i], now);
+    if (node_count > peak_count)
+        peak_count = node_count;
+    assert_invariants();
+    if ((node_count > max_count || negative_count > max_negative) && separate_delete_thread)
+        pthread_cond_signal(&delete_cond);
+    write_unlock();
+
+    // Then what each plain call does after it unlocks
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        if (op->op == TRIE_OP_INSERT_NEGATIVE && op->res)
+            expiry_queue_push(&negative_queue, op->name, op->strlen, slots[i].value.expires);
+        else if ((op->op == TRIE_OP_INSERT || op->op == TRIE_OP_UPSERT) && op->res)
+            expiry_add(&wheel, op->name, op->strlen, slots[i].value.expires);
+        else if (op->op == TRIE_OP_DELETE && op->res) {
+            if (slots[i].prunable)
+                expiry_queue_push(&prune_queue, op->name, op->strlen, 0);
+            waitq_wake(op->name, op->strlen);
+        }
+        done += (op->res != 0);
+    }
+    free(slots);
+    brlock_rdunlock(&reload_gate);
+    return done;
 }
 
 /* Find one node to remove from the tree. 
  * Use any policy you like to select the node.
  */
 int drop_one_node() {
-    struct trie_node *node = root;
+    struct trie_node *node = root, *leaf;
     assert(node->key != NULL);
     int size = MAX_KEY-1;
     char key[size+1];
@@ -451,32 +1182,112 @@ int drop_one_node() {
         size -= node->strlen;
         assert(size >= 0);
         memcpy(&key[size], node->key, node->strlen);
+        leaf = node;
     } while ((node = node->children));
     assert(node == NULL);
-    return (_delete(root, &key[size], strlen(&key[size])) != NULL);
+    int negative = leaf->negative;
+    if (_delete(root, &key[size], strlen(&key[size]), 0, negative) == NULL)
+        return 0;
+    if (!negative)
+        waitq_wake(&key[size], strlen(&key[size]));
+    return 1;
+}
+
+/* Drop the oldest negative entry.  Returns 0 if there are none.
+ * Called with the trie locked for writing.
+ */
+int drop_one_negative() {
+    struct expiry_entry *entry;
+    int res = 0;
+
+    while (!res && (entry = expiry_queue_pop(&negative_queue, 0))) {
+        res = (_delete(root, entry->key, entry->strlen, 0, 1) != NULL);
+        free(entry);
+    }
+    return res;
+}
+
+/* Delete every name whose TTL has run out.  The wheel hands us
+ * just the names that came due, so the tree is never scanned.
+ * Called with the trie locked for writing.
+ */
+void reap_expired() {
+    uint32_t now = expiry_now();
+    struct expiry_entry *entry = expiry_advance(&wheel, now), *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        if (_delete(root, entry->key, entry->strlen, now, 0))
+            waitq_wake(entry->key, entry->strlen);
+        free(entry);
+    }
+
+    // Negative entries all share one TTL, so their queue is in expiry order
+    while ((entry = expiry_queue_pop(&negative_queue, now))) {
+        _delete(root, entry->key, entry->strlen, now, 1);
+        free(entry);
+    }
 }
+/* Unlink the tombstones that deletes have left behind, up to
+ * COMPACT_BATCH of them per hold of the lock. Called with delete_mutex held.
+ */
+void compact() {
+    struct expiry_entry *batch[COMPACT_BATCH];
+    int i, n;
+
+    do {
+        for (n = 0; n < COMPACT_BATCH && (batch[n] = expiry_queue_pop(&prune_queue, 0)); n++)
+            ;
+        if (n == 0)
+            break;
+        write_lock();
+        for (i = 0; i < n; i++) {
+            struct trie_node *node = _search(root, batch[i]->key, batch[i]->strlen);
+            // It may have been re-inserted, or unlinked along with another name
+            if (node && empty_node(node) && node->children == NULL)
+                _delete(root, batch[i]->key, batch[i]->strlen, 0, 0);
+        }
+        assert_invariants();
+        write_unlock();
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    } while (n == COMPACT_BATCH);
+}
+
 
 /* Check the total node count; see if we have exceeded a the max.
 */
 void check_max_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    if (separate_delete_thread)
-        pthread_cond_wait(&delete_cond, &delete_mutex);
-    pthread_rwlock_wrlock(&rwlock);
+    if (separate_delete_thread) {
+        /* Wake up at least once a tick to reap expired names */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &deadline);
+    }
+    compact();
+    write_lock();
+    reap_expired();
+    while (negative_count > max_negative && drop_one_negative())
+        ;
+    // Negative entries go first
     while (node_count > max_count)
-        assert(drop_one_node());
+        if (!drop_one_negative())
+            assert(drop_one_node());
     assert(node_count <= max_count);
-    pthread_rwlock_unlock(&rwlock);
+    write_unlock();
     pthread_mutex_unlock(&delete_mutex);
 }
 
 void delete_all_nodes() {
     pthread_mutex_lock(&delete_mutex);
-    pthread_rwlock_wrlock(&rwlock);
+    compact();
+    write_lock();
     while (node_count)
         assert(drop_one_node());
     assert(node_count == 0);
-    pthread_rwlock_unlock(&rwlock);
+    write_unlock();
     pthread_mutex_unlock(&delete_mutex);
 }
 
@@ -486,8 +1297,11 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
         printf("└");
     else
         printf("├");
-    printf ("%.*s, IP %d, This %p, Next %p, Children %p\n",
-            node->strlen, node->key, node->ip4_address, node, node->next, node->children);
+    int32_t ip4_address = 0;
+    rrset_find_a(&node->records, &ip4_address);
+    printf ("%.*s, IP %d, Records %d%s, This %p, Next %p, Children %p\n",
+            node->strlen, node->key, ip4_address, node->records.count, node->negative ? " (negative)" : "",
+            node, node->next, node->children);
     if (node->children) {
         if (node->next)
             strcat(lines, "| ");
@@ -501,9 +1315,7 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
 }
 
 void print() {
-    pthread_mutex_lock(&delete_mutex);
-    pthread_rwlock_rdlock(&rwlock);
-    pthread_mutex_unlock(&delete_mutex);
+    read_lock();
     printf ("Root is at %p\n", root);
     char lines[100];
     lines[0] = '\0';
@@ -514,7 +1326,14 @@ void print() {
     printf("node_count: %d\nActual node count: %d\n", node_count, count);
 #endif
     assert(count == node_count);
-    pthread_rwlock_unlock(&rwlock);
+    read_unlock();
+}
+
+void print_stats() {
+    lock_stats_print("Writer lock", &writer_stats);
+    printf ("Peak node count %d (limit %d)\n", peak_count, max_count);
+    if (use_filter)
+        printf ("Filter false positive rate %.4f\n", bloom_false_positive_rate(&filter));
 }
 
 int num_nodes() {
@@ -526,8 +1345,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
 
     int len = prefix_length + node->strlen;
     if (len > MAX_KEY) {
-        printf("key too long at node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+        printf("key too long at node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
         *error = 1;
         return count;
     }
@@ -535,8 +1354,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     if (node->children) {
         count += _assert_invariants(node->children, len, error);
         if (*error) {
-            printf("Unwinding tree on error: node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                    node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+            printf("Unwinding tree on error: node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                    node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
             return count;
         }
     }
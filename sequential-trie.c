@@ -1,26 +1,123 @@
-/* A simple, (reverse) trie.  Only for use with 1 thread. */
+/* A simple, (reverse) trie.  Only for use with 1 thread.
+ *
+ * Built with -DSHARDED (as shard-trie.o), this is also the building
+ * block for the delegating and left-right tries: the entry points are
+ * renamed shard_* (see shard.h), and the trie's state lives in a
+ * struct trie_state, so a program can have several tries.  Each
+ * thread works on the one it last passed to shard_use.
+ */
 
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef SHARDED
+#include "shard.h"
+#endif
 #include "trie.h"
+#include "expiry.h"
+#include "cursor.h"
+#include "hashindex.h"
+#include "bloom.h"
+#include "lookupcache.h"
+#include "async.h"
+#include "waitq.h"
 #include <unistd.h>
 
 struct trie_node {
     struct trie_node *next;  /* parent list */
     unsigned int strlen; /* Length of the key */
-    int32_t ip4_address; /* 4 octets */
+    struct rrset records; /* The name's records, if present */
+    unsigned char present; /* Does this node hold a value? */
+    uint32_t expires; /* Tick when the value or negative entry expires, 0 = never */
+    unsigned char negative; /* A cached "known absent" entry rather than a value */
+    struct index_entry *indexed; /* In the hash index, if it is on */
+    unsigned char filtered; /* Counted in the filter, if it is on */
+    uint64_t filter_hash; /* Of the full name, to remove it from the filter */
     struct trie_node *children; /* Sorted list of children */
     char key[MAX_KEY]; /* Up to MAX_KEY chars */
 };
 
+/* What _insert stores at a name */
+struct new_value {
+    const struct record *record; /* Record to add, NULL for a negative entry */
+    uint32_t expires; /* Tick when it expires, 0 = never */
+    int negative; /* Store a negative entry instead of a record */
+    int append; /* Add to a live record set, rather than failing */
+    const char *name; /* The full name, for the hash index */
+    size_t name_len;
+    int replace; /* Overwrite a live value too (upsert) */
+};
+
+/* Best match so far in search_longest_suffix */
+struct suffix_match {
+    int found;
+    size_t rest; /* Length of the string in front of the match */
+    int32_t ip4_address;
+};
+
+#ifdef SHARDED
+struct trie_state {
+    struct trie_node *root;
+    int node_count;
+    int max_count;
+    struct expiry_wheel wheel;
+    int negative_count;
+    int max_negative;
+    uint32_t negative_ttl;
+    struct expiry_queue negative_queue;
+    struct hash_index name_index;
+    struct expiry_queue prune_queue;
+    struct bloom filter;
+};
+static __thread struct trie_state *state = NULL;
+
+struct trie_state * shard_new () {
+    struct trie_state *new_state = aligned_alloc(CACHE_LINE, sizeof(struct trie_state));  //The filter's slots are cache-line aligned
+    assert(new_state);
+    memset(new_state, 0, sizeof(struct trie_state));
+    new_state->max_count = 100;
+    new_state->max_negative = 20;
+    new_state->negative_ttl = 5;
+    return new_state;
+}
+
+void shard_use (struct trie_state *trie) {
+    state = trie;
+}
+
+#define root (state->root)
+#define node_count (state->node_count)
+#define max_count (state->max_count)
+#define wheel (state->wheel)
+#define negative_count (state->negative_count)
+#define max_negative (state->max_negative)
+#define negative_ttl (state->negative_ttl)
+#define negative_queue (state->negative_queue)
+#define name_index (state->name_index)
+#define prune_queue (state->prune_queue)
+#define filter (state->filter)
+#else
 static struct trie_node * root = NULL;
 static int node_count = 0;
 static int max_count = 100;  //Try to stay under 100 nodes
+static struct expiry_wheel wheel;
+static int negative_count = 0;
+static int max_negative = 20;  //Negative entries get their own, smaller budget
+static uint32_t negative_ttl = 5;  //Seconds
+static struct expiry_queue negative_queue;
+static struct hash_index name_index;
+static struct expiry_queue prune_queue;  //Names of tombstones awaiting compact()
+static struct bloom filter;
+#endif
+extern int use_hash_index;
+extern int use_filter;
+extern int use_cache;
+
+void set_value (struct trie_node *node, const struct new_value *value);
 
-struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_address) {
+struct trie_node * new_leaf (const char *string, size_t strlen, const struct new_value *value) {
     struct trie_node *new_node = malloc(sizeof(struct trie_node));
     node_count++;
     if (!new_node) {
@@ -33,12 +130,77 @@ struct trie_node * new_leaf (const char *string, size_t strlen, int32_t ip4_addr
     new_node->strlen = strlen;
     strncpy(new_node->key, string, strlen);
     new_node->key[strlen] = '\0';
-    new_node->ip4_address = ip4_address;
+    rrset_init(&new_node->records);
+    new_node->indexed = NULL;
+    new_node->filtered = 0;
+    new_node->present = 0;
+    new_node->expires = 0;
+    new_node->negative = 0;
     new_node->children = NULL;
+    if (value)
+        set_value(new_node, value);
 
     return new_node;
 }
 
+/* Does this node hold a value that has not expired by tick now? */
+int live_value (struct trie_node *node, uint32_t now) {
+    return node->present && (node->expires == 0 || node->expires > now);
+}
+
+/* Does this node hold nothing at all, not even a negative entry? */
+int empty_node (struct trie_node *node) {
+    return !node->present && !node->negative;
+}
+
+/* Store a record or a negative entry, or clear the node if value
+ * is NULL, keeping negative_count in step.
+ */
+void set_value (struct trie_node *node, const struct new_value *value) {
+    int negative = value && value->negative;
+
+    negative_count += negative - node->negative;
+    node->negative = negative;
+
+    // Appending to a live set keeps its records and its TTL
+    if (!value || !value->append || !live_value(node, expiry_now())) {
+        rrset_clear(&node->records);
+        node->expires = value ? value->expires : 0;
+    }
+    if (value && value->record)
+        rrset_add(&node->records, value->record);
+    node->present = (node->records.count > 0);
+
+    // Index exactly the nodes that hold something
+    if (use_hash_index) {
+        if (!empty_node(node) && !node->indexed)
+            node->indexed = index_add(&name_index, value->name, value->name_len, node);
+        else if (empty_node(node) && node->indexed) {
+            index_remove(&name_index, node->indexed);
+            node->indexed = NULL;
+        }
+    }
+    if (use_filter) {
+        if (!empty_node(node) && !node->filtered) {
+            node->filter_hash = bloom_hash(value->name, value->name_len);
+            bloom_add(&filter, node->filter_hash);
+            node->filtered = 1;
+        } else if (empty_node(node) && node->filtered) {
+            bloom_remove(&filter, node->filter_hash);
+            node->filtered = 0;
+        }
+    }
+    if (use_cache)
+        cache_invalidate();
+}
+
+/* Would _delete remove what this node holds? */
+int deletable (struct trie_node *node, uint32_t expired_by, int negative) {
+    if (negative ? !node->negative : !node->present)
+        return 0;
+    return !expired_by || (node->expires && node->expires <= expired_by);
+}
+
 // Compare strings backward.  Unlike strncmp, we assume
 // that we will not stop at a null termination, only after
 // n chars (or a difference).  Base code borrowed from musl
@@ -96,6 +258,11 @@ void init(int numthreads) {
         printf("WARNING: This Trie is only safe to use with one thread!!!  You have %d!!!\n", numthreads);
 
     root = NULL;
+    expiry_init(&wheel);
+    expiry_queue_init(&negative_queue);
+    expiry_queue_init(&prune_queue);
+    bloom_init(&filter);
+    index_init(&name_index, 0);
 }
 
 void shutdown_delete_thread() {
@@ -148,23 +315,216 @@ _search (struct trie_node *node, const char *string, size_t strlen) {
 }
 
 
+/* Exact-match search, from the hash index if it is on.  The caller
+ * holds the trie's lock, which also covers the index.
+ */
+struct trie_node * find_exact (const char *string, size_t strlen) {
+    if (use_hash_index)
+        return index_find(&name_index, string, strlen, NULL, NULL);
+    return _search(root, string, strlen);
+}
+
 int search  (const char *string, size_t strlen, int32_t *ip4_address) {
+    return lookup(string, strlen, ip4_address) == LOOKUP_FOUND;
+}
+
+int lookup  (const char *string, size_t strlen, int32_t *ip4_address) {
     struct trie_node *found;
+    uint32_t now = expiry_now();
+    int res = LOOKUP_MISS;
+    int32_t ip = 0;
+    int has_a = 0;
+    uint32_t expires = 0;
+    unsigned long epoch = cache_epoch();
 
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
-    found = _search(root, string, strlen);
+    // Hot names are answered from this thread's cache, without locks
+    if (use_cache && cache_get(string, strlen, epoch, now, &res, ip4_address))
+        return res;
+
+    // Most absent names stop here, without any locks
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return LOOKUP_MISS;
+
+    found = find_exact(string, strlen);
+
+    if (found && live_value(found, now)) {
+        has_a = rrset_find_a(&found->records, &ip);
+        res = has_a ? LOOKUP_FOUND : LOOKUP_MISS;
+        expires = found->expires;
+    } else if (found && found->negative && found->expires > now) {
+        res = LOOKUP_NEGATIVE;
+        expires = found->expires;
+    }
 
-    if (found && ip4_address)
-        *ip4_address = found->ip4_address;
+    if (use_filter && res == LOOKUP_MISS)
+        bloom_false_positive(&filter);
+    if (use_cache)
+        cache_put(string, strlen, epoch, res, has_a, ip, expires);
+    if (ip4_address && has_a)
+        *ip4_address = ip;
+    return res;
+}
+
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg) {
+    struct trie_node *found;
+    int res = 0;
 
-    return (found != NULL);
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    if (use_filter && !bloom_maybe(&filter, bloom_hash(string, strlen)))
+        return 0;
+
+    found = find_exact(string, strlen);
+
+    if (found && live_value(found, expiry_now())) {
+        fn(&found->records, arg);
+        res = 1;
+    }
+    return res;
+}
+
+/* Recursive helper for search_longest_suffix.  Walks the same path
+ * as _search, remembering the deepest live value that ends on a
+ * label boundary.
+ */
+void
+_search_suffix (struct trie_node *node, const char *string, size_t strlen,
+        uint32_t now, struct suffix_match *match) {
+
+    int keylen, cmp;
+
+    // First things first, check if we are NULL 
+    if (node == NULL) return;
+
+    assert(node->strlen < MAX_KEY);
+
+    cmp = compare_keys_substring(node->key, node->strlen, string, strlen, &keylen);
+    if (cmp == 0) {
+        // This node is on the path unless its key is longer than the string
+        if (node->strlen > keylen)
+            return;
+        if (live_value(node, now) && (strlen == keylen || string[strlen - keylen - 1] == '.')) {
+            match->found = 1;
+            match->rest = strlen - keylen;
+            match->ip4_address = 0;
+            rrset_find_a(&node->records, &match->ip4_address);
+        }
+        if (strlen > keylen)
+            _search_suffix(node->children, string, strlen - keylen, now, match);
+    } else {
+        cmp = compare_keys(node->key, node->strlen, string, strlen, &keylen);
+        if (cmp < 0)
+            _search_suffix(node->next, string, strlen, now, match);
+    }
+}
+
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len) {
+    struct suffix_match match = { 0, 0, 0 };
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    _search_suffix(root, string, strlen, expiry_now(), &match);
+
+    if (match.found) {
+        if (ip4_address)
+            *ip4_address = match.ip4_address;
+        if (suffix_len)
+            *suffix_len = strlen - match.rest;
+    }
+    return match.found;
+}
+
+/* Recursive helper for cursor_next.  name is a MAX_KEY buffer whose
+ * last namelen bytes hold the full name of node's parent.  Walks node
+ * and its later siblings.  Returns 1 once the walk should stop.
+ */
+int _cursor_walk (struct trie_node *node, char *name, size_t namelen, uint32_t now,
+        struct trie_cursor *cursor, int *left,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+
+    for (; node; node = node->next) {
+        size_t strlen = namelen + node->strlen;
+        char *start = &name[MAX_KEY - strlen];
+        int want;
+
+        assert(strlen < MAX_KEY);
+        memcpy(start, node->key, node->strlen);
+        want = cursor_check(cursor, start, strlen);
+        if (want & CURSOR_STOP)
+            return 1;
+        if ((want & CURSOR_EMIT) && live_value(node, now)) {
+            fn(start, strlen, &node->records, arg);
+            cursor_advance(cursor, start, strlen);
+            if (--*left == 0)
+                return 1;
+        }
+        if ((want & CURSOR_DESCEND) && _cursor_walk(node->children, name, strlen, now, cursor, left, fn, arg))
+            return 1;
+    }
+    return 0;
+}
+
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg) {
+    char name[MAX_KEY];
+    int left = max;
+
+    if (cursor->done || max <= 0)
+        return 0;
+
+    _cursor_walk(root, name, 0, expiry_now(), cursor, &left, fn, arg);
+
+    // A page that isn't full means the walk ran out of names
+    if (left > 0)
+        cursor->done = 1;
+    return max - left;
+}
+
+int update (const char *string, size_t strlen, int32_t ip4_address) {
+    struct trie_node *found;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    found = find_exact(string, strlen);
+    if (!found || !live_value(found, expiry_now()) || !rrset_set_a(&found->records, ip4_address))
+        return 0;
+    if (use_cache)
+        cache_invalidate();
+    return 1;
+}
+
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address) {
+    struct trie_node *found;
+    int32_t ip;
+
+    // Skip strings of length 0
+    if (strlen == 0)
+        return 0;
+
+    found = find_exact(string, strlen);
+    if (!found || !live_value(found, expiry_now())
+            || !rrset_find_a(&found->records, &ip) || ip != expected)
+        return 0;
+    rrset_set_a(&found->records, ip4_address);
+    if (use_cache)
+        cache_invalidate();
+    return 1;
 }
 
 /* Recursive helper function */
-int _insert (const char *string, size_t strlen, int32_t ip4_address, 
+int _insert (const char *string, size_t strlen, const struct new_value *value,
         struct trie_node *node, struct trie_node *parent, struct trie_node *left) {
 
     int cmp, keylen;
@@ -186,7 +546,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
             assert(keylen == strlen);
             assert((!parent) || parent->children == node);
 
-            new_node = new_leaf (string, strlen, ip4_address);
+            new_node = new_leaf (string, strlen, value);
             node->strlen -= keylen;
             new_node->children = node;
             new_node->next = node->next;
@@ -207,18 +567,18 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
             if (node->children == NULL) {
                 // Insert leaf here
-                struct trie_node *new_node = new_leaf (string, strlen - keylen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen - keylen, value);
                 node->children = new_node;
                 return 1;
             } else {
                 // Recur on children list, store "parent" (loosely defined)
-                return _insert(string, strlen - keylen, ip4_address,
+                return _insert(string, strlen - keylen, value,
                         node->children, node, NULL);
             }
         } else {
             assert (strlen == keylen);
-            if (node->ip4_address == 0) {
-                node->ip4_address = ip4_address;
+            if (value->append || value->replace || !live_value(node, expiry_now())) {
+                set_value(node, value);
                 return 1;
             } else {
                 return 0;
@@ -241,7 +601,7 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
         if (overlap) {
             // Insert a common parent, recur
             int offset = strlen - keylen2;
-            struct trie_node *new_node = new_leaf (&string[offset], keylen2, 0);
+            struct trie_node *new_node = new_leaf (&string[offset], keylen2, NULL);
             assert ((node->strlen - keylen2) > 0);
             node->strlen -= keylen2;
             new_node->children = node;
@@ -260,23 +620,23 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
                 root = new_node;
             }
 
-            return _insert(string, offset, ip4_address,
+            return _insert(string, offset, value,
                     node, new_node, NULL);
         } else {
             cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
             if (cmp < 0) {
                 // No, recur right (the node's key is "less" than  the search key)
                 if (node->next)
-                    return _insert(string, strlen, ip4_address, node->next, NULL, node);
+                    return _insert(string, strlen, value, node->next, NULL, node);
                 else {
                     // Insert here
-                    struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                    struct trie_node *new_node = new_leaf (string, strlen, value);
                     node->next = new_node;
                     return 1;
                 }
             } else {
                 // Insert here
-                struct trie_node *new_node = new_leaf (string, strlen, ip4_address);
+                struct trie_node *new_node = new_leaf (string, strlen, value);
                 new_node->next = node;
                 if (node == root)
                     root = new_node;
@@ -292,28 +652,67 @@ int _insert (const char *string, size_t strlen, int32_t ip4_address,
 
 void assert_invariants();
 
+int insert_value (const char *string, size_t strlen, const struct new_value *value);
+
 int insert (const char *string, size_t strlen, int32_t ip4_address) {
+    return insert_ttl(string, strlen, ip4_address, 0);
+}
+
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int insert_negative (const char *string, size_t strlen) {
+    struct new_value value = { NULL, expiry_from_ttl(negative_ttl), 1, 0, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int insert_record (const char *string, size_t strlen, const struct record *record) {
+    struct new_value value = { record, 0, 0, 1, string, strlen };
+    return insert_value(string, strlen, &value);
+}
+
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl) {
+    struct record record = { .type = RR_A, .data.a = ip4_address };
+    struct new_value value = { &record, expiry_from_ttl(ttl), 0, 0, string, strlen, 1 };
+    return insert_value(string, strlen, &value);
+}
+
+/* Common code for inserting a value or a negative entry */
+int insert_value (const char *string, size_t strlen, const struct new_value *value) {
+    int res;
+
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
     /* Edge case: root is null */
     if (root == NULL) {
-        root = new_leaf (string, strlen, ip4_address);
-        return 1;
-    }
-    return _insert (string, strlen, ip4_address, root, NULL, NULL);
+        root = new_leaf (string, strlen, value);
+        res = 1;
+    } else
+        res = _insert(string, strlen, value, root, NULL, NULL);
+
+    if (res && value->negative)
+        expiry_queue_push(&negative_queue, string, strlen, value->expires);
+    else if (res)
+        expiry_add(&wheel, string, strlen, value->expires);
+    return res;
 }
 
 /* Recursive helper function.
  * Returns a pointer to the node if found.
  * Stores an optional pointer to the 
  * parent, or what should be the parent if not found.
- * 
+ * If expired_by is non-zero, only delete a value that 
+ * expired at or before that tick.  If negative is set,
+ * delete a negative entry instead of a value.
  */
 struct trie_node * 
 _delete (struct trie_node *node, const char *string, 
-        size_t strlen) {
+        size_t strlen, uint32_t expired_by, int negative) {
     int keylen, cmp;
 
     // First things first, check if we are NULL 
@@ -330,11 +729,11 @@ _delete (struct trie_node *node, const char *string,
         if (node->strlen > keylen) {
             return NULL;
         } else if (strlen > keylen) {
-            struct trie_node *found =  _delete(node->children, string, strlen - keylen);
+            struct trie_node *found =  _delete(node->children, string, strlen - keylen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->children == found);
                     node->children = found->next;
                     free(found);
@@ -342,7 +741,7 @@ _delete (struct trie_node *node, const char *string,
                 }
 
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -354,12 +753,16 @@ _delete (struct trie_node *node, const char *string,
         } else {
             assert (strlen == keylen);
 
-            /* We found it! Clear the ip4 address and return. */
-            if (node->ip4_address) {
-                node->ip4_address = 0;
-
+            /* We found it! Clear the records if we may, and report the
+             * node if that leaves it empty, so it (and any emptied
+             * ancestors) get unlinked.  The reaper only takes values that
+             * have really expired, since the name may have been
+             * re-inserted with a new TTL. */
+            if (deletable(node, expired_by, negative))
+                set_value(node, NULL);
+            if (empty_node(node)) {
                 /* Delete the root node if we empty the tree */
-                if (node == root && node->children == NULL && node->ip4_address == 0) {
+                if (node == root && node->children == NULL && empty_node(node)) {
                     root = node->next;
                     free(node);
                     node_count--;
@@ -371,7 +774,7 @@ _delete (struct trie_node *node, const char *string,
                 }
                 return node;
             } else {
-                /* Just an interior node with no value */
+                /* Still holds a value */
                 return NULL;
             }
         }
@@ -380,11 +783,11 @@ _delete (struct trie_node *node, const char *string,
         cmp = compare_keys (node->key, node->strlen, string, strlen, &keylen);
         if (cmp < 0) {
             // No, look right (the node's key is "less" than  the search key)
-            struct trie_node *found = _delete(node->next, string, strlen);
+            struct trie_node *found = _delete(node->next, string, strlen, expired_by, negative);
             if (found) {
                 /* If the node doesn't have children, delete it.
                  * Otherwise, keep it around to find the kids */
-                if (found->children == NULL && found->ip4_address == 0) {
+                if (found->children == NULL && empty_node(found)) {
                     assert(node->next == found);
                     node->next = found->next;
                     free(found);
@@ -402,20 +805,69 @@ _delete (struct trie_node *node, const char *string,
 }
 
 int delete  (const char *string, size_t strlen) {
+    struct trie_node *found;
+    int res = 0, prunable = 0;
+
     // Skip strings of length 0
     if (strlen == 0)
         return 0;
 
-    int res = (NULL != _delete(root, string, strlen));
+    /* Only clear the value.  The node stays linked as a tombstone,
+     * which searches already treat as a miss, until compact() gets
+     * to it. */
+    found = find_exact(string, strlen);
+    if (found && deletable(found, 0, 0)) {
+        set_value(found, NULL);
+        prunable = (found->children == NULL);
+        res = 1;
+    }
     assert_invariants();
+
+    if (prunable)
+        expiry_queue_push(&prune_queue, string, strlen, 0);
+    if (res)
+        waitq_wake(string, strlen);
     return res;
 }
 
+/* With no locks to take, a batch is just its operations in turn */
+int trie_apply_batch (struct trie_op *ops, int n) {
+    int i, done = 0;
+
+    for (i = 0; i < n; i++) {
+        struct trie_op *op = &ops[i];
+        switch (op->op) {
+            case TRIE_OP_LOOKUP:
+                op->res = lookup(op->name, op->strlen, &op->ip4_address);
+                break;
+            case TRIE_OP_INSERT:
+                op->res = insert_ttl(op->name, op->strlen, op->ip4_address, op->ttl);
+                break;
+            case TRIE_OP_INSERT_NEGATIVE:
+                op->res = insert_negative(op->name, op->strlen);
+                break;
+            case TRIE_OP_UPDATE:
+                op->res = update(op->name, op->strlen, op->ip4_address);
+                break;
+            case TRIE_OP_DELETE:
+                op->res = delete(op->name, op->strlen);
+                break;
+            case TRIE_OP_UPSERT:
+                op->res = upsert(op->name, op->strlen, op->ip4_address, op->ttl);
+                break;
+            default:
+                assert(0);
+        }
+        done += (op->res != 0);
+    }
+    return done;
+}
+
 /* Find one node to remove from the tree. 
  *  * Use any policy you like to select the node.
  *   */
 int drop_one_node() {
-    struct trie_node *node = root;
+    struct trie_node *node = root, *leaf;
     assert(node->key != NULL);
     int size = MAX_KEY-1;
     char key[size+1];
@@ -425,20 +877,97 @@ int drop_one_node() {
         size -= node->strlen;
         assert(size >= 0);
         memcpy(&key[size], node->key, node->strlen);
+        leaf = node;
     } while ((node = node->children));
     assert(node == NULL);
-    return (_delete(root, &key[size], strlen(&key[size])) != NULL);
+    int negative = leaf->negative;
+    if (_delete(root, &key[size], strlen(&key[size]), 0, negative) == NULL)
+        return 0;
+    if (!negative)
+        waitq_wake(&key[size], strlen(&key[size]));
+    return 1;
+}
+
+/* Drop the oldest negative entry.  Returns 0 if there are none. */
+int drop_one_negative() {
+    struct expiry_entry *entry;
+    int res = 0;
+
+    while (!res && (entry = expiry_queue_pop(&negative_queue, 0))) {
+        res = (_delete(root, entry->key, entry->strlen, 0, 1) != NULL);
+        free(entry);
+    }
+    return res;
+}
+
+/* Delete every name whose TTL has run out.  The wheel hands us
+ * just the names that came due, so the tree is never scanned.
+ */
+void reap_expired() {
+    uint32_t now = expiry_now();
+    struct expiry_entry *entry = expiry_advance(&wheel, now), *next;
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        if (_delete(root, entry->key, entry->strlen, now, 0))
+            waitq_wake(entry->key, entry->strlen);
+        free(entry);
+    }
+
+    // Negative entries all share one TTL, so their queue is in expiry order
+    while ((entry = expiry_queue_pop(&negative_queue, now))) {
+        _delete(root, entry->key, entry->strlen, now, 1);
+        free(entry);
+    }
+}
+/* Unlink the tombstones that deletes have left behind, up to
+ * COMPACT_BATCH of them per hold of the lock.
+ */
+void compact() {
+    struct expiry_entry *batch[COMPACT_BATCH];
+    int i, n;
+
+    do {
+        for (n = 0; n < COMPACT_BATCH && (batch[n] = expiry_queue_pop(&prune_queue, 0)); n++)
+            ;
+        if (n == 0)
+            break;
+        for (i = 0; i < n; i++) {
+            struct trie_node *node = _search(root, batch[i]->key, batch[i]->strlen);
+            // It may have been re-inserted, or unlinked along with another name
+            if (node && empty_node(node) && node->children == NULL)
+                _delete(root, batch[i]->key, batch[i]->strlen, 0, 0);
+        }
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    } while (n == COMPACT_BATCH);
+}
+
+
+/* Evict until there are at most nodes nodes and negatives negative
+ * entries.  check_max_nodes uses this trie's own budget; a caller that
+ * holds several shards to one budget passes a smaller one.
+ */
+void trim (int nodes, int negatives) {
+    while (negative_count > negatives && drop_one_negative())
+        ;
+    // Negative entries go first
+    while (node_count > nodes)
+        if (!drop_one_negative())
+            drop_one_node();
 }
 
 /* Check the total node count; see if we have exceeded a the max.
 */
 void check_max_nodes() {
-    while (node_count > max_count)
-        drop_one_node();
+    compact();
+    reap_expired();
+    trim(max_count, max_negative);
     assert(node_count <= max_count);
 }
 
 void delete_all_nodes() {
+    compact();
     while (node_count)
         drop_one_node();
     assert(node_count == 0);
@@ -450,8 +979,11 @@ int _print(struct trie_node *node, int depth, char lines[100], int count) {
         printf("└");
     else
         printf("├");
-    printf ("%.*s, IP %d, This %p, Next %p, Children %p\n",
-            node->strlen, node->key, node->ip4_address, node, node->next, node->children);
+    int32_t ip4_address = 0;
+    rrset_find_a(&node->records, &ip4_address);
+    printf ("%.*s, IP %d, Records %d%s, This %p, Next %p, Children %p\n",
+            node->strlen, node->key, ip4_address, node->records.count, node->negative ? " (negative)" : "",
+            node, node->next, node->children);
     if (node->children) {
         if (node->next)
             strcat(lines, "| ");
@@ -477,18 +1009,27 @@ void print() {
     assert(count == node_count);
 }
 
+void print_stats() {
+    if (use_filter)
+        printf ("Filter false positive rate %.4f\n", bloom_false_positive_rate(&filter));
+}
+
 int num_nodes() {
     return node_count;
 }
 
+int num_negative() {
+    return negative_count;
+}
+
 
 int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     int count = 1;
 
     int len = prefix_length + node->strlen;
     if (len > MAX_KEY) {
-        printf("key too long at node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+        printf("key too long at node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
         *error = 1;
         return count;
     }
@@ -496,8 +1037,8 @@ int _assert_invariants (struct trie_node *node, int prefix_length, int *error) {
     if (node->children) {
         count += _assert_invariants(node->children, len, error);
         if (*error) {
-            printf("Unwinding tree on error: node %p.  Key %.*s (%d), IP %d.  Next %p, Children %p\n", 
-                    node, node->strlen, node->key, node->strlen, node->ip4_address, node->next, node->children);
+            printf("Unwinding tree on error: node %p.  Key %.*s (%d), Records %d.  Next %p, Children %p\n", 
+                    node, node->strlen, node->key, node->strlen, node->records.count, node->next, node->children);
             return count;
         }
     }
@@ -0,0 +1,77 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "trie.h"
+
+/* The sequential trie's entry points, as built into shard-trie.o for
+ * the delegating and left-right tries.  They work on the trie that the
+ * calling thread last passed to shard_use, and, as with the sequential
+ * trie itself, nothing stops two threads from changing one trie at
+ * once.  See trie.h for what each one does.
+ */
+
+struct trie_state;
+
+/* A new, empty trie; shard_use it, then shard_init it. */
+struct trie_state * shard_new ();
+
+/* Make this thread's shard_* calls work on trie */
+void shard_use (struct trie_state *trie);
+
+void shard_init (int numthreads);
+int shard_insert (const char *string, size_t strlen, int32_t ip4_address);
+int shard_insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl);
+int shard_insert_negative (const char *string, size_t strlen);
+int shard_insert_record (const char *string, size_t strlen, const struct record *record);
+int shard_search (const char *string, size_t strlen, int32_t *ip4_address);
+int shard_lookup (const char *string, size_t strlen, int32_t *ip4_address);
+int shard_update (const char *string, size_t strlen, int32_t ip4_address);
+int shard_upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl);
+int shard_cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address);
+int shard_search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg);
+int shard_search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len);
+int shard_cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg);
+int shard_delete (const char *string, size_t strlen);
+int shard_apply_batch (struct trie_op *ops, int n);
+void shard_compact ();
+void shard_check_max_nodes ();
+void shard_shutdown_delete_thread ();
+void shard_print ();
+void shard_print_stats ();
+int shard_num_nodes ();
+int shard_num_negative ();
+void shard_trim (int nodes, int negatives);
+void shard_delete_all_nodes ();
+
+/* Compiling the sequential trie as a shard renames its definitions */
+#ifdef SHARDED
+#define init shard_init
+#define insert shard_insert
+#define insert_ttl shard_insert_ttl
+#define insert_negative shard_insert_negative
+#define insert_record shard_insert_record
+#define search shard_search
+#define lookup shard_lookup
+#define update shard_update
+#define upsert shard_upsert
+#define cas_value shard_cas_value
+#define search_records shard_search_records
+#define search_longest_suffix shard_search_longest_suffix
+#define cursor_next shard_cursor_next
+#define delete shard_delete
+#define trie_apply_batch shard_apply_batch
+#define compact shard_compact
+#define check_max_nodes shard_check_max_nodes
+#define shutdown_delete_thread shard_shutdown_delete_thread
+#define print shard_print
+#define print_stats shard_print_stats
+#define num_nodes shard_num_nodes
+#define num_negative shard_num_negative
+#define trim shard_trim
+#define delete_all_nodes shard_delete_all_nodes
+#endif
+
+#endif /* __SHARD_H__ */
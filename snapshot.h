@@ -0,0 +1,27 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "trie.h"
+
+/* Frozen views of the copy-on-write trie (cow-trie.c).  Taking a
+ * snapshot just pins the current version of the tree, so it costs the
+ * same however big the tree is, and writers carry on while it is held:
+ * they copy whatever they change, and the snapshot keeps the nodes it
+ * saw until it is released.
+ */
+
+struct trie_snapshot;
+
+/* Pin the tree as it is now */
+struct trie_snapshot * snapshot_take ();
+
+/* Call fn on every name that was live when the snapshot was taken, in
+ * the order cursor_next visits them.  Returns how many there were.
+ */
+int snapshot_walk (struct trie_snapshot *snap,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg);
+
+/* Let the writers free what only this snapshot still uses */
+void snapshot_release (struct trie_snapshot *snap);
+
+#endif /* __SNAPSHOT_H__ */
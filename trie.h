@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <stddef.h>
+#include "records.h"
 
 /* A simple (reverse) trie interface */
 
@@ -13,19 +15,120 @@
 /* Optional init routine.  May not be required. */
 void init (int numthreads);
 
-/* Return 1 on success, 0 on failure */
+/* Store a single A record.  Return 1 on success, 0 on failure
+ * (including if the name already holds a value).
+ */
 int insert (const char *string, size_t strlen, int32_t ip4_address);
 
-/* Return 1 if the key is found, 0 if not. 
+/* Like insert, but the name expires ttl seconds from now.  A ttl
+ * of 0 never expires.  Expired names are treated as absent right
+ * away, and are removed from the tree by check_max_nodes.
+ */
+int insert_ttl (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl);
+
+/* Return 1 if the key is found and holds an A record, 0 if not
+ * (a name holding only other types has no address to give).
  * If ip4_address is not NULL, store the IP 
- * here.  
+ * of the name's first A record here.  
  */
 int search  (const char *string, size_t strlen, int32_t *ip4_address);
 
+/* Change the address in the name's first A record, if the name
+ * holds a live one.  Unlike insert, this never changes the shape of
+ * the tree, so variants can do it under their read-side locks.
+ * Return 1 on success, 0 if the name has no live A record.
+ */
+int update (const char *string, size_t strlen, int32_t ip4_address);
+
+/* Leave the name holding just this A record and TTL, whether it was
+ * absent, expired, negative or live, in one walk down the tree.  This
+ * is how to refresh a record, rather than a delete and an insert.
+ * Return 1 on success, 0 on failure.
+ */
+int upsert (const char *string, size_t strlen, int32_t ip4_address, uint32_t ttl);
+
+/* Change the address in the name's first A record to ip4_address,
+ * but only if it is expected now.  Return 1 if it was changed, 0 if
+ * the name has no live A record or it held something else.
+ */
+int cas_value (const char *string, size_t strlen, int32_t expected, int32_t ip4_address);
+
+/* Add a record to the name's record set, creating the name if 
+ * needed.  Return 1 on success, 0 on failure.
+ */
+int insert_record (const char *string, size_t strlen, const struct record *record);
+
+/* Call fn on the name's record set in place, without copying it.
+ * The set is only valid, and only protected from concurrent changes,
+ * for the duration of the call; fn must not call back into the trie.
+ * Return 1 if the key is found (and fn was called), 0 if not.
+ */
+int search_records (const char *string, size_t strlen,
+        void (*fn) (const struct rrset *records, void *arg), void *arg);
+
+/* Find the most specific stored name that is a suffix of string on
+ * a label boundary (e.g. "example.com" for "a.b.example.com", but
+ * not "ample.com"), in one walk down the tree.  Return 1 if there is
+ * one, storing its first A record (if any) in ip4_address and its
+ * length in suffix_len; either may be NULL.  Return 0 if not.
+ */
+int search_longest_suffix (const char *string, size_t strlen,
+        int32_t *ip4_address, size_t *suffix_len);
+
+/* Results of lookup */
+#define LOOKUP_MISS     0
+#define LOOKUP_FOUND    1
+#define LOOKUP_NEGATIVE 2 /* A cached "known absent" answer */
+
+/* Like search, but also tells a plain miss apart from a name that
+ * holds a live negative entry.  LOOKUP_FOUND, as for search, means
+ * the name holds an A record, and it has been stored in ip4_address.
+ */
+int lookup  (const char *string, size_t strlen, int32_t *ip4_address);
+
+/* Cache the fact that a name does not exist.  Negative entries live
+ * for a short, fixed TTL, have their own budget, and are evicted
+ * before any positive entry.  Return 1 on success, 0 if the name
+ * holds a live value.
+ */
+int insert_negative (const char *string, size_t strlen);
+
+
+struct trie_cursor;
+
+/* Pass up to max more names from the cursor's walk (see cursor.h),
+ * in order, to fn along with their record sets.  As with
+ * search_records, fn runs under the trie's locks and must not call
+ * back into it.  Return how many names were passed; fewer than max
+ * means the walk is complete.
+ */
+int cursor_next (struct trie_cursor *cursor, int max,
+        void (*fn) (const char *name, size_t strlen, const struct rrset *records, void *arg), void *arg);
+
 
-/* Return 1 if the key is found and deleted, 0 if not. */
+/* Return 1 if the key is found and deleted, 0 if not.
+ * The value goes away at once, but the node is only unlinked
+ * later, by compact.
+ */
 int delete  (const char *string, size_t strlen);
 
+struct trie_op;
+
+/* Apply the n operations in ops (see async.h) in order, as one atomic
+ * change: no other call sees some of them done and not others.  Each
+ * op's res, and a lookup's ip4_address, are set as by the plain call.
+ * The variant's locks are taken once for the whole batch.  Return
+ * how many ops succeeded (res non-zero).
+ */
+int trie_apply_batch (struct trie_op *ops, int n);
+
+/* Unlink and free the nodes that deletes have emptied, in batches
+ * of COMPACT_BATCH names per hold of the lock.  check_max_nodes
+ * calls this before it does anything else.
+ */
+#define COMPACT_BATCH 32
+void compact ();
+
 /* Check the maximum node count.
  * If we have exceeded it, drop some nodes
  * to lower the count.
@@ -41,10 +144,16 @@ void shutdown_delete_thread ();
 void print (); 
 
 /* Determines whether to allow blocking until 
- * a name is available.
+ * a name is available.  If set, insert and insert_ttl of a name that
+ * holds a live value sleep (on the name's queue in waitq.h) until a
+ * delete or eviction frees it, rather than failing.  The sequential
+ * trie has no one else to free it, so it never blocks.
  */
 extern int allow_squatting;
 
+/* Print any lock and eviction statistics the variant collects. */
+void print_stats ();
+
 /* functions for testing in main */
 int num_nodes();
 void delete_all_nodes();
@@ -0,0 +1,92 @@
+/* Per-name wait queues for squatting inserts.  See waitq.h. */
+
+#include <stdint.h>
+#include <string.h>
+#include "waitq.h"
+
+static struct waitq_bucket buckets[WAITQ_BUCKETS];
+static volatile int sleepers = 0;  //Waiters in all buckets
+static volatile int closed = 0;
+
+static struct waitq_bucket * _waitq_bucket (const char *string, size_t strlen) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < strlen; i++) {
+        hash ^= (unsigned char) string[i];
+        hash *= 16777619;
+    }
+    return &buckets[hash % WAITQ_BUCKETS];
+}
+
+/* A waiter joins its bucket before it tries again, and a waker frees
+ * the name before it counts sleepers, each with a full barrier in
+ * between.  So either the retry sees the name free, or the waker sees
+ * the waiter and wakes it.
+ */
+int waitq_until (const char *name, size_t strlen, int (*try) (void *), void *arg) {
+    struct waitq_bucket *bucket;
+    struct waitq_waiter me = { name, strlen, 0, NULL }, **link;
+    int res;
+
+    // Most names are free, and cost nothing more than the try
+    if ((res = try(arg)) || closed)
+        return res;
+
+    bucket = _waitq_bucket(name, strlen);
+    wordlock_lock(&bucket->lock);
+    me.next = bucket->waiters;
+    bucket->waiters = &me;
+    __sync_fetch_and_add(&sleepers, 1);
+    wordlock_unlock(&bucket->lock);
+
+    while (1) {
+        me.woken = 0;
+        __sync_synchronize();
+        if ((res = try(arg)) || closed)
+            break;
+        while (!me.woken)
+            futex_wait(&me.woken, 0);
+    }
+
+    wordlock_lock(&bucket->lock);
+    for (link = &bucket->waiters; *link != &me; link = &(*link)->next)
+        ;
+    *link = me.next;
+    __sync_fetch_and_sub(&sleepers, 1);
+    wordlock_unlock(&bucket->lock);
+    return res;
+}
+
+void waitq_wake (const char *name, size_t strlen) {
+    struct waitq_bucket *bucket;
+    struct waitq_waiter *waiter;
+
+    __sync_synchronize();
+    if (!sleepers)
+        return;
+
+    bucket = _waitq_bucket(name, strlen);
+    wordlock_lock(&bucket->lock);
+    for (waiter = bucket->waiters; waiter; waiter = waiter->next)
+        if (waiter->strlen == strlen && memcmp(waiter->name, name, strlen) == 0) {
+            waiter->woken = 1;
+            futex_wake(&waiter->woken, 1);
+        }
+    wordlock_unlock(&bucket->lock);
+}
+
+void waitq_shutdown () {
+    struct waitq_waiter *waiter;
+    int i;
+
+    closed = 1;
+    __sync_synchronize();
+    for (i = 0; i < WAITQ_BUCKETS; i++) {
+        wordlock_lock(&buckets[i].lock);
+        for (waiter = buckets[i].waiters; waiter; waiter = waiter->next) {
+            waiter->woken = 1;
+            futex_wake(&waiter->woken, 1);
+        }
+        wordlock_unlock(&buckets[i].lock);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __WAITQ_H__
+#define __WAITQ_H__
+
+#include <stddef.h>
+#include "locks.h"
+
+/* Per-name wait queues, for squatting inserts (allow_squatting): an
+ * insert of a name that is taken sleeps until a delete or eviction
+ * frees that name, and then tries again.
+ *
+ * Waiters hang off a fixed table of buckets, hashed by name.  Each
+ * sleeps on a word of its own, and a wake only sets the words of the
+ * waiters on the freed name, so names that share a bucket don't wake
+ * each other.  While nobody waits, waitq_wake is one load.
+ */
+
+#define WAITQ_BUCKETS 256
+
+struct waitq_waiter {
+    const char *name;
+    size_t strlen;
+    volatile int woken;
+    struct waitq_waiter *next;
+};
+
+struct waitq_bucket {
+    struct wordlock lock;
+    struct waitq_waiter *waiters;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Call try(arg) until it returns non-zero, sleeping on name's queue
+ * between tries, and return what it returned.  Returns 0 once
+ * waitq_shutdown has been called.
+ */
+int waitq_until (const char *name, size_t strlen, int (*try) (void *), void *arg);
+
+/* Wake whoever waits on name.  Call after the name is freed. */
+void waitq_wake (const char *name, size_t strlen);
+
+/* Wake every waiter for good, so clients can finish */
+void waitq_shutdown ();
+
+#endif /* __WAITQ_H__ */
@@ -0,0 +1,29 @@
+#ifndef __ZONE_H__
+#define __ZONE_H__
+
+#include "trie.h"
+
+/* Whole-zone reloads, for the copy-on-write trie (cow-trie.c) and the
+ * mutex and rw tries.
+ */
+
+/* One name in a new zone */
+struct zone_name {
+    const char *name;
+    size_t strlen;
+    int32_t ip4_address;
+    uint32_t ttl; /* Seconds, 0 = never expires */
+};
+
+/* Replace every name in the trie with the n names in zone.  The new
+ * tree is built off to the side, without holding up readers, and then
+ * takes the old one's place all at once: readers see either the old
+ * zone or the new one, never a mix, and the old tree is freed once the
+ * last of them is done with it.  Writers wait from the start of the
+ * build to the swap, so each change lands either before the reload,
+ * and is replaced with the rest of the old zone, or after it.  Returns
+ * how many names were loaded.
+ */
+int reload (const struct zone_name *zone, int n);
+
+#endif /* __ZONE_H__ */